@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include "admission.h"
+#include "log.h"
+
+/* binds the calling thread to the given cpus of the gate, or to all of them */
+static int bind_thread(const AdmissionGate *gate, const int *indices, int nb_indices)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < nb_indices; i++)
+        CPU_SET(gate->cpus[indices ? indices[i] : i], &set);
+    return AVERROR(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+}
+
+int admission_init(AdmissionGate *gate, int budget, int pin)
+{
+    cpu_set_t set;
+
+    memset(gate, 0, sizeof(*gate));
+    gate->budget = gate->free_cores = budget > 0 ? budget : av_cpu_count();
+
+    if (pin) {
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) {
+            log_warning("admission: cannot read the cpu affinity, not pinning");
+        } else if (CPU_COUNT(&set) < gate->budget) {
+            log_warning("admission: a budget of %d cores cannot be pinned on %d cpus, not pinning",
+                        gate->budget, CPU_COUNT(&set));
+        } else {
+            gate->cpus = av_malloc_array(CPU_COUNT(&set), sizeof(*gate->cpus));
+            gate->taken = av_mallocz(CPU_COUNT(&set));
+            if (!gate->cpus || !gate->taken) {
+                av_freep(&gate->cpus);
+                av_freep(&gate->taken);
+                return AVERROR(ENOMEM);
+            }
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                    gate->cpus[gate->nb_cpus++] = cpu;
+            gate->pin = 1;
+        }
+    }
+
+    pthread_mutex_init(&gate->lock, NULL);
+    pthread_cond_init(&gate->cores_freed, NULL);
+    return 0;
+}
+
+int admission_acquire(AdmissionGate *gate, int cores, AdmissionGrant *grant)
+{
+    uint64_t ticket;
+    int ret;
+
+    memset(grant, 0, sizeof(*grant));
+    cores = av_clip(cores, 1, gate->budget);
+    if (gate->pin && !(grant->cpus = av_malloc_array(cores, sizeof(*grant->cpus))))
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&gate->lock);
+    ticket = gate->next_ticket++;
+    while (ticket != gate->now_serving || gate->free_cores < cores)
+        pthread_cond_wait(&gate->cores_freed, &gate->lock);
+    gate->free_cores -= cores;
+    gate->now_serving++;
+    if (gate->pin) {
+        /* the budget is within nb_cpus, so there are always enough free ones */
+        for (int cpu = 0, n = 0; n < cores; cpu++)
+            if (!gate->taken[cpu]) {
+                gate->taken[cpu] = 1;
+                grant->cpus[n++] = cpu;
+            }
+    }
+    /* the next in line may fit as well */
+    pthread_cond_broadcast(&gate->cores_freed);
+    pthread_mutex_unlock(&gate->lock);
+
+    grant->cores = cores;
+    if (gate->pin) {
+        if ((ret = bind_thread(gate, grant->cpus, cores)) < 0)
+            log_warning("admission: cannot pin to %d cores (%s)", cores, av_err2str(ret));
+        else
+            grant->pinned = 1;
+    }
+    return cores;
+}
+
+void admission_release(AdmissionGate *gate, AdmissionGrant *grant)
+{
+    if (grant->pinned)
+        bind_thread(gate, NULL, gate->nb_cpus);
+
+    pthread_mutex_lock(&gate->lock);
+    gate->free_cores += grant->cores;
+    if (grant->cpus)
+        for (int i = 0; i < grant->cores; i++)
+            gate->taken[grant->cpus[i]] = 0;
+    pthread_cond_broadcast(&gate->cores_freed);
+    pthread_mutex_unlock(&gate->lock);
+
+    av_freep(&grant->cpus);
+    grant->cores = 0;
+    grant->pinned = 0;
+}
+
+void admission_destroy(AdmissionGate *gate)
+{
+    pthread_mutex_destroy(&gate->lock);
+    pthread_cond_destroy(&gate->cores_freed);
+    av_freep(&gate->cpus);
+    av_freep(&gate->taken);
+}
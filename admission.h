@@ -0,0 +1,48 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Core budget shared by jobs that run side by side. A job asks for a number
+ * of cores and waits until that many are free, strictly in arrival order so
+ * a big job is not starved by small ones, and the jobs admitted together
+ * never ask for more than the budget. With pinning every admitted job gets
+ * cores of its own: the thread that runs it is bound to them, and every
+ * thread it starts, codec threads included, inherits that.
+ */
+typedef struct AdmissionGate
+{
+    int budget;
+    int free_cores;
+    uint64_t next_ticket, now_serving;
+    pthread_mutex_t lock;
+    pthread_cond_t cores_freed;
+
+    int pin;
+    int *cpus;              /* the process may run on these, with pinning */
+    unsigned char *taken;   /* per entry of cpus */
+    int nb_cpus;
+} AdmissionGate;
+
+/* the cores one admitted job holds */
+typedef struct AdmissionGrant
+{
+    int cores;
+    int *cpus;              /* indices into the gate's cpus, with pinning */
+    int pinned;             /* the calling thread was bound to them */
+} AdmissionGrant;
+
+/* budget <= 0 takes every core; pinning needs no more cores than the machine has */
+int admission_init(AdmissionGate *gate, int budget, int pin);
+/*
+ * Blocks until cores are free, in turn, and takes them; a request over the
+ * budget is cut down to it. With pinning, also binds the calling thread.
+ */
+int admission_acquire(AdmissionGate *gate, int cores, AdmissionGrant *grant);
+/* hands the cores back and unbinds the calling thread, the one that acquired them */
+void admission_release(AdmissionGate *gate, AdmissionGrant *grant);
+void admission_destroy(AdmissionGate *gate);
+
+#endif
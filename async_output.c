@@ -0,0 +1,399 @@
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "async_output.h"
+#include "log.h"
+
+/* what one write from the muxer hands over at most */
+#define ASYNC_OUTPUT_BUFFER_SIZE (256 * 1024)
+/* queued and not written yet; past this the muxer waits for the disk after all */
+#define ASYNC_OUTPUT_MAX_BUFFERED (64 * 1024 * 1024)
+
+typedef struct AsyncRequest AsyncRequest;
+
+typedef struct AsyncFile
+{
+    AsyncOutput *output;
+    char *filename;
+    char *temporary;        /* written under this name, renamed to filename once done */
+    int fd;
+    int publish;            /* a ".tmp" name the muxer renames itself is left alone */
+    int64_t position, size;
+    /* allocated with the file, so that closing it can always be queued behind its writes */
+    AsyncRequest *close_request;
+
+    /* under the output's lock */
+    int error;
+    int done;               /* the I/O thread is through with it */
+    int waited;             /* the closer waits for done and frees it */
+} AsyncFile;
+
+struct AsyncRequest
+{
+    AsyncRequest *next;
+    AsyncFile *file;
+    int64_t offset;
+    size_t size;            /* 0: the file was closed */
+    uint8_t data[];
+};
+
+struct AsyncOutput
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      /* a request came in, or stopping */
+    pthread_cond_t written;     /* a request went out */
+    AsyncRequest *head, *tail;
+    int64_t buffered;
+    int stopping;
+    int cancelled;
+    int error;                  /* first failed write or rename */
+
+    /* the muxer's own, for what is not a local file written */
+    int (*io_open)(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    void (*io_close)(AVFormatContext *s, AVIOContext *pb);
+
+    int64_t nb_bytes, nb_files, nb_waits, max_buffered;
+};
+
+static int write_all(int fd, const uint8_t *data, size_t size, int64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void free_file(AsyncFile *file)
+{
+    av_free(file->filename);
+    av_free(file->temporary);
+    av_free(file->close_request);
+    av_free(file);
+}
+
+/* closes the file and renames it into place, or deletes it when it is not whole */
+static int finish_file(AsyncFile *file, int error, int cancelled)
+{
+    if (close(file->fd) < 0 && !error)
+        error = AVERROR(errno);
+    if (error || cancelled) {
+        unlink(file->temporary);
+        return error;
+    }
+    if (file->publish && rename(file->temporary, file->filename) < 0) {
+        error = AVERROR(errno);
+        unlink(file->temporary);
+    }
+    return error;
+}
+
+static void *io_thread_main(void *arg)
+{
+    AsyncOutput *output = arg;
+
+    pthread_mutex_lock(&output->lock);
+    for (;;) {
+        AsyncRequest *request;
+        AsyncFile *file;
+        int error, cancelled, ret;
+
+        while (!output->head && !output->stopping)
+            pthread_cond_wait(&output->queued, &output->lock);
+        if (!(request = output->head))
+            break;
+        if (!(output->head = request->next))
+            output->tail = NULL;
+        file = request->file;
+        error = file->error;
+        cancelled = output->cancelled;
+        pthread_mutex_unlock(&output->lock);
+
+        if (request->size > 0)
+            ret = error ? error : write_all(file->fd, request->data, request->size, request->offset);
+        else
+            ret = finish_file(file, error, cancelled);
+        if (ret < 0 && !error)
+            log_error("async output: %s: %s", file->filename, av_err2str(ret));
+
+        pthread_mutex_lock(&output->lock);
+        output->buffered -= request->size;
+        output->nb_bytes += request->size;
+        if (ret < 0) {
+            file->error = ret;
+            if (!output->error)
+                output->error = ret;
+        }
+        if (!request->size) {
+            file->done = 1;
+            if (!file->waited)
+                free_file(file);
+        }
+        pthread_cond_broadcast(&output->written);
+        av_free(request);
+    }
+    pthread_mutex_unlock(&output->lock);
+    return NULL;
+}
+
+/* hands request over to the I/O thread, once there is room for it */
+static int push_request(AsyncOutput *output, AsyncRequest *request)
+{
+    int64_t size = request->size;
+    int ret;
+
+    pthread_mutex_lock(&output->lock);
+    if (output->buffered > 0 && output->buffered + size > ASYNC_OUTPUT_MAX_BUFFERED)
+        output->nb_waits++;
+    while (output->buffered > 0 && output->buffered + size > ASYNC_OUTPUT_MAX_BUFFERED)
+        pthread_cond_wait(&output->written, &output->lock);
+    /* a close still goes through so the file gets cleaned up */
+    if ((ret = output->error) < 0 && size > 0) {
+        pthread_mutex_unlock(&output->lock);
+        av_free(request);
+        return ret;
+    }
+    if (output->tail)
+        output->tail->next = request;
+    else
+        output->head = request;
+    output->tail = request;
+    output->buffered += size;
+    output->max_buffered = FFMAX(output->max_buffered, output->buffered);
+    pthread_cond_signal(&output->queued);
+    pthread_mutex_unlock(&output->lock);
+    return 0;
+}
+
+static int queue_request(AsyncOutput *output, AsyncFile *file, const uint8_t *data, int size)
+{
+    AsyncRequest *request = av_malloc(sizeof(*request) + size);
+
+    if (!request)
+        return AVERROR(ENOMEM);
+    request->next = NULL;
+    request->file = file;
+    request->offset = file->position;
+    request->size = size;
+    memcpy(request->data, data, size);
+    return push_request(output, request);
+}
+
+static int write_packet(void *opaque, uint8_t *buffer, int buffer_size)
+{
+    AsyncFile *file = opaque;
+    int ret;
+
+    if ((ret = queue_request(file->output, file, buffer, buffer_size)) < 0)
+        return ret;
+    file->position += buffer_size;
+    file->size = FFMAX(file->size, file->position);
+    return buffer_size;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence)
+{
+    AsyncFile *file = opaque;
+    int64_t position;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return file->size;
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = file->position + offset;
+        break;
+    case SEEK_END:
+        position = file->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (position < 0)
+        return AVERROR(EINVAL);
+    file->position = position;
+    return position;
+}
+
+int async_output_init(AsyncOutput **output)
+{
+    AsyncOutput *o = av_mallocz(sizeof(*o));
+    int ret;
+
+    if (!o)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->queued, NULL);
+    pthread_cond_init(&o->written, NULL);
+    if ((ret = pthread_create(&o->thread, NULL, io_thread_main, o))) {
+        pthread_mutex_destroy(&o->lock);
+        pthread_cond_destroy(&o->queued);
+        pthread_cond_destroy(&o->written);
+        av_free(o);
+        return AVERROR(ret);
+    }
+    *output = o;
+    return 0;
+}
+
+int async_output_open(AsyncOutput *output, AVIOContext **pb, const char *filename)
+{
+    AsyncFile *file;
+    uint8_t *buffer = NULL;
+    const char *extension = strrchr(filename, '.');
+    int ret;
+
+    av_strstart(filename, "file:", &filename);
+    if (!(file = av_mallocz(sizeof(*file))))
+        return AVERROR(ENOMEM);
+    file->output = output;
+    file->fd = -1;
+    file->publish = !extension || strcmp(extension, ".tmp");
+    file->filename = av_strdup(filename);
+    file->temporary = file->publish ? av_asprintf("%s.tmp", filename) : av_strdup(filename);
+    file->close_request = av_mallocz(sizeof(*file->close_request));
+    if (!file->filename || !file->temporary || !file->close_request ||
+        !(buffer = av_malloc(ASYNC_OUTPUT_BUFFER_SIZE))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((file->fd = open(file->temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        ret = AVERROR(errno);
+        log_error("Cannot open %s", file->temporary);
+        goto fail;
+    }
+    if (!(*pb = avio_alloc_context(buffer, ASYNC_OUTPUT_BUFFER_SIZE, 1, file, NULL, write_packet, seek))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    pthread_mutex_lock(&output->lock);
+    output->nb_files++;
+    pthread_mutex_unlock(&output->lock);
+    return 0;
+
+fail:
+    if (file->fd >= 0) {
+        close(file->fd);
+        unlink(file->temporary);
+    }
+    av_free(buffer);
+    free_file(file);
+    return ret;
+}
+
+void async_output_close(AVIOContext **pb)
+{
+    AsyncFile *file;
+    AsyncOutput *output;
+    AsyncRequest *request;
+
+    if (!*pb)
+        return;
+    if ((*pb)->write_packet != write_packet) {
+        avio_closep(pb);
+        return;
+    }
+    file = (*pb)->opaque;
+    output = file->output;
+
+    avio_flush(*pb);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    /* the muxer renames its ".tmp" files right after closing them, so they have to be written by then */
+    file->waited = !file->publish;
+    /* the I/O thread frees the file once through with it, unless waited for */
+    request = file->close_request;
+    file->close_request = NULL;
+    request->file = file;
+    request->offset = file->position;
+    push_request(output, request);
+    if (file->waited) {
+        pthread_mutex_lock(&output->lock);
+        while (!file->done)
+            pthread_cond_wait(&output->written, &output->lock);
+        pthread_mutex_unlock(&output->lock);
+        free_file(file);
+    }
+}
+
+static int io_open(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options)
+{
+    AsyncOutput *output = s->opaque;
+
+    if ((flags & AVIO_FLAG_READ) || (strstr(url, "://") && !av_strstart(url, "file:", NULL)))
+        return output->io_open(s, pb, url, flags, options);
+    return async_output_open(output, pb, url);
+}
+
+static void io_close(AVFormatContext *s, AVIOContext *pb)
+{
+    AsyncOutput *output = s->opaque;
+
+    if (pb && pb->write_packet == write_packet)
+        async_output_close(&pb);
+    else
+        output->io_close(s, pb);
+}
+
+void async_output_attach(AsyncOutput *output, AVFormatContext *format_context)
+{
+    /* every muxer context starts out with the same defaults */
+    if (!output->io_open) {
+        output->io_open = format_context->io_open;
+        output->io_close = format_context->io_close;
+    }
+    format_context->opaque = output;
+    format_context->io_open = io_open;
+    format_context->io_close = io_close;
+}
+
+void async_output_cancel(AsyncOutput *output)
+{
+    pthread_mutex_lock(&output->lock);
+    output->cancelled = 1;
+    pthread_mutex_unlock(&output->lock);
+}
+
+int async_output_free(AsyncOutput **output)
+{
+    AsyncOutput *o = *output;
+    int ret;
+
+    if (!o)
+        return 0;
+    pthread_mutex_lock(&o->lock);
+    o->stopping = 1;
+    pthread_cond_signal(&o->queued);
+    pthread_mutex_unlock(&o->lock);
+    pthread_join(o->thread, NULL);
+
+    log_debug("async output: %"PRId64" files, %"PRId64" bytes, %"PRId64" KB queued at most, "
+              "%"PRId64" waits for the disk", o->nb_files, o->nb_bytes, o->max_buffered / 1024, o->nb_waits);
+    ret = o->error;
+    pthread_mutex_destroy(&o->lock);
+    pthread_cond_destroy(&o->queued);
+    pthread_cond_destroy(&o->written);
+    av_freep(output);
+    return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef ASYNC_OUTPUT_H
+#define ASYNC_OUTPUT_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Output files written by a background thread. A write from the muxer only
+ * copies the AVIO buffer into memory and queues it; the I/O thread pwrite()s
+ * it at its offset (muxers seek back to patch headers), so muxing waits for
+ * storage only once more than ASYNC_OUTPUT_MAX_BUFFERED bytes are queued.
+ * Each file is written as "<name>.tmp" and renamed to its name once closed
+ * and written out, so readers see a segment or playlist whole or not at all.
+ * The thread takes files in the order they were closed: a playlist never
+ * shows up before the segments it lists.
+ */
+typedef struct AsyncOutput AsyncOutput;
+
+int async_output_init(AsyncOutput **output);
+/* as avio_open for writing */
+int async_output_open(AsyncOutput *output, AVIOContext **pb, const char *filename);
+/* for pbs of async_output_open or of an attached muxer; anything else goes to avio_closep */
+void async_output_close(AVIOContext **pb);
+/*
+ * Takes over io_open/io_close of a muxer, so the files it opens itself,
+ * segments and playlists, are written the same way. Files the muxer reads
+ * and non-local URLs still go through its own callbacks.
+ */
+void async_output_attach(AsyncOutput *output, AVFormatContext *format_context);
+/* after a failed run: files not renamed yet are deleted instead */
+void async_output_cancel(AsyncOutput *output);
+/* waits until everything queued is written, then stops; returns the first write error */
+int async_output_free(AsyncOutput **output);
+
+#endif
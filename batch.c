@@ -0,0 +1,106 @@
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include "batch.h"
+#include "log.h"
+#include "percentile.h"
+#include "work_pool.h"
+
+/* waits for the cores the job is estimated to need and sets them as its quota */
+static int admit(BatchJob *job, AdmissionGrant *grant)
+{
+    TranscodeEstimate *estimate = &job->estimate;
+    int ret;
+
+    if ((ret = transcode_job_estimate(job->job, estimate)) < 0)
+        log_warning("batch: cannot estimate %s (%s), asking for one core", job->name, av_err2str(ret));
+    if ((ret = admission_acquire(job->gate, ceil(estimate->load), grant)) < 0)
+        return ret;
+    job->cores = ret;
+    transcode_job_set_core_quota(job->job, job->cores);
+    log_debug("batch: %s, %dx%d %.2f fps %s, %.1f s, load %.1f cores, %.0f core-seconds: %d cores%s",
+              job->name, estimate->width, estimate->height, estimate->frame_rate,
+              estimate->codec_name ? estimate->codec_name : "no video", estimate->duration,
+              estimate->load, estimate->work, job->cores, grant->pinned ? ", pinned" : "");
+    return 0;
+}
+
+static void run_batch_job(void *arg, int worker)
+{
+    BatchJob *job = arg;
+    AdmissionGrant grant = { 0 };
+
+    job->worker = worker;
+    if (job->gate && (job->ret = admit(job, &grant)) < 0) {
+        job->started = job->finished = av_gettime_relative();
+        log_error("batch: %s not admitted (%s)", job->name, av_err2str(job->ret));
+        return;
+    }
+    job->started = av_gettime_relative();
+    job->ret = transcode_job_run(job->job);
+    job->finished = av_gettime_relative();
+    if (job->gate)
+        admission_release(job->gate, &grant);
+
+    if (job->ret < 0)
+        log_error("batch: %s failed (%s) on worker %d after %.1f s", job->name, av_err2str(job->ret),
+                  worker, (job->finished - job->started) / 1e6);
+    else
+        log_info("batch: %s done on worker %d, %.1f s running, %.1f s queued", job->name, worker,
+                 (job->finished - job->started) / 1e6, (job->started - job->queued) / 1e6);
+}
+
+int batch_run(BatchJob *jobs, int nb_jobs, int nb_workers, AdmissionGate *gate)
+{
+    WorkPool pool;
+    int64_t started, wall, stolen, *latencies;
+    int failures = 0;
+    int ret;
+
+    if (nb_jobs <= 0)
+        return 0;
+    if (!(latencies = av_malloc_array(nb_jobs, sizeof(*latencies))))
+        return AVERROR(ENOMEM);
+    if ((ret = work_pool_init(&pool, nb_workers)) < 0) {
+        log_error("batch: cannot start %d workers (%s)", nb_workers, av_err2str(ret));
+        av_free(latencies);
+        return ret;
+    }
+    if (gate)
+        log_info("batch: %d jobs on %d workers, %d cores to admit them to%s", nb_jobs, nb_workers,
+                 gate->budget, gate->pin ? ", pinned" : "");
+    else
+        log_info("batch: %d jobs on %d workers", nb_jobs, nb_workers);
+
+    started = av_gettime_relative();
+    for (int i = 0; i < nb_jobs; i++) {
+        jobs[i].queued = started;
+        jobs[i].started = jobs[i].finished = started;
+        jobs[i].worker = -1;
+        jobs[i].gate = gate;
+        jobs[i].cores = 0;
+        if ((jobs[i].ret = work_pool_submit(&pool, run_batch_job, &jobs[i])) < 0)
+            log_error("batch: cannot queue %s (%s)", jobs[i].name, av_err2str(jobs[i].ret));
+    }
+    work_pool_wait(&pool);
+    wall = av_gettime_relative() - started;
+    stolen = atomic_load(&pool.stolen);
+    work_pool_destroy(&pool);
+
+    for (int i = 0; i < nb_jobs; i++) {
+        latencies[i] = jobs[i].finished - jobs[i].queued;
+        failures += jobs[i].ret < 0;
+    }
+    percentile_sort(latencies, nb_jobs);
+
+    log_info("batch: %d clips, %d failed, %.1f s, %.1f clips/hour, latency p50 %.1f s p99 %.1f s max %.1f s, "
+             "%"PRId64" steals", nb_jobs, failures, wall / 1e6, nb_jobs * 3600e6 / FFMAX(wall, 1),
+             percentile(latencies, nb_jobs, 50) / 1e6, percentile(latencies, nb_jobs, 99) / 1e6,
+             percentile(latencies, nb_jobs, 100) / 1e6, stolen);
+    av_free(latencies);
+    return failures;
+}
@@ -0,0 +1,38 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "admission.h"
+#include "transcode.h"
+
+/* one configured transcode of a batch, the times are filled in by batch_run */
+typedef struct BatchJob
+{
+    TranscodeJob *job;
+    const char *name;       /* for the log, usually the input */
+    int64_t queued, started, finished;  /* av_gettime_relative() */
+    int worker;
+    int ret;
+
+    AdmissionGate *gate;    /* set by batch_run */
+    TranscodeEstimate estimate;
+    int cores;              /* quota it was admitted with, 0 without a gate */
+} BatchJob;
+
+/*
+ * Runs every job on one work-stealing pool of nb_workers threads, so many
+ * short clips keep the machine busy without a process per clip. Logs a line
+ * per finished job and a summary with the throughput in clips per hour and
+ * the p50/p99 job latency, queueing included.
+ *
+ * With a gate, every job is first estimated from its input headers and then
+ * waits for as many cores as it keeps busy at real time; it runs with that
+ * quota as its thread counts. The workers then only bound how many jobs are
+ * in flight, the gate keeps the cores from being oversubscribed.
+ *
+ * Returns the number of jobs that failed, or a negative AVERROR when the
+ * pool cannot be started.
+ */
+int batch_run(BatchJob *jobs, int nb_jobs, int nb_workers, AdmissionGate *gate);
+
+#endif
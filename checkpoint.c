@@ -0,0 +1,301 @@
+#include <libavutil/avutil.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "log.h"
+
+#define CHECKPOINT_VERSION 1
+/* how far the playlist's rounded durations may put a segment start from its keyframe */
+#define CHECKPOINT_TOLERANCE 5000
+/*
+ * The muxer times the first segment from whichever stream's packet came
+ * first, so the first segment start of a run is only known to be the
+ * keyframe nearest to where its durations point.
+ */
+#define CHECKPOINT_FIRST_TOLERANCE 500000
+
+struct Checkpoint
+{
+    char playlist[1024];
+    char state[1040];
+    char settings[256];
+    int64_t input_size, input_mtime_ns;
+
+    int reference;          /* output stream the muxer cuts on: the first video one, -1 until known */
+    int nb_segments;        /* in the last checkpoint, or listed when this run started */
+    int64_t segment_start;  /* AV_TIME_BASE, of the segment after those: its keyframe once a checkpoint
+                               was written, the first reference packet of the run before */
+    int checkpointed;       /* segment_start is a keyframe */
+    int64_t *keyframes;     /* reference keyframes muxed since segment_start */
+    int nb_keyframes, keyframes_size;
+
+    off_t playlist_size;
+    int64_t playlist_mtime_ns;
+};
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* the segments the playlist lists, and the duration of those from the first'th on */
+static int scan_playlist(const char *filename, int first, int *nb_segments, double *duration)
+{
+    FILE *playlist = fopen(filename, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+
+    if (!playlist)
+        return AVERROR(errno);
+    *nb_segments = 0;
+    *duration = 0;
+    while (getline(&line, &line_size, playlist) >= 0)
+        if (!strncmp(line, "#EXTINF:", 8)) {
+            if (*nb_segments >= first)
+                *duration += strtod(line + 8, NULL);
+            (*nb_segments)++;
+        }
+    free(line);
+    fclose(playlist);
+    return 0;
+}
+
+/* keeps the header and the first nb_segments segments, drops what follows and the end tag */
+static int truncate_playlist(const char *filename, int nb_segments)
+{
+    char temporary[1040];
+    FILE *playlist, *truncated;
+    char *line = NULL;
+    size_t line_size = 0;
+    int kept = 0;
+
+    if (!(playlist = fopen(filename, "r")))
+        return AVERROR(errno);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    if (!(truncated = fopen(temporary, "w"))) {
+        fclose(playlist);
+        return AVERROR(errno);
+    }
+    while (kept < nb_segments && getline(&line, &line_size, playlist) >= 0) {
+        if (!strncmp(line, "#EXT-X-ENDLIST", 14))
+            continue;
+        fputs(line, truncated);
+        /* a URI line ends a segment's entry */
+        if (line[0] != '#' && line[strspn(line, " \t\r\n")])
+            kept++;
+    }
+    free(line);
+    fclose(playlist);
+
+    if (fclose(truncated) || kept < nb_segments || rename(temporary, filename) < 0) {
+        unlink(temporary);
+        return kept < nb_segments ? AVERROR_INVALIDDATA : AVERROR(errno);
+    }
+    return 0;
+}
+
+/* written under a temporary name and renamed, a crash leaves the old state or the new one */
+static int write_state(const Checkpoint *checkpoint, int nb_segments, int64_t time)
+{
+    char temporary[1060];
+    FILE *state;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", checkpoint->state);
+    if (!(state = fopen(temporary, "w")))
+        return AVERROR(errno);
+    fprintf(state, "checkpoint %d\ninput %"PRId64" %"PRId64"\nsettings %s\nsegments %d\nresume %"PRId64"\n",
+            CHECKPOINT_VERSION, checkpoint->input_size, checkpoint->input_mtime_ns, checkpoint->settings,
+            nb_segments, time);
+    if (fclose(state) || rename(temporary, checkpoint->state) < 0) {
+        unlink(temporary);
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+/* the segments done and where the next one starts, if the state fits this run; quiet only looks */
+static int read_state(const Checkpoint *checkpoint, int *nb_segments, int64_t *time, int quiet)
+{
+    char settings[256];
+    int64_t input_size, input_mtime_ns;
+    int version, matched;
+    FILE *state = fopen(checkpoint->state, "r");
+
+    if (!state)
+        return AVERROR(errno);
+    matched = fscanf(state, "checkpoint %d input %"SCNd64" %"SCNd64" settings %255s segments %d resume %"SCNd64,
+                     &version, &input_size, &input_mtime_ns, settings, nb_segments, time);
+    fclose(state);
+
+    if (matched != 6 || version != CHECKPOINT_VERSION || *nb_segments <= 0)
+        return AVERROR_INVALIDDATA;
+    if (input_size != checkpoint->input_size || input_mtime_ns != checkpoint->input_mtime_ns) {
+        if (!quiet)
+            log_warning("%s: the input changed since, starting over", checkpoint->state);
+        return AVERROR_INVALIDDATA;
+    }
+    if (strcmp(settings, checkpoint->settings)) {
+        if (!quiet)
+            log_warning("%s: written with other settings (%s), starting over", checkpoint->state, settings);
+        return AVERROR_INVALIDDATA;
+    }
+    return 0;
+}
+
+/* names the files and notes what the state has to match; the input must be a local file */
+static int describe(Checkpoint *checkpoint, const char *input_filename, const char *playlist_filename,
+                    const char *settings)
+{
+    struct stat input;
+
+    if (stat(input_filename, &input) < 0 || !S_ISREG(input.st_mode))
+        return AVERROR(EINVAL);
+    snprintf(checkpoint->playlist, sizeof(checkpoint->playlist), "%s", playlist_filename);
+    snprintf(checkpoint->state, sizeof(checkpoint->state), "%s.resume", playlist_filename);
+    snprintf(checkpoint->settings, sizeof(checkpoint->settings), "%s", settings);
+    checkpoint->input_size = input.st_size;
+    checkpoint->input_mtime_ns = mtime_ns(&input);
+    return 0;
+}
+
+int checkpoint_open(Checkpoint **checkpoint, const char *input_filename, const char *playlist_filename,
+                    const char *settings, int64_t *resume_time)
+{
+    Checkpoint *c;
+    int nb_segments, ret;
+    int64_t time;
+
+    *resume_time = AV_NOPTS_VALUE;
+    if (!(c = av_mallocz(sizeof(*c))))
+        return AVERROR(ENOMEM);
+    if ((ret = describe(c, input_filename, playlist_filename, settings)) < 0) {
+        log_error("--resume needs a local input file, %s is not one", input_filename);
+        av_free(c);
+        return ret;
+    }
+    c->reference = -1;
+    c->segment_start = AV_NOPTS_VALUE;
+    c->playlist_size = -1;
+
+    if ((ret = read_state(c, &nb_segments, &time, 0)) >= 0 &&
+        (ret = truncate_playlist(c->playlist, nb_segments)) < 0)
+        log_warning("%s: cannot take the first %d segments of %s (%s), starting over", c->state,
+                    nb_segments, c->playlist, av_err2str(ret));
+    if (ret >= 0) {
+        c->nb_segments = nb_segments;
+        *resume_time = time;
+        log_info("%s: %d segments done, continuing at %.3f s", c->playlist, nb_segments,
+                 time / (double)AV_TIME_BASE);
+    } else {
+        unlink(c->state);
+    }
+    *checkpoint = c;
+    return 0;
+}
+
+int64_t checkpoint_resume_time(const char *input_filename, const char *playlist_filename, const char *settings)
+{
+    Checkpoint checkpoint = { 0 };
+    int nb_segments;
+    int64_t time;
+
+    if (describe(&checkpoint, input_filename, playlist_filename, settings) < 0 ||
+        read_state(&checkpoint, &nb_segments, &time, 1) < 0)
+        return AV_NOPTS_VALUE;
+    return time;
+}
+
+int checkpoint_packet(Checkpoint *checkpoint, const AVFormatContext *muxer, const AVPacket *packet)
+{
+    const AVStream *stream = muxer->streams[packet->stream_index];
+    int64_t time;
+
+    /* the hls muxer splits on the first video stream, at its keyframes */
+    for (unsigned int i = 0; checkpoint->reference < 0 && i < muxer->nb_streams; i++)
+        if (muxer->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            checkpoint->reference = i;
+    if (packet->stream_index != checkpoint->reference || packet->pts == AV_NOPTS_VALUE)
+        return 0;
+
+    time = av_rescale_q(packet->pts, stream->time_base, AV_TIME_BASE_Q);
+    if (checkpoint->segment_start == AV_NOPTS_VALUE)
+        checkpoint->segment_start = time;
+    if (!(packet->flags & AV_PKT_FLAG_KEY))
+        return 1;
+
+    if (checkpoint->nb_keyframes == checkpoint->keyframes_size) {
+        int size = checkpoint->keyframes_size ? checkpoint->keyframes_size * 2 : 64;
+        int64_t *keyframes = av_realloc_array(checkpoint->keyframes, size, sizeof(*keyframes));
+
+        if (!keyframes)
+            return AVERROR(ENOMEM);
+        checkpoint->keyframes = keyframes;
+        checkpoint->keyframes_size = size;
+    }
+    checkpoint->keyframes[checkpoint->nb_keyframes++] = time;
+    return 1;
+}
+
+void checkpoint_update(Checkpoint *checkpoint)
+{
+    struct stat st;
+    double duration;
+    int64_t boundary, tolerance, start = AV_NOPTS_VALUE;
+    int nb_segments, next = 0, ret;
+
+    /* the muxer renames a new playlist into place as it starts a segment, nothing else touches it */
+    if (stat(checkpoint->playlist, &st) < 0 ||
+        (st.st_size == checkpoint->playlist_size && mtime_ns(&st) == checkpoint->playlist_mtime_ns))
+        return;
+    checkpoint->playlist_size = st.st_size;
+    checkpoint->playlist_mtime_ns = mtime_ns(&st);
+    if (scan_playlist(checkpoint->playlist, checkpoint->nb_segments, &nb_segments, &duration) < 0 ||
+        nb_segments <= checkpoint->nb_segments || checkpoint->segment_start == AV_NOPTS_VALUE)
+        return;
+
+    /* the segments written since end where the next one starts, on one of the keyframes */
+    boundary = checkpoint->segment_start + llrint(duration * AV_TIME_BASE);
+    tolerance = checkpoint->checkpointed ? CHECKPOINT_TOLERANCE : CHECKPOINT_FIRST_TOLERANCE;
+    for (int i = 0; i < checkpoint->nb_keyframes; i++)
+        if (llabs(checkpoint->keyframes[i] - boundary) <= tolerance &&
+            (start == AV_NOPTS_VALUE || llabs(checkpoint->keyframes[i] - boundary) < llabs(start - boundary))) {
+            start = checkpoint->keyframes[i];
+            next = i;
+        }
+    if (start == AV_NOPTS_VALUE) {
+        log_debug("checkpoint: no keyframe at %.3f s, where segment %d starts", boundary / (double)AV_TIME_BASE,
+                  nb_segments);
+        return;
+    }
+
+    if ((ret = write_state(checkpoint, nb_segments, start)) < 0) {
+        log_warning("Cannot write %s (%s)", checkpoint->state, av_err2str(ret));
+        return;
+    }
+    log_debug("checkpoint: %d segments, next at %.3f s", nb_segments, start / (double)AV_TIME_BASE);
+    checkpoint->nb_segments = nb_segments;
+    checkpoint->segment_start = start;
+    checkpoint->checkpointed = 1;
+    checkpoint->nb_keyframes -= next;
+    memmove(checkpoint->keyframes, checkpoint->keyframes + next, checkpoint->nb_keyframes * sizeof(*checkpoint->keyframes));
+}
+
+void checkpoint_close(Checkpoint **checkpoint, int finished)
+{
+    Checkpoint *c = *checkpoint;
+
+    if (!c)
+        return;
+    if (finished)
+        unlink(c->state);
+    av_free(c->keyframes);
+    av_freep(checkpoint);
+}
@@ -0,0 +1,44 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <libavformat/avformat.h>
+#include <stdint.h>
+
+/*
+ * Resume state of an HLS output, kept next to the playlist as
+ * "<playlist>.resume". While the output is written, the keyframes of the
+ * stream the hls muxer cuts segments on are noted. Whenever the playlist on
+ * disk gains a segment, the state file is rewritten under a temporary name
+ * and renamed. It holds the number of segments done and the keyframe time
+ * the next one starts at, along with the input's size and modification
+ * time and the encoder settings. A later run with the same input and
+ * settings cuts the playlist back to those segments and continues from
+ * that keyframe, appending to the playlist.
+ */
+typedef struct Checkpoint Checkpoint;
+
+/*
+ * Picks up the state an earlier run left, and cuts the playlist back to it.
+ * *resume_time is the input time (AV_TIME_BASE) to continue from, or
+ * AV_NOPTS_VALUE to start over when there is no state or it does not match.
+ * settings is a string without blanks that changes with anything that
+ * changes the encoded output.
+ */
+int checkpoint_open(Checkpoint **checkpoint, const char *input_filename, const char *playlist_filename,
+                    const char *settings, int64_t *resume_time);
+/*
+ * Where checkpoint_open would most likely continue, AV_NOPTS_VALUE if it
+ * would start over. Only reads the state, nothing is logged or changed.
+ */
+int64_t checkpoint_resume_time(const char *input_filename, const char *playlist_filename, const char *settings);
+/* before muxing each packet of the playlist's muxer; 1 for a packet of the stream it cuts on */
+int checkpoint_packet(Checkpoint *checkpoint, const AVFormatContext *muxer, const AVPacket *packet);
+/*
+ * After muxing such a packet, which may have let the interleaved muxer cut a
+ * segment: rewrites the state once the playlist lists more segments.
+ */
+void checkpoint_update(Checkpoint *checkpoint);
+/* a finished output needs no state, it is deleted */
+void checkpoint_close(Checkpoint **checkpoint, int finished);
+
+#endif
@@ -0,0 +1,587 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/dict.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../../log.h"
+
+// Compile command : gcc benchmark.c ../../log.c -lavformat -lavcodec -lavutil -lm -lpthread
+// Usage           : ./a.out [options]                       run the suite
+//                   ./a.out --compare baseline.json run.json [--threshold pct]
+//
+// Run options:
+//   --transcoder path   task_source.c binary to benchmark (default ../../out.o)
+//   --preset name=path  an experiments/transcoding build, run on the sources
+//                       with audio (its presets copy the audio); repeatable
+//   --dir path          where sources and outputs go (default bench)
+//   --duration seconds  length of every source (default 5)
+//   --repeat n          run every case n times and keep the fastest (default 1)
+//   --only text         only run cases whose name contains text
+//   --json file         write the results here (default bench/results.json)
+//
+// Every source is generated here from a fixed pattern and a sine tone, once
+// per resolution, codec and audio combination, and reused while it exists.
+// The generator needs the encoder for its codec; codecs this libavcodec
+// lacks are skipped. Each case runs in a child process so wait4() reports
+// the child's own peak RSS and CPU time:
+//   fps   - source frames / wall seconds
+//   rtf   - source duration / wall seconds, above 1 is faster than real time
+//   cpu   - user + system seconds over all threads of the child
+//   rss   - peak resident set size in KiB
+// --compare matches cases by name and fails when fps drops, or cpu or rss
+// grow, by more than the threshold (default 5 percent).
+
+#define FRAME_RATE 30
+#define SAMPLE_RATE 48000
+#define MAX_RESULTS 512
+
+
+typedef struct Resolution
+{
+    const char *name;
+    int width;
+    int height;
+} Resolution;
+
+typedef struct SourceCodec
+{
+    const char *name;
+    const char *encoder;
+    const char *options; // key=value:key=value for the generator's encoder
+} SourceCodec;
+
+static const Resolution resolutions[] = {
+    { "360p",  640,  360 },
+    { "720p",  1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "2160p", 3840, 2160 },
+};
+
+static const SourceCodec codecs[] = {
+    { "h264",  "libx264",    "preset=veryfast" },
+    { "hevc",  "libx265",    "preset=ultrafast" },
+    { "mpeg4", "mpeg4",      "" },
+    { "vp9",   "libvpx-vp9", "deadline=realtime:cpu-used=8" },
+};
+
+typedef struct BenchResult
+{
+    char name[256];
+    int frames;
+    double media_seconds;
+    double wall_seconds;
+    double fps;
+    double rtf;
+    double cpu_seconds;
+    long peak_rss_kb;
+    int status;
+} BenchResult;
+
+typedef struct Preset
+{
+    char name[64];
+    const char *path;
+} Preset;
+
+static void fill_picture(AVFrame *frame, int index)
+{
+    // a scrolling xor texture with a box bouncing across it; busy enough
+    // that the encoders and decoders do real work on every frame
+    int box = frame->height / 4;
+    int box_x = (index * 8) % (frame->width - box);
+    int box_y = (index * 4) % (frame->height - box);
+
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            int inside = x >= box_x && x < box_x + box && y >= box_y && y < box_y + box;
+            row[x] = inside ? 235 : (((x + 2 * index) ^ (y + index)) & 0xff) / 2 + 32;
+        }
+    }
+    for (int y = 0; y < frame->height / 2; y++) {
+        uint8_t *u = frame->data[1] + y * frame->linesize[1];
+        uint8_t *v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < frame->width / 2; x++) {
+            u[x] = 128 + ((x + index) & 63) - 32;
+            v[x] = 128 + ((y - index) & 63) - 32;
+        }
+    }
+}
+
+static void fill_tone(AVFrame *frame, int64_t first_sample)
+{
+    for (int c = 0; c < frame->channels; c++) {
+        float *samples = (float *)frame->extended_data[c];
+        for (int s = 0; s < frame->nb_samples; s++)
+            samples[s] = 0.25f * sinf(2 * M_PI * 440 * (c + 1) * (first_sample + s) / SAMPLE_RATE);
+    }
+}
+
+// send one frame (NULL flushes) and write out whatever the encoder returns
+static int encode_write(AVFormatContext *oc, AVStream *stream, AVCodecContext *enc, AVFrame *frame)
+{
+    AVPacket *packet = av_packet_alloc();
+    int ret;
+
+    if (!packet)
+        return AVERROR(ENOMEM);
+    ret = avcodec_send_frame(enc, frame);
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(enc, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            ret = 0;
+            break;
+        }
+        if (ret < 0)
+            break;
+        av_packet_rescale_ts(packet, enc->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        ret = av_interleaved_write_frame(oc, packet);
+    }
+    av_packet_free(&packet);
+    return ret;
+}
+
+static int generate_source(const char *filename, const Resolution *res,
+                           const SourceCodec *sc, int with_audio, int seconds)
+{
+    AVFormatContext *oc = NULL;
+    AVCodecContext *video_enc = NULL, *audio_enc = NULL;
+    AVStream *video_stream, *audio_stream = NULL;
+    AVFrame *picture = NULL, *tone = NULL;
+    AVDictionary *opts = NULL;
+    const AVCodec *video_codec = avcodec_find_encoder_by_name(sc->encoder);
+    const AVCodec *audio_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    int64_t samples = 0;
+    int nb_frames = seconds * FRAME_RATE;
+    int ret;
+
+    if (!video_codec || (with_audio && !audio_codec))
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, "matroska", filename)) < 0)
+        return ret;
+
+    video_stream = avformat_new_stream(oc, NULL);
+    video_enc = avcodec_alloc_context3(video_codec);
+    if (!video_stream || !video_enc) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    video_enc->width = res->width;
+    video_enc->height = res->height;
+    video_enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    video_enc->time_base = (AVRational){ 1, FRAME_RATE };
+    video_enc->framerate = (AVRational){ FRAME_RATE, 1 };
+    video_enc->gop_size = 2 * FRAME_RATE;
+    // about 0.1 bit per pixel, a typical streaming rate
+    video_enc->bit_rate = (int64_t)res->width * res->height * FRAME_RATE / 10;
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        video_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_dict_parse_string(&opts, sc->options, "=", ":", 0);
+    ret = avcodec_open2(video_enc, video_codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0 || (ret = avcodec_parameters_from_context(video_stream->codecpar, video_enc)) < 0)
+        goto end;
+    video_stream->time_base = video_enc->time_base;
+
+    if (with_audio) {
+        audio_stream = avformat_new_stream(oc, NULL);
+        audio_enc = avcodec_alloc_context3(audio_codec);
+        if (!audio_stream || !audio_enc) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        audio_enc->sample_rate = SAMPLE_RATE;
+        audio_enc->channel_layout = AV_CH_LAYOUT_STEREO;
+        audio_enc->channels = 2;
+        audio_enc->sample_fmt = AV_SAMPLE_FMT_FLTP;
+        audio_enc->bit_rate = 128000;
+        audio_enc->time_base = (AVRational){ 1, SAMPLE_RATE };
+        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+            audio_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if ((ret = avcodec_open2(audio_enc, audio_codec, NULL)) < 0 ||
+            (ret = avcodec_parameters_from_context(audio_stream->codecpar, audio_enc)) < 0)
+            goto end;
+        audio_stream->time_base = audio_enc->time_base;
+
+        if (!(tone = av_frame_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        tone->format = audio_enc->sample_fmt;
+        tone->channel_layout = audio_enc->channel_layout;
+        tone->channels = audio_enc->channels;
+        tone->nb_samples = audio_enc->frame_size;
+        if ((ret = av_frame_get_buffer(tone, 0)) < 0)
+            goto end;
+    }
+
+    if (!(picture = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    picture->format = AV_PIX_FMT_YUV420P;
+    picture->width = res->width;
+    picture->height = res->height;
+    if ((ret = av_frame_get_buffer(picture, 0)) < 0)
+        goto end;
+
+    if ((ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE)) < 0 ||
+        (ret = avformat_write_header(oc, NULL)) < 0)
+        goto end;
+
+    for (int i = 0; i < nb_frames; i++) {
+        if ((ret = av_frame_make_writable(picture)) < 0)
+            goto end;
+        fill_picture(picture, i);
+        picture->pts = i;
+        if ((ret = encode_write(oc, video_stream, video_enc, picture)) < 0)
+            goto end;
+
+        // keep the audio level with the video written so far
+        while (audio_enc && samples < (int64_t)(i + 1) * SAMPLE_RATE / FRAME_RATE) {
+            if ((ret = av_frame_make_writable(tone)) < 0)
+                goto end;
+            fill_tone(tone, samples);
+            tone->pts = samples;
+            samples += tone->nb_samples;
+            if ((ret = encode_write(oc, audio_stream, audio_enc, tone)) < 0)
+                goto end;
+        }
+    }
+    if ((ret = encode_write(oc, video_stream, video_enc, NULL)) < 0 ||
+        (audio_enc && (ret = encode_write(oc, audio_stream, audio_enc, NULL)) < 0))
+        goto end;
+    ret = av_write_trailer(oc);
+
+end:
+    av_frame_free(&picture);
+    av_frame_free(&tone);
+    avcodec_free_context(&video_enc);
+    avcodec_free_context(&audio_enc);
+    if (oc)
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    if (ret < 0)
+        unlink(filename);
+    return ret;
+}
+
+// run argv in a child with its output in log_filename and measure it
+static int run_case(char *const argv[], const char *log_filename, BenchResult *result)
+{
+    struct rusage usage;
+    int64_t start = av_gettime_relative();
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return AVERROR(errno);
+    if (pid == 0) {
+        int fd = open(log_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return AVERROR(errno);
+
+    result->wall_seconds = (av_gettime_relative() - start) / 1000000.0;
+    result->cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+                          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+    result->peak_rss_kb = usage.ru_maxrss;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    result->fps = result->frames / FFMAX(result->wall_seconds, 1e-6);
+    result->rtf = result->media_seconds / FFMAX(result->wall_seconds, 1e-6);
+    return 0;
+}
+
+static int bench(char *const argv[], const char *dir, const char *name, int repeat,
+                 int frames, double media_seconds, BenchResult *result)
+{
+    char log_filename[1024];
+    int ret = 0;
+
+    snprintf(log_filename, sizeof(log_filename), "%s/%s.log", dir, name);
+    for (char *c = log_filename + strlen(dir) + 1; *c; c++)
+        if (*c == '/')
+            *c = '_';
+
+    for (int r = 0; r < repeat; r++) {
+        BenchResult run = { .frames = frames, .media_seconds = media_seconds };
+
+        if ((ret = run_case(argv, log_filename, &run)) < 0)
+            return ret;
+        // the fastest run is the one least disturbed by the rest of the machine
+        if (r == 0 || run.wall_seconds < result->wall_seconds) {
+            long peak_rss_kb = FFMAX(result->peak_rss_kb, run.peak_rss_kb);
+            *result = run;
+            result->peak_rss_kb = peak_rss_kb;
+        } else {
+            result->peak_rss_kb = FFMAX(result->peak_rss_kb, run.peak_rss_kb);
+        }
+        if (run.status)
+            break;
+    }
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    log_info("%-36s %8.1f fps %6.2fx rt %7.2f cpu s %8ld KiB%s", result->name, result->fps,
+            result->rtf, result->cpu_seconds, result->peak_rss_kb,
+            result->status ? "  FAILED, see log" : "");
+    return 0;
+}
+
+static int write_results(const char *filename, const BenchResult *results, int nb_results,
+                         int seconds)
+{
+    FILE *f = fopen(filename, "w");
+
+    if (!f)
+        return AVERROR(errno);
+    fprintf(f, "{\n");
+    fprintf(f, "  \"libavcodec\": \"%d.%d.%d\",\n", avcodec_version() >> 16,
+            (avcodec_version() >> 8) & 0xff, avcodec_version() & 0xff);
+    fprintf(f, "  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "  \"source_seconds\": %d,\n", seconds);
+    fprintf(f, "  \"runs\": [\n");
+    // one run per line, which is all --compare has to parse
+    for (int i = 0; i < nb_results; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"frames\": %d, \"media_seconds\": %.3f, "
+                   "\"wall_seconds\": %.3f, \"fps\": %.2f, \"rtf\": %.3f, \"cpu_seconds\": %.3f, "
+                   "\"peak_rss_kb\": %ld, \"status\": %d}%s\n",
+                r->name, r->frames, r->media_seconds, r->wall_seconds, r->fps, r->rtf,
+                r->cpu_seconds, r->peak_rss_kb, r->status, i + 1 < nb_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) ? AVERROR(errno) : 0;
+}
+
+static double json_number(const char *line, const char *key)
+{
+    char pattern[64];
+    const char *value;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    value = strstr(line, pattern);
+    return value ? strtod(value + strlen(pattern), NULL) : NAN;
+}
+
+// reads back the files write_results() writes
+static int load_results(const char *filename, BenchResult *results, int max_results)
+{
+    char line[1024];
+    int nb_results = 0;
+    FILE *f = fopen(filename, "r");
+
+    if (!f) {
+        log_error("could not open '%s'", filename);
+        return AVERROR(errno);
+    }
+    while (nb_results < max_results && fgets(line, sizeof(line), f)) {
+        BenchResult *r = &results[nb_results];
+
+        if (sscanf(line, " {\"name\": \"%255[^\"]\"", r->name) != 1)
+            continue;
+        r->fps = json_number(line, "fps");
+        r->cpu_seconds = json_number(line, "cpu_seconds");
+        r->peak_rss_kb = json_number(line, "peak_rss_kb");
+        r->status = json_number(line, "status");
+        nb_results++;
+    }
+    fclose(f);
+    return nb_results;
+}
+
+// percent change from base to current, positive when current is larger
+static double change(double base, double current)
+{
+    return base > 0 ? (current - base) * 100 / base : 0;
+}
+
+static int compare(const char *baseline_filename, const char *current_filename, double threshold)
+{
+    static BenchResult baseline[MAX_RESULTS], current[MAX_RESULTS];
+    int nb_baseline = load_results(baseline_filename, baseline, MAX_RESULTS);
+    int nb_current = load_results(current_filename, current, MAX_RESULTS);
+    int regressions = 0;
+
+    if (nb_baseline < 0 || nb_current < 0)
+        return -1;
+
+    printf("%-36s %9s %9s %9s  %s\n", "case", "fps", "cpu", "rss", "");
+    for (int i = 0; i < nb_baseline; i++) {
+        const BenchResult *b = &baseline[i], *c = NULL;
+        double fps, cpu, rss;
+        int regressed;
+
+        for (int j = 0; j < nb_current && !c; j++)
+            if (!strcmp(current[j].name, b->name))
+                c = &current[j];
+        if (!c) {
+            printf("%-36s %s\n", b->name, "missing from the new run");
+            continue;
+        }
+
+        fps = change(b->fps, c->fps);
+        cpu = change(b->cpu_seconds, c->cpu_seconds);
+        rss = change(b->peak_rss_kb, c->peak_rss_kb);
+        regressed = (c->status && !b->status) || fps < -threshold ||
+                    cpu > threshold || rss > threshold;
+        regressions += regressed;
+        printf("%-36s %+8.1f%% %+8.1f%% %+8.1f%%  %s\n", b->name, fps, cpu, rss,
+               c->status && !b->status ? "FAILED" : regressed ? "REGRESSION" : "");
+    }
+    log_info("%d regression%s over %.1f%% against %s", regressions, regressions == 1 ? "" : "s",
+            threshold, baseline_filename);
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static BenchResult results[MAX_RESULTS];
+    Preset presets[16];
+    const char *transcoder = "../../out.o";
+    const char *dir = "bench";
+    const char *only = NULL;
+    char json_filename[1024] = "";
+    int nb_presets = 0, nb_results = 0;
+    int seconds = 5, repeat = 1;
+
+    if (argc >= 4 && !strcmp(argv[1], "--compare")) {
+        double threshold = 5;
+
+        if (argc >= 6 && !strcmp(argv[4], "--threshold"))
+            threshold = strtod(argv[5], NULL);
+        return compare(argv[2], argv[3], threshold);
+    }
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--transcoder") && arg + 1 < argc) {
+            transcoder = argv[++arg];
+        } else if (!strcmp(argv[arg], "--preset") && arg + 1 < argc && nb_presets < 16) {
+            const char *spec = argv[++arg];
+            const char *equals = strchr(spec, '=');
+
+            if (!equals || equals == spec) {
+                log_error("--preset wants name=path, got '%s'", spec);
+                return -1;
+            }
+            snprintf(presets[nb_presets].name, sizeof(presets[nb_presets].name), "%.*s",
+                     (int)(equals - spec), spec);
+            presets[nb_presets++].path = equals + 1;
+        } else if (!strcmp(argv[arg], "--dir") && arg + 1 < argc) {
+            dir = argv[++arg];
+        } else if (!strcmp(argv[arg], "--duration") && arg + 1 < argc) {
+            seconds = FFMAX(atoi(argv[++arg]), 1);
+        } else if (!strcmp(argv[arg], "--repeat") && arg + 1 < argc) {
+            repeat = FFMAX(atoi(argv[++arg]), 1);
+        } else if (!strcmp(argv[arg], "--only") && arg + 1 < argc) {
+            only = argv[++arg];
+        } else if (!strcmp(argv[arg], "--json") && arg + 1 < argc) {
+            snprintf(json_filename, sizeof(json_filename), "%s", argv[++arg]);
+        } else {
+            log_error("Unknown option %s", argv[arg]);
+            return -1;
+        }
+    }
+    if (!*json_filename)
+        snprintf(json_filename, sizeof(json_filename), "%s/results.json", dir);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_error("could not create '%s'", dir);
+        return 1;
+    }
+    if (access(transcoder, X_OK) < 0) {
+        log_error("transcoder '%s' is not executable, pass --transcoder", transcoder);
+        return 1;
+    }
+
+    for (int r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+        for (int c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+            for (int with_audio = 0; with_audio <= 1; with_audio++) {
+                const Resolution *res = &resolutions[r];
+                const SourceCodec *sc = &codecs[c];
+                char source[1024], output[1024], name[256], base[128];
+                char *copy[] = { (char *)transcoder, source, output, "0", "-1", "-1", "-1", NULL };
+                char *reencode[] = { (char *)transcoder, source, output, "0", "-1", "-1", "-1",
+                                     "--no-copy", NULL };
+                char *scale360[] = { (char *)transcoder, source, output, "0", "360", "640", "-1",
+                                     NULL };
+                struct {
+                    const char *label;
+                    char **argv;
+                } runs[] = { { "copy", copy }, { "reencode", reencode }, { "scale360", scale360 } };
+                int frames = seconds * FRAME_RATE;
+                int ret;
+
+                snprintf(base, sizeof(base), "%s_%s_%s", res->name, sc->name,
+                         with_audio ? "audio" : "noaudio");
+                if (only && !strstr(base, only))
+                    continue;
+
+                snprintf(source, sizeof(source), "%s/%s_%ds.mkv", dir, base, seconds);
+                if (access(source, R_OK) < 0) {
+                    int64_t start = av_gettime_relative();
+
+                    if ((ret = generate_source(source, res, sc, with_audio, seconds)) < 0) {
+                        log_error("skipping %s: could not generate it with %s (%s)", base,
+                                sc->encoder, av_err2str(ret));
+                        continue;
+                    }
+                    log_info("generated %s in %.1f s", source,
+                            (av_gettime_relative() - start) / 1000000.0);
+                }
+
+                for (int i = 0; i < sizeof(runs) / sizeof(runs[0]) && nb_results < MAX_RESULTS; i++) {
+                    // scaling to the size it already has measures nothing new
+                    if (runs[i].argv == scale360 && res->height <= 360)
+                        continue;
+                    snprintf(name, sizeof(name), "%s/%s", base, runs[i].label);
+                    snprintf(output, sizeof(output), "%s/%s_%s.out.mkv", dir, base, runs[i].label);
+                    if ((ret = bench(runs[i].argv, dir, name, repeat, frames, seconds,
+                                     &results[nb_results])) < 0) {
+                        log_error("could not run %s: %s", name, av_err2str(ret));
+                        return 1;
+                    }
+                    nb_results++;
+                }
+
+                for (int p = 0; p < nb_presets && with_audio && nb_results < MAX_RESULTS; p++) {
+                    char *preset[] = { (char *)presets[p].path, source, output, NULL };
+
+                    snprintf(name, sizeof(name), "%s/preset_%s", base, presets[p].name);
+                    snprintf(output, sizeof(output), "%s/%s_preset_%s.out.mkv", dir, base,
+                             presets[p].name);
+                    if ((ret = bench(preset, dir, name, repeat, frames, seconds,
+                                     &results[nb_results])) < 0) {
+                        log_error("could not run %s: %s", name, av_err2str(ret));
+                        return 1;
+                    }
+                    nb_results++;
+                }
+            }
+        }
+    }
+
+    if (write_results(json_filename, results, nb_results, seconds) < 0) {
+        log_error("could not write '%s'", json_filename);
+        return 1;
+    }
+    log_info("%d runs written to %s", nb_results, json_filename);
+    return 0;
+}
+
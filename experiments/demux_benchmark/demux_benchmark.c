@@ -0,0 +1,137 @@
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "../../log.h"
+#include "../../mmap_input.h"
+
+// Compile command : gcc demux_benchmark.c ../../mmap_input.c ../../log.c -lavformat -lavcodec -lavutil -lpthread
+// Usage           : ./a.out input [repeat] [--cold]
+//
+// Reads every packet of the input, nothing is decoded, once through the
+// default file protocol and once through the mmap input of --mmap-input,
+// repeat times each (default 3), and prints per run:
+//   MB/s    - input bytes / wall seconds
+//   pkt/s   - packets / wall seconds
+//   user    - user CPU seconds
+//   sys     - system CPU seconds, where the read() calls of the default show up
+// --cold drops the input from the page cache before every run (posix_fadvise,
+// no root needed while nothing else holds it), so the read-ahead counts too.
+// Without it every run after the first reads from memory.
+
+
+typedef struct DemuxRun
+{
+    int64_t packets, bytes, wall_us;
+    double user, sys;
+} DemuxRun;
+
+static double cpu_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void drop_page_cache(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int demux(const char *filename, int use_mmap, DemuxRun *run)
+{
+    AVFormatContext *format_context = NULL;
+    MmapInput *input = NULL;
+    AVPacket *packet = av_packet_alloc();
+    struct rusage before, after;
+    int64_t start;
+    int ret;
+
+    memset(run, 0, sizeof(*run));
+    if (!packet)
+        return AVERROR(ENOMEM);
+    getrusage(RUSAGE_SELF, &before);
+    start = av_gettime_relative();
+
+    if (use_mmap) {
+        AVIOContext *pb;
+
+        if ((ret = mmap_input_open(&input, filename, &pb)) < 0)
+            goto end;
+        if (!(format_context = avformat_alloc_context())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        format_context->pb = pb;
+    }
+    if ((ret = avformat_open_input(&format_context, filename, NULL, NULL)) < 0)
+        goto end;
+
+    while ((ret = av_read_frame(format_context, packet)) >= 0) {
+        run->packets++;
+        run->bytes += packet->size;
+        av_packet_unref(packet);
+    }
+    ret = ret == AVERROR_EOF ? 0 : ret;
+
+    run->wall_us = av_gettime_relative() - start;
+    getrusage(RUSAGE_SELF, &after);
+    run->user = cpu_seconds(&after.ru_utime) - cpu_seconds(&before.ru_utime);
+    run->sys = cpu_seconds(&after.ru_stime) - cpu_seconds(&before.ru_stime);
+
+end:
+    avformat_close_input(&format_context);
+    mmap_input_close(&input);
+    av_packet_free(&packet);
+    return ret;
+}
+
+int main(int argc, const char *argv[])
+{
+    static const char *const modes[2] = { "read", "mmap" };
+    int repeat = 3, cold = 0;
+    double best[2] = { 0, 0 };
+
+    if (argc < 2) {
+        log_error("usage: %s input [repeat] [--cold]", argv[0]);
+        return -1;
+    }
+    for (int arg = 2; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--cold"))
+            cold = 1;
+        else
+            repeat = FFMAX(atoi(argv[arg]), 1);
+    }
+
+    printf("%-6s %4s %10s %12s %8s %8s\n", "input", "run", "MB/s", "pkt/s", "user", "sys");
+    for (int r = 0; r < repeat; r++) {
+        for (int mode = 0; mode < 2; mode++) {
+            DemuxRun run;
+            double seconds;
+            int ret;
+
+            if (cold)
+                drop_page_cache(argv[1]);
+            if ((ret = demux(argv[1], mode, &run)) < 0) {
+                log_error("%s demux of '%s' failed: %s", modes[mode], argv[1], av_err2str(ret));
+                return 1;
+            }
+            seconds = FFMAX(run.wall_us, 1) / 1e6;
+            printf("%-6s %4d %10.1f %12.0f %8.3f %8.3f\n", modes[mode], r + 1,
+                   run.bytes / 1048576.0 / seconds, run.packets / seconds, run.user, run.sys);
+            best[mode] = FFMAX(best[mode], run.bytes / 1048576.0 / seconds);
+        }
+    }
+    printf("best: read %.1f MB/s, mmap %.1f MB/s (%+.1f%%)\n", best[0], best[1],
+           best[0] > 0 ? (best[1] / best[0] - 1) * 100 : 0);
+    return 0;
+}
@@ -2,21 +2,13 @@
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/file.h>
+#include "../../../log.h"
 
 struct buffer_data {
     uint8_t *ptr;
     size_t size; 
 };
 
-static void logging(const char *fmt, ...)
-{
-    va_list args;
-    fprintf(stderr, "LOG: ");
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
 
 static int read_packet(void *opaque, uint8_t *buf, int buf_size)
 {
@@ -40,7 +32,7 @@ int main(int argc, char *argv[]) {
     char *input_filename = NULL;
 
     if(argc < 2){
-        logging("Need to specify a file");
+        log_error("Need to specify a file");
         return -1;
     }
 
@@ -52,7 +44,7 @@ int main(int argc, char *argv[]) {
 
     ret = av_file_map(input_filename, &buffer, &buffer_size, 0, NULL);
 
-    logging("%d %u %zu",ret,*(buffer),buffer_size);
+    log_info("%d %u %zu",ret,*(buffer),buffer_size);
     if (ret < 0)
         goto end;
 
@@ -62,7 +54,7 @@ int main(int argc, char *argv[]) {
 
     AVFormatContext *p_format_context = NULL;
     if(!(p_format_context = avformat_alloc_context())){
-        logging("Error avformt_alloc_context()");
+        log_error("Error avformt_alloc_context()");
         ret = AVERROR(ENOMEM);
         goto end;
     }
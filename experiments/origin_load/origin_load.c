@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../../log.h"
+#include "../../percentile.h"
+
+// Compile command : gcc origin_load.c ../../log.c ../../percentile.c -lavutil -lpthread
+// Usage           : ./a.out port playlist.m3u8 [connections] [seconds]
+//
+// Load generator for the --serve origin on 127.0.0.1. Fetches the playlist,
+// and the media playlists a master playlist lists, and collects every URI
+// in them. Then each of connections threads (default 16) sends GETs over one
+// keep-alive connection for seconds (default 10), playlists and segments in
+// turn, each thread starting at a different one, and reads every response
+// whole. Prints:
+//   req/s   - responses / wall seconds
+//   MB/s    - response bytes / wall seconds
+//   p50/p99 - latency from sending a request to its last byte, in ms
+//   errors  - failed requests and non-200 answers; the connection is redone
+
+#define LOAD_BUFFER_SIZE (64 * 1024)
+#define LOAD_MAX_URIS 65536
+
+typedef struct LoadTarget
+{
+    int port;
+    char **uris;
+    int nb_uris;
+    int64_t deadline;
+} LoadTarget;
+
+typedef struct LoadWorker
+{
+    const LoadTarget *target;
+    pthread_t thread;
+    int first;
+    int64_t *latencies;     /* us, one per response */
+    int64_t nb_latencies, capacity;
+    int64_t bytes, errors;
+} LoadWorker;
+
+static int connect_origin(int port)
+{
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * One GET on an open connection. The response body goes to *body when body is
+ * set (av_malloc'd, NUL-terminated), is thrown away otherwise. Returns the
+ * bytes received, < 0 on an error or an answer other than 200.
+ */
+static int64_t get(int fd, const char *uri, char *buffer, char **body)
+{
+    char request[1200];
+    int64_t received = 0, length = -1, header_size = 0, body_read = 0;
+    int size = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", uri);
+    int filled = 0;
+
+    if (send(fd, request, size, MSG_NOSIGNAL) != size)
+        return -1;
+
+    /* the header first, plus whatever body came along with it */
+    while (!header_size) {
+        char *end;
+        ssize_t n = recv(fd, buffer + filled, LOAD_BUFFER_SIZE - 1 - filled, 0);
+
+        if (n <= 0)
+            return -1;
+        filled += n;
+        received += n;
+        buffer[filled] = '\0';
+        if ((end = strstr(buffer, "\r\n\r\n"))) {
+            char *field = strcasestr(buffer, "\r\nContent-Length:");
+
+            header_size = end + 4 - buffer;
+            if (strncmp(buffer, "HTTP/1.1 200", 12) || !field)
+                return -1;
+            length = strtoll(field + 17, NULL, 10);
+        } else if (filled == LOAD_BUFFER_SIZE - 1) {
+            return -1;
+        }
+    }
+
+    if (body && !(*body = av_malloc(length + 1)))
+        return -1;
+    body_read = FFMIN(filled - header_size, length);
+    if (body)
+        memcpy(*body, buffer + header_size, body_read);
+    while (body_read < length) {
+        ssize_t n = recv(fd, body ? *body + body_read : buffer,
+                         body ? length - body_read : FFMIN(length - body_read, LOAD_BUFFER_SIZE), 0);
+
+        if (n <= 0) {
+            if (body)
+                av_freep(body);
+            return -1;
+        }
+        body_read += n;
+        received += n;
+    }
+    if (body)
+        (*body)[length] = '\0';
+    return received;
+}
+
+static int add_uri(LoadTarget *target, const char *uri, int length)
+{
+    if (target->nb_uris == LOAD_MAX_URIS)
+        return 0;
+    for (int i = 0; i < target->nb_uris; i++)
+        if ((int)strlen(target->uris[i]) == length && !strncmp(target->uris[i], uri, length))
+            return 0;
+    if (!(target->uris[target->nb_uris] = av_strndup(uri, length)))
+        return AVERROR(ENOMEM);
+    target->nb_uris++;
+    return 0;
+}
+
+/* the playlist and every URI in it, going one level down from a master playlist */
+static int collect_uris(LoadTarget *target, const char *playlist, int depth)
+{
+    char *buffer = av_malloc(LOAD_BUFFER_SIZE), *body = NULL, *line, *save = NULL;
+    int fd = connect_origin(target->port);
+    int ret = 0;
+
+    if (!buffer || fd < 0 || get(fd, playlist, buffer, &body) < 0) {
+        log_error("Cannot fetch /%s from 127.0.0.1:%d", playlist, target->port);
+        ret = AVERROR(EIO);
+        goto end;
+    }
+    if ((ret = add_uri(target, playlist, strlen(playlist))) < 0)
+        goto end;
+    for (line = strtok_r(body, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+        if (line[0] == '#' || !line[0])
+            continue;
+        if (depth == 0 && strstr(line, ".m3u8"))
+            ret = collect_uris(target, line, 1);
+        else
+            ret = add_uri(target, line, strlen(line));
+        if (ret < 0)
+            break;
+    }
+
+end:
+    if (fd >= 0)
+        close(fd);
+    av_free(body);
+    av_free(buffer);
+    return ret;
+}
+
+static void *worker_main(void *arg)
+{
+    LoadWorker *worker = arg;
+    const LoadTarget *target = worker->target;
+    char *buffer = av_malloc(LOAD_BUFFER_SIZE);
+    int fd = -1;
+
+    if (!buffer)
+        return NULL;
+    for (int64_t next = worker->first; av_gettime_relative() < target->deadline; next++) {
+        int64_t sent, received;
+
+        if (fd < 0 && (fd = connect_origin(target->port)) < 0) {
+            worker->errors++;
+            usleep(1000);
+            continue;
+        }
+        sent = av_gettime_relative();
+        if ((received = get(fd, target->uris[next % target->nb_uris], buffer, NULL)) < 0) {
+            worker->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (worker->nb_latencies == worker->capacity) {
+            int64_t capacity = worker->capacity ? worker->capacity * 2 : 4096;
+            int64_t *grown = av_realloc_array(worker->latencies, capacity, sizeof(*grown));
+
+            if (!grown)
+                break;
+            worker->latencies = grown;
+            worker->capacity = capacity;
+        }
+        worker->latencies[worker->nb_latencies++] = av_gettime_relative() - sent;
+        worker->bytes += received;
+    }
+    if (fd >= 0)
+        close(fd);
+    av_free(buffer);
+    return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+    LoadTarget target = { 0 };
+    LoadWorker *workers;
+    int64_t *latencies, nb_latencies = 0, bytes = 0, errors = 0, started;
+    int nb_workers = argc > 3 ? FFMAX(atoi(argv[3]), 1) : 16;
+    double seconds = argc > 4 ? atof(argv[4]) : 10;
+
+    if (argc < 3) {
+        log_error("usage: %s port playlist.m3u8 [connections] [seconds]", argv[0]);
+        return -1;
+    }
+    target.port = atoi(argv[1]);
+    if (!(target.uris = av_malloc_array(LOAD_MAX_URIS, sizeof(*target.uris))) ||
+        collect_uris(&target, argv[2][0] == '/' ? argv[2] + 1 : argv[2], 0) < 0)
+        return 1;
+    if (!(workers = av_mallocz_array(nb_workers, sizeof(*workers))))
+        return 1;
+
+    printf("%d URIs, %d connections, %.1f s\n", target.nb_uris, nb_workers, seconds);
+    started = av_gettime_relative();
+    target.deadline = started + (int64_t)(seconds * 1000000);
+    for (int i = 0; i < nb_workers; i++) {
+        workers[i].target = &target;
+        workers[i].first = i * target.nb_uris / nb_workers;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            log_error("Cannot start connection %d", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < nb_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        nb_latencies += workers[i].nb_latencies;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+    seconds = (av_gettime_relative() - started) / 1e6;
+
+    if (!(latencies = av_malloc_array(FFMAX(nb_latencies, 1), sizeof(*latencies))))
+        return 1;
+    nb_latencies = 0;
+    for (int i = 0; i < nb_workers; i++) {
+        memcpy(latencies + nb_latencies, workers[i].latencies, workers[i].nb_latencies * sizeof(*latencies));
+        nb_latencies += workers[i].nb_latencies;
+        av_free(workers[i].latencies);
+    }
+    percentile_sort(latencies, nb_latencies);
+
+    printf("%10s %10s %10s %10s %10s %8s\n", "requests", "req/s", "MB/s", "p50 ms", "p99 ms", "errors");
+    printf("%10"PRId64" %10.0f %10.1f %10.3f %10.3f %8"PRId64"\n", nb_latencies, nb_latencies / seconds,
+           bytes / 1048576.0 / seconds,
+           percentile(latencies, nb_latencies, 50) / 1000.0, percentile(latencies, nb_latencies, 99) / 1000.0,
+           errors);
+
+    for (int i = 0; i < target.nb_uris; i++)
+        av_free(target.uris[i]);
+    av_free(target.uris);
+    av_free(workers);
+    av_free(latencies);
+    return errors && !nb_latencies ? 1 : 0;
+}
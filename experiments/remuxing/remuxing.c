@@ -2,13 +2,10 @@
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
-
-// print out the steps and errors
-static void logging(const char *fmt, ...);
+#include "../../log.h"
 
 int main(int argc, const char *argv[])
 {
@@ -26,7 +23,7 @@ int main(int argc, const char *argv[])
    int fragmented_mp4_options = 0;
 
    if(argc < 3){
-        logging("You need to pass at least 2 parameters");
+        log_error("You need to pass at least 2 parameters");
         return -1;
    }else if (argc == 4) {
     fragmented_mp4_options = 1;
@@ -36,21 +33,21 @@ int main(int argc, const char *argv[])
   out_filename = argv[2];
 
   if((ret = avformat_open_input(&input_format_context,in_filename, NULL, NULL)) < 0){
-    logging("Could not open input file '%s'" , in_filename);
+    log_error("Could not open input file '%s'" , in_filename);
     goto end;
   }
 
   if((ret = avformat_find_stream_info(input_format_context,NULL)) < 0){
-    logging("Failed to retrieve input stream information");
+    log_error("Failed to retrieve input stream information");
     goto end;
   }
 
-  logging("format %s, duration %lld us, bit_rate %lld, nb_stream %u", input_format_context->iformat->name, input_format_context->duration, input_format_context->bit_rate,input_format_context->nb_streams);
+  log_info("format %s, duration %" PRId64 " us, bit_rate %" PRId64 ", nb_stream %u", input_format_context->iformat->name, input_format_context->duration, input_format_context->bit_rate,input_format_context->nb_streams);
 
   avformat_alloc_output_context2(&output_format_context , NULL ,NULL , out_filename);
 
   if(!output_format_context){
-    logging("Could not create output context\n");
+    log_error("Could not create output context\n");
     ret = AVERROR_UNKNOWN;
     goto end;
   }
@@ -80,7 +77,7 @@ int main(int argc, const char *argv[])
     out_stream = avformat_new_stream(output_format_context, NULL);
 
     if(!out_stream){
-        logging("Failed allocating output stream\n");
+        log_error("Failed allocating output stream\n");
         ret = AVERROR_UNKNOWN;
         goto end;
     }
@@ -88,7 +85,7 @@ int main(int argc, const char *argv[])
     ret = avcodec_parameters_copy(out_stream->codecpar , in_codec_par);
 
     if(ret < 0){
-        logging("Failed to copy codec parameters\n");
+        log_error("Failed to copy codec parameters\n");
         goto end;
     }
   }
@@ -99,7 +96,7 @@ int main(int argc, const char *argv[])
         ret = avio_open(&output_format_context->pb , out_filename , AVIO_FLAG_WRITE);
 
         if(ret < 0){
-            logging("Could not open output file '%s'" , out_filename);
+            log_error("Could not open output file '%s'" , out_filename);
             goto end;
         }
     }
@@ -114,7 +111,7 @@ int main(int argc, const char *argv[])
     ret = avformat_write_header(output_format_context, &opts);
 
     if(ret < 0){
-        logging("Error occured when opening output file\n");
+        log_error("Error occured when opening output file\n");
         goto end;
     }
 
@@ -165,12 +162,3 @@ int main(int argc, const char *argv[])
     return 0;
 }
 
-static void logging(const char *fmt, ...)
-{
-    va_list args;
-    fprintf(stderr, "LOG: ");
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
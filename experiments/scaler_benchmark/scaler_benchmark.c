@@ -0,0 +1,214 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../../log.h"
+
+// Compile command : gcc scaler_benchmark.c ../../log.c -lavformat -lavcodec -lavutil -lswscale -lm -lpthread
+// Usage           : ./a.out input.mp4 out_width out_height [frames]
+//
+// Decodes the first frames of the input once, then for every swscale
+// algorithm the scale filter can use (--scaler in task_source.c):
+//   fps  - how many frames per second it downscales to out_width x out_height
+//   psnr - luma PSNR of the downscaled frame, upscaled back with lanczos,
+//          against the original. Higher is better.
+// Pick the cheapest algorithm whose psnr still meets the quality bar.
+
+
+typedef struct ScalerAlgorithm
+{
+    const char *name;
+    int flags;
+} ScalerAlgorithm;
+
+static const ScalerAlgorithm algorithms[] = {
+    { "neighbor",      SWS_POINT },
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear",      SWS_BILINEAR },
+    { "area",          SWS_AREA },
+    { "bicublin",      SWS_BICUBLIN },
+    { "bicubic",       SWS_BICUBIC },
+    { "gauss",         SWS_GAUSS },
+    { "spline",        SWS_SPLINE },
+    { "lanczos",       SWS_LANCZOS },
+    { "sinc",          SWS_SINC },
+};
+
+static double luma_psnr(const AVFrame *a, const AVFrame *b)
+{
+    double sse = 0;
+
+    for (int y = 0; y < a->height; y++) {
+        const uint8_t *row_a = a->data[0] + y * a->linesize[0];
+        const uint8_t *row_b = b->data[0] + y * b->linesize[0];
+        for (int x = 0; x < a->width; x++) {
+            int d = row_a[x] - row_b[x];
+            sse += d * d;
+        }
+    }
+    if (sse == 0)
+        return INFINITY;
+    return 10 * log10(255.0 * 255.0 * a->width * a->height / sse);
+}
+
+static AVFrame *alloc_picture(int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (!frame)
+        return NULL;
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+static int scale(struct SwsContext *sws, const AVFrame *src, AVFrame *dst)
+{
+    return sws_scale(sws, (const uint8_t * const *)src->data, src->linesize,
+                     0, src->height, dst->data, dst->linesize);
+}
+
+int main(int argc, const char *argv[])
+{
+    AVFormatContext *format_context = NULL;
+    AVCodecContext *codec_context = NULL;
+    const AVCodec *decoder = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *decoded = NULL;
+    AVFrame **frames = NULL;
+    int nb_frames = 0, max_frames = 100;
+    int out_width, out_height, video_index;
+    int ret = 0;
+
+    if (argc < 4) {
+        log_error("usage: %s input out_width out_height [frames]", argv[0]);
+        return -1;
+    }
+    out_width = atoi(argv[2]);
+    out_height = atoi(argv[3]);
+    if (argc > 4)
+        max_frames = atoi(argv[4]);
+
+    if ((ret = avformat_open_input(&format_context, argv[1], NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(format_context, NULL)) < 0) {
+        log_error("Could not open input file '%s'", argv[1]);
+        goto end;
+    }
+
+    video_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    if (video_index < 0) {
+        log_error("no video stream in '%s'", argv[1]);
+        ret = video_index;
+        goto end;
+    }
+
+    codec_context = avcodec_alloc_context3(decoder);
+    packet = av_packet_alloc();
+    decoded = av_frame_alloc();
+    frames = av_calloc(max_frames, sizeof(*frames));
+    if (!codec_context || !packet || !decoded || !frames) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    avcodec_parameters_to_context(codec_context, format_context->streams[video_index]->codecpar);
+    if ((ret = avcodec_open2(codec_context, decoder, NULL)) < 0) {
+        log_error("failed to open decoder");
+        goto end;
+    }
+
+    // decode once, keep the source frames as yuv420p in memory
+    while (nb_frames < max_frames && av_read_frame(format_context, packet) >= 0) {
+        if (packet->stream_index == video_index && avcodec_send_packet(codec_context, packet) >= 0) {
+            while (nb_frames < max_frames && avcodec_receive_frame(codec_context, decoded) >= 0) {
+                struct SwsContext *convert;
+                AVFrame *source = alloc_picture(decoded->width, decoded->height);
+
+                if (!source) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                convert = sws_getContext(decoded->width, decoded->height, decoded->format,
+                                         decoded->width, decoded->height, AV_PIX_FMT_YUV420P,
+                                         SWS_POINT, NULL, NULL, NULL);
+                if (!convert) {
+                    av_frame_free(&source);
+                    ret = AVERROR(EINVAL);
+                    goto end;
+                }
+                scale(convert, decoded, source);
+                sws_freeContext(convert);
+                frames[nb_frames++] = source;
+                av_frame_unref(decoded);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    if (!nb_frames) {
+        log_error("no frames decoded");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    log_info("%d frames %dx%d -> %dx%d", nb_frames, frames[0]->width, frames[0]->height, out_width, out_height);
+    printf("%-14s %10s %10s\n", "scaler", "fps", "psnr_y");
+
+    for (int a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+        int in_width = frames[0]->width, in_height = frames[0]->height;
+        struct SwsContext *down = sws_getContext(in_width, in_height, AV_PIX_FMT_YUV420P,
+                                                 out_width, out_height, AV_PIX_FMT_YUV420P,
+                                                 algorithms[a].flags, NULL, NULL, NULL);
+        struct SwsContext *up = sws_getContext(out_width, out_height, AV_PIX_FMT_YUV420P,
+                                               in_width, in_height, AV_PIX_FMT_YUV420P,
+                                               SWS_LANCZOS, NULL, NULL, NULL);
+        AVFrame *scaled = alloc_picture(out_width, out_height);
+        AVFrame *restored = alloc_picture(in_width, in_height);
+        double psnr = 0;
+        int64_t start, elapsed;
+
+        if (!down || !up || !scaled || !restored) {
+            log_error("could not set up %s", algorithms[a].name);
+            ret = AVERROR(ENOMEM);
+        } else {
+            start = av_gettime_relative();
+            for (int f = 0; f < nb_frames; f++)
+                scale(down, frames[f], scaled);
+            elapsed = av_gettime_relative() - start;
+
+            for (int f = 0; f < nb_frames; f++) {
+                scale(down, frames[f], scaled);
+                scale(up, scaled, restored);
+                psnr += luma_psnr(frames[f], restored);
+            }
+
+            printf("%-14s %10.1f %10.2f\n", algorithms[a].name,
+                   nb_frames * 1000000.0 / FFMAX(elapsed, 1), psnr / nb_frames);
+        }
+
+        sws_freeContext(down);
+        sws_freeContext(up);
+        av_frame_free(&scaled);
+        av_frame_free(&restored);
+        if (ret < 0)
+            goto end;
+    }
+
+end:
+    for (int f = 0; f < nb_frames; f++)
+        av_frame_free(&frames[f]);
+    av_free(frames);
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_context);
+    avformat_close_input(&format_context);
+    return ret < 0 ? 1 : 0;
+}
+
@@ -2,7 +2,6 @@
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <libavutil/opt.h>
 #include <string.h>
@@ -19,6 +18,9 @@ typedef struct StreamingParams {
   char *audio_codec;
   char *codec_priv_key;
   char *codec_priv_value;
+  int decoder_threads; // video only, 0 = one per core
+  int encoder_threads; // video only, 0 = one per core
+  int thread_type;     // FF_THREAD_FRAME and/or FF_THREAD_SLICE, 0 = both
 } StreamingParams;
 
 typedef struct StreamingContext {
@@ -32,45 +34,58 @@ typedef struct StreamingContext {
   int video_index;
   int audio_index;
   char *filename;
+  AVPacket *output_packet; // encoder side: reused for every encoded packet
 } StreamingContext;
 
-int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc) {
+// audio codecs are cheap and mostly single threaded, they get one thread
+void set_codec_threads(AVCodecContext *avcc, int threads, int thread_type) {
+  if (avcc->codec_type != AVMEDIA_TYPE_VIDEO) {
+    avcc->thread_count = 1;
+    return;
+  }
+  avcc->thread_count = threads;
+  avcc->thread_type = thread_type ? thread_type : FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc, StreamingParams sp) {
   *avc = avcodec_find_decoder(avs->codecpar->codec_id);
-  if (!*avc) {logging("failed to find the codec"); return -1;}
+  if (!*avc) {log_error("failed to find the codec"); return -1;}
 
   *avcc = avcodec_alloc_context3(*avc);
-  if (!*avcc) {logging("failed to alloc memory for codec context"); return -1;}
+  if (!*avcc) {log_error("failed to alloc memory for codec context"); return -1;}
 
-  if (avcodec_parameters_to_context(*avcc, avs->codecpar) < 0) {logging("failed to fill codec context"); return -1;}
+  if (avcodec_parameters_to_context(*avcc, avs->codecpar) < 0) {log_error("failed to fill codec context"); return -1;}
 
-  if (avcodec_open2(*avcc, *avc, NULL) < 0) {logging("failed to open codec"); return -1;}
+  set_codec_threads(*avcc, sp.decoder_threads, sp.thread_type);
+
+  if (avcodec_open2(*avcc, *avc, NULL) < 0) {log_error("failed to open codec"); return -1;}
   return 0;
 }
 
 int open_media(const char *in_filename, AVFormatContext **avfc) {
   *avfc = avformat_alloc_context();
-  if (!*avfc) {logging("failed to alloc memory for format"); return -1;}
+  if (!*avfc) {log_error("failed to alloc memory for format"); return -1;}
 
-  if (avformat_open_input(avfc, in_filename, NULL, NULL) != 0) {logging("failed to open input file %s", in_filename); return -1;}
+  if (avformat_open_input(avfc, in_filename, NULL, NULL) != 0) {log_error("failed to open input file %s", in_filename); return -1;}
 
-  if (avformat_find_stream_info(*avfc, NULL) < 0) {logging("failed to get stream info"); return -1;}
+  if (avformat_find_stream_info(*avfc, NULL) < 0) {log_error("failed to get stream info"); return -1;}
   return 0;
 }
 
-int prepare_decoder(StreamingContext *sc) {
+int prepare_decoder(StreamingContext *sc, StreamingParams sp) {
   for (int i = 0; i < sc->avfc->nb_streams; i++) {
     if (sc->avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
       sc->video_avs = sc->avfc->streams[i];
       sc->video_index = i;
 
-      if (fill_stream_info(sc->video_avs, &sc->video_avc, &sc->video_avcc)) {return -1;}
+      if (fill_stream_info(sc->video_avs, &sc->video_avc, &sc->video_avcc, sp)) {return -1;}
     } else if (sc->avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
       sc->audio_avs = sc->avfc->streams[i];
       sc->audio_index = i;
 
-      if (fill_stream_info(sc->audio_avs, &sc->audio_avc, &sc->audio_avcc)) {return -1;}
+      if (fill_stream_info(sc->audio_avs, &sc->audio_avc, &sc->audio_avcc, sp)) {return -1;}
     } else {
-      logging("skipping streams other than audio and video");
+      log_info("skipping streams other than audio and video");
     }
   }
 
@@ -81,10 +96,10 @@ int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVR
   sc->video_avs = avformat_new_stream(sc->avfc, NULL);
 
   sc->video_avc = avcodec_find_encoder_by_name(sp.video_codec);
-  if (!sc->video_avc) {logging("could not find the proper codec"); return -1;}
+  if (!sc->video_avc) {log_error("could not find the proper codec"); return -1;}
 
   sc->video_avcc = avcodec_alloc_context3(sc->video_avc);
-  if (!sc->video_avcc) {logging("could not allocated memory for codec context"); return -1;}
+  if (!sc->video_avcc) {log_error("could not allocated memory for codec context"); return -1;}
 
   av_opt_set(sc->video_avcc->priv_data, "preset", "fast", 0);
   if (sp.codec_priv_key && sp.codec_priv_value)
@@ -106,7 +121,9 @@ int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVR
   sc->video_avcc->time_base = av_inv_q(input_framerate);
   sc->video_avs->time_base = sc->video_avcc->time_base;
 
-  if (avcodec_open2(sc->video_avcc, sc->video_avc, NULL) < 0) {logging("could not open the codec"); return -1;}
+  set_codec_threads(sc->video_avcc, sp.encoder_threads, sp.thread_type);
+
+  if (avcodec_open2(sc->video_avcc, sc->video_avc, NULL) < 0) {log_error("could not open the codec"); return -1;}
   avcodec_parameters_from_context(sc->video_avs->codecpar, sc->video_avcc);
   return 0;
 }
@@ -115,10 +132,10 @@ int prepare_audio_encoder(StreamingContext *sc, int sample_rate, StreamingParams
   sc->audio_avs = avformat_new_stream(sc->avfc, NULL);
 
   sc->audio_avc = avcodec_find_encoder_by_name(sp.audio_codec);
-  if (!sc->audio_avc) {logging("could not find the proper codec"); return -1;}
+  if (!sc->audio_avc) {log_error("could not find the proper codec"); return -1;}
 
   sc->audio_avcc = avcodec_alloc_context3(sc->audio_avc);
-  if (!sc->audio_avcc) {logging("could not allocated memory for codec context"); return -1;}
+  if (!sc->audio_avcc) {log_error("could not allocated memory for codec context"); return -1;}
 
   int OUTPUT_CHANNELS = 2;
   int OUTPUT_BIT_RATE = 196000;
@@ -133,7 +150,9 @@ int prepare_audio_encoder(StreamingContext *sc, int sample_rate, StreamingParams
 
   sc->audio_avs->time_base = sc->audio_avcc->time_base;
 
-  if (avcodec_open2(sc->audio_avcc, sc->audio_avc, NULL) < 0) {logging("could not open the codec"); return -1;}
+  set_codec_threads(sc->audio_avcc, 1, 0);
+
+  if (avcodec_open2(sc->audio_avcc, sc->audio_avc, NULL) < 0) {log_error("could not open the codec"); return -1;}
   avcodec_parameters_from_context(sc->audio_avs->codecpar, sc->audio_avcc);
   return 0;
 }
@@ -146,15 +165,14 @@ int prepare_copy(AVFormatContext *avfc, AVStream **avs, AVCodecParameters *decod
 
 int remux(AVPacket **pkt, AVFormatContext **avfc, AVRational decoder_tb, AVRational encoder_tb) {
   av_packet_rescale_ts(*pkt, decoder_tb, encoder_tb);
-  if (av_interleaved_write_frame(*avfc, *pkt) < 0) { logging("error while copying stream packet"); return -1; }
+  if (av_interleaved_write_frame(*avfc, *pkt) < 0) { log_error("error while copying stream packet"); return -1; }
   return 0;
 }
 
 int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
   if (input_frame) input_frame->pict_type = AV_PICTURE_TYPE_NONE;
 
-  AVPacket *output_packet = av_packet_alloc();
-  if (!output_packet) {logging("could not allocate memory for output packet"); return -1;}
+  AVPacket *output_packet = encoder->output_packet;
 
   int response = avcodec_send_frame(encoder->video_avcc, input_frame);
 
@@ -163,7 +181,7 @@ int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
     if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
       break;
     } else if (response < 0) {
-      logging("Error while receiving packet from encoder: %s", av_err2str(response));
+      log_error("Error while receiving packet from encoder: %s", av_err2str(response));
       return -1;
     }
 
@@ -172,16 +190,14 @@ int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
 
     av_packet_rescale_ts(output_packet, decoder->video_avs->time_base, encoder->video_avs->time_base);
     response = av_interleaved_write_frame(encoder->avfc, output_packet);
-    if (response != 0) { logging("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
+    if (response != 0) { log_error("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
   }
   av_packet_unref(output_packet);
-  av_packet_free(&output_packet);
   return 0;
 }
 
 int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
-  AVPacket *output_packet = av_packet_alloc();
-  if (!output_packet) {logging("could not allocate memory for output packet"); return -1;}
+  AVPacket *output_packet = encoder->output_packet;
 
   int response = avcodec_send_frame(encoder->audio_avcc, input_frame);
 
@@ -190,7 +206,7 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
     if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
       break;
     } else if (response < 0) {
-      logging("Error while receiving packet from encoder: %s", av_err2str(response));
+      log_error("Error while receiving packet from encoder: %s", av_err2str(response));
       return -1;
     }
 
@@ -198,23 +214,22 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
 
     av_packet_rescale_ts(output_packet, decoder->audio_avs->time_base, encoder->audio_avs->time_base);
     response = av_interleaved_write_frame(encoder->avfc, output_packet);
-    if (response != 0) { logging("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
+    if (response != 0) { log_error("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
   }
   av_packet_unref(output_packet);
-  av_packet_free(&output_packet);
   return 0;
 }
 
 int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame) {
   int response = avcodec_send_packet(decoder->audio_avcc, input_packet);
-  if (response < 0) {logging("Error while sending packet to decoder: %s", av_err2str(response)); return response;}
+  if (response < 0) {log_error("Error while sending packet to decoder: %s", av_err2str(response)); return response;}
 
   while (response >= 0) {
     response = avcodec_receive_frame(decoder->audio_avcc, input_frame);
     if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
       break;
     } else if (response < 0) {
-      logging("Error while receiving frame from decoder: %s", av_err2str(response));
+      log_error("Error while receiving frame from decoder: %s", av_err2str(response));
       return response;
     }
 
@@ -228,14 +243,14 @@ int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
 int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame) {
   int response = avcodec_send_packet(decoder->video_avcc, input_packet);
-  if (response < 0) {logging("Error while sending packet to decoder: %s", av_err2str(response)); return response;}
+  if (response < 0) {log_error("Error while sending packet to decoder: %s", av_err2str(response)); return response;}
 
   while (response >= 0) {
     response = avcodec_receive_frame(decoder->video_avcc, input_frame);
     if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
       break;
     } else if (response < 0) {
-      logging("Error while receiving frame from decoder: %s", av_err2str(response));
+      log_error("Error while receiving frame from decoder: %s", av_err2str(response));
       return response;
     }
 
@@ -313,6 +328,10 @@ int main(int argc, char *argv[])
   //sp.audio_codec = "libvorbis";
   //sp.output_extension = ".webm";
 
+  // usage: ./a.out input output [decoder_threads [encoder_threads]]
+  if (argc > 3) sp.decoder_threads = atoi(argv[3]);
+  if (argc > 4) sp.encoder_threads = atoi(argv[4]);
+
   StreamingContext *decoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
   decoder->filename = argv[1];
 
@@ -323,10 +342,10 @@ int main(int argc, char *argv[])
     strcat(encoder->filename, sp.output_extension);
 
   if (open_media(decoder->filename, &decoder->avfc)) return -1;
-  if (prepare_decoder(decoder)) return -1;
+  if (prepare_decoder(decoder, sp)) return -1;
 
   avformat_alloc_output_context2(&encoder->avfc, NULL, NULL, encoder->filename);
-  if (!encoder->avfc) {logging("could not allocate memory for output format");return -1;}
+  if (!encoder->avfc) {log_error("could not allocate memory for output format");return -1;}
 
   if (!sp.copy_video) {
     AVRational input_framerate = av_guess_frame_rate(decoder->avfc, decoder->video_avs, NULL);
@@ -346,7 +365,7 @@ int main(int argc, char *argv[])
 
   if (!(encoder->avfc->oformat->flags & AVFMT_NOFILE)) {
     if (avio_open(&encoder->avfc->pb, encoder->filename, AVIO_FLAG_WRITE) < 0) {
-      logging("could not open the output file");
+      log_error("could not open the output file");
       return -1;
     }
   }
@@ -357,13 +376,16 @@ int main(int argc, char *argv[])
     av_dict_set(&muxer_opts, sp.muxer_opt_key, sp.muxer_opt_value, 0);
   }
 
-  if (avformat_write_header(encoder->avfc, &muxer_opts) < 0) {logging("an error occurred when opening output file"); return -1;}
+  if (avformat_write_header(encoder->avfc, &muxer_opts) < 0) {log_error("an error occurred when opening output file"); return -1;}
 
   AVFrame *input_frame = av_frame_alloc();
-  if (!input_frame) {logging("failed to allocated memory for AVFrame"); return -1;}
+  if (!input_frame) {log_error("failed to allocated memory for AVFrame"); return -1;}
 
   AVPacket *input_packet = av_packet_alloc();
-  if (!input_packet) {logging("failed to allocated memory for AVPacket"); return -1;}
+  if (!input_packet) {log_error("failed to allocated memory for AVPacket"); return -1;}
+
+  encoder->output_packet = av_packet_alloc();
+  if (!encoder->output_packet) {log_error("could not allocate memory for output packet"); return -1;}
 
   while (av_read_frame(decoder->avfc, input_packet) >= 0)
   {
@@ -383,7 +405,7 @@ int main(int argc, char *argv[])
         if (remux(&input_packet, &encoder->avfc, decoder->audio_avs->time_base, encoder->audio_avs->time_base)) return -1;
       }
     } else {
-      logging("ignoring all non video or audio packets");
+      log_trace("ignoring all non video or audio packets");
     }
   }
   // TODO: should I also flush the audio encoder?
@@ -406,6 +428,8 @@ int main(int argc, char *argv[])
     input_packet = NULL;
   }
 
+  av_packet_free(&encoder->output_packet);
+
   avformat_close_input(&decoder->avfc);
 
   avformat_free_context(decoder->avfc); decoder->avfc = NULL;
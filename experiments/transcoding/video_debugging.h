@@ -2,12 +2,11 @@
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <libavutil/opt.h>
 #include <string.h>
 #include <inttypes.h>
+#include "../../log.h"
 
-void logging(const char *fmt, ...);
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt);
 void print_timing(char *name, AVFormatContext *avf, AVCodecContext *avc, AVStream *avs);
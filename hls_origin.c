@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "hls_origin.h"
+#include "log.h"
+
+/* a request header larger than this is refused */
+#define ORIGIN_REQUEST_SIZE 8192
+#define ORIGIN_EVENTS 64
+
+static const char playlist_type[] = "application/vnd.apple.mpegurl";
+
+typedef struct OriginFile
+{
+    char *name;
+    AVBufferRef *data;
+} OriginFile;
+
+/* a file a muxer is still writing, into a dynamic buffer */
+typedef struct OpenFile
+{
+    AVIOContext *pb;
+    char *name;
+} OpenFile;
+
+typedef struct Connection
+{
+    struct Connection *prev, *next;
+    int fd;
+    int writing;            /* polled for EPOLLOUT instead of EPOLLIN */
+    int keep_alive;
+
+    char request[ORIGIN_REQUEST_SIZE];
+    int request_size;
+
+    /* the response being sent: header, then body */
+    char header[512];
+    int header_size, header_sent;
+    AVBufferRef *body;
+    size_t body_size, body_sent;
+} Connection;
+
+struct HlsOrigin
+{
+    int port;
+    int listen_fd, epoll_fd, wake_fd;
+    pthread_t thread;
+    Connection *connections;    /* open ones, server thread only */
+
+    pthread_mutex_t lock;       /* files and open_files */
+    OriginFile *files;
+    int nb_files;
+    OpenFile *open_files;
+    int nb_open_files;
+
+    int (*io_open)(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    void (*io_close)(AVFormatContext *s, AVIOContext *pb);
+
+    int64_t nb_connections, nb_requests, nb_not_found, bytes_sent;
+};
+
+static const char *content_type(const char *name)
+{
+    if (av_match_ext(name, "m3u8"))
+        return playlist_type;
+    if (av_match_ext(name, "ts"))
+        return "video/mp2t";
+    if (av_match_ext(name, "mp4,m4s"))
+        return "video/mp4";
+    if (av_match_ext(name, "aac"))
+        return "audio/aac";
+    return "application/octet-stream";
+}
+
+/* a reference to the file, NULL when there is none */
+static AVBufferRef *find_file(HlsOrigin *origin, const char *name)
+{
+    AVBufferRef *data = NULL;
+
+    pthread_mutex_lock(&origin->lock);
+    for (int i = 0; i < origin->nb_files; i++)
+        if (!strcmp(origin->files[i].name, name)) {
+            data = av_buffer_ref(origin->files[i].data);
+            break;
+        }
+    pthread_mutex_unlock(&origin->lock);
+    return data;
+}
+
+static void set_response(Connection *c, int status, const char *reason, const char *type,
+                         AVBufferRef *body, size_t length, int head)
+{
+    c->header_size = snprintf(c->header, sizeof(c->header),
+                              "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                              "Cache-Control: %s\r\n%s\r\n", status, reason, type, length,
+                              /* playlists change under the same name, segments never do */
+                              status != 200 || type == playlist_type ? "no-cache" : "max-age=3600",
+                              c->keep_alive ? "" : "Connection: close\r\n");
+    c->header_sent = 0;
+    c->body_sent = 0;
+    if (head || !body) {
+        av_buffer_unref(&body);
+        c->body_size = 0;
+    } else {
+        c->body = body;
+        c->body_size = length;
+    }
+}
+
+/* answers the request header that takes up the first length bytes of c->request */
+static void answer(HlsOrigin *origin, Connection *c, int length)
+{
+    char method[8], target[1024], version[16];
+    char *headers, *query;
+    AVBufferRef *data;
+
+    c->request[length - 2] = '\0';
+    headers = strstr(c->request, "\r\n");
+    origin->nb_requests++;
+    if (!headers || sscanf(c->request, "%7s %1023s %15s", method, target, version) != 3 ||
+        target[0] != '/' || strncmp(version, "HTTP/1.", 7)) {
+        c->keep_alive = 0;
+        set_response(c, 400, "Bad Request", "text/plain", NULL, 0, 0);
+        return;
+    }
+    c->keep_alive = strcmp(version, "HTTP/1.0") ? !strcasestr(headers, "\nConnection: close")
+                                                 : !!strcasestr(headers, "\nConnection: keep-alive");
+    if (strcmp(method, "GET") && strcmp(method, "HEAD")) {
+        set_response(c, 405, "Method Not Allowed", "text/plain", NULL, 0, 0);
+        return;
+    }
+    if ((query = strchr(target, '?')))
+        *query = '\0';
+
+    if (!(data = find_file(origin, target + 1))) {
+        origin->nb_not_found++;
+        set_response(c, 404, "Not Found", "text/plain", NULL, 0, 0);
+        return;
+    }
+    set_response(c, 200, "OK", content_type(target + 1), data, data->size, !strcmp(method, "HEAD"));
+}
+
+static int response_pending(const Connection *c)
+{
+    return c->header_sent < c->header_size || c->body_sent < c->body_size;
+}
+
+/* as much of the response as the socket takes */
+static int send_response(HlsOrigin *origin, Connection *c)
+{
+    while (response_pending(c)) {
+        struct iovec iov[2];
+        struct msghdr message = { .msg_iov = iov };
+        ssize_t n;
+
+        if (c->header_sent < c->header_size) {
+            iov[message.msg_iovlen].iov_base = c->header + c->header_sent;
+            iov[message.msg_iovlen++].iov_len = c->header_size - c->header_sent;
+        }
+        if (c->body_sent < c->body_size) {
+            iov[message.msg_iovlen].iov_base = c->body->data + c->body_sent;
+            iov[message.msg_iovlen++].iov_len = c->body_size - c->body_sent;
+        }
+        if ((n = sendmsg(c->fd, &message, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : AVERROR(errno);
+        }
+        origin->bytes_sent += n;
+        if (c->header_sent < c->header_size) {
+            int header = FFMIN(n, c->header_size - c->header_sent);
+
+            c->header_sent += header;
+            n -= header;
+        }
+        c->body_sent += n;
+    }
+    av_buffer_unref(&c->body);
+    c->body_size = c->body_sent = 0;
+    return 0;
+}
+
+static int poll_for(HlsOrigin *origin, Connection *c, int writing)
+{
+    struct epoll_event event = { .events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+
+    if (c->writing == writing)
+        return 0;
+    c->writing = writing;
+    return epoll_ctl(origin->epoll_fd, EPOLL_CTL_MOD, c->fd, &event) < 0 ? AVERROR(errno) : 0;
+}
+
+/* reads, answers and sends until the socket would block; < 0 closes the connection */
+static int serve_connection(HlsOrigin *origin, Connection *c)
+{
+    for (;;) {
+        char *end;
+        ssize_t n;
+        int ret;
+
+        if (response_pending(c)) {
+            if ((ret = send_response(origin, c)) < 0)
+                return ret;
+            if (response_pending(c))
+                return poll_for(origin, c, 1);
+            if (!c->keep_alive)
+                return AVERROR_EOF;
+            continue;
+        }
+
+        /* pipelined requests are answered one after the other */
+        if ((end = memmem(c->request, c->request_size, "\r\n\r\n", 4))) {
+            int length = end + 4 - c->request;
+
+            answer(origin, c, length);
+            memmove(c->request, c->request + length, c->request_size - length);
+            c->request_size -= length;
+            continue;
+        }
+        if (c->request_size == sizeof(c->request))
+            return AVERROR(EINVAL);
+
+        n = recv(c->fd, c->request + c->request_size, sizeof(c->request) - c->request_size, 0);
+        if (n == 0)
+            return AVERROR_EOF;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? poll_for(origin, c, 0) : AVERROR(errno);
+        }
+        c->request_size += n;
+    }
+}
+
+static void close_connection(HlsOrigin *origin, Connection *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        origin->connections = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    close(c->fd);
+    av_buffer_unref(&c->body);
+    av_free(c);
+}
+
+static void accept_connections(HlsOrigin *origin)
+{
+    for (;;) {
+        struct epoll_event event = { .events = EPOLLIN };
+        Connection *c;
+        int one = 1;
+        int fd = accept4(origin->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_warning("origin: accept failed: %s", strerror(errno));
+            return;
+        }
+        /* responses go out whole, do not hold their last bytes back */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!(c = av_mallocz(sizeof(*c)))) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        event.data.ptr = c;
+        if (epoll_ctl(origin->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            av_free(c);
+            continue;
+        }
+        if ((c->next = origin->connections))
+            c->next->prev = c;
+        origin->connections = c;
+        origin->nb_connections++;
+    }
+}
+
+static void *server_main(void *arg)
+{
+    HlsOrigin *origin = arg;
+    struct epoll_event events[ORIGIN_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(origin->epoll_fd, events, ORIGIN_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("origin: epoll_wait failed: %s", strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+
+            if (events[i].data.ptr == &origin->wake_fd)
+                return NULL;
+            if (events[i].data.ptr == &origin->listen_fd) {
+                accept_connections(origin);
+                continue;
+            }
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) || serve_connection(origin, c) < 0)
+                close_connection(origin, c);
+        }
+    }
+}
+
+int hls_origin_start(HlsOrigin **origin, int port)
+{
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct epoll_event event = { .events = EPOLLIN };
+    HlsOrigin *o;
+    int one = 1;
+    int ret;
+
+    if (!(o = av_mallocz(sizeof(*o))))
+        return AVERROR(ENOMEM);
+    o->port = port;
+    o->listen_fd = o->epoll_fd = o->wake_fd = -1;
+    pthread_mutex_init(&o->lock, NULL);
+
+    if ((o->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(o->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(o->listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(o->listen_fd, SOMAXCONN) < 0 ||
+        (o->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (o->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        ret = AVERROR(errno);
+        log_error("origin: cannot listen on 127.0.0.1:%d: %s", port, av_err2str(ret));
+        goto fail;
+    }
+    event.data.ptr = &o->listen_fd;
+    if (epoll_ctl(o->epoll_fd, EPOLL_CTL_ADD, o->listen_fd, &event) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    event.data.ptr = &o->wake_fd;
+    if (epoll_ctl(o->epoll_fd, EPOLL_CTL_ADD, o->wake_fd, &event) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    if ((ret = pthread_create(&o->thread, NULL, server_main, o))) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+
+    log_info("origin: serving on http://127.0.0.1:%d/", port);
+    *origin = o;
+    return 0;
+
+fail:
+    if (o->wake_fd >= 0)
+        close(o->wake_fd);
+    if (o->epoll_fd >= 0)
+        close(o->epoll_fd);
+    if (o->listen_fd >= 0)
+        close(o->listen_fd);
+    pthread_mutex_destroy(&o->lock);
+    av_free(o);
+    return ret;
+}
+
+int hls_origin_publish(HlsOrigin *origin, const char *name, AVBufferRef **data)
+{
+    OriginFile *files, *file = NULL;
+    int ret = 0;
+
+    pthread_mutex_lock(&origin->lock);
+    for (int i = 0; i < origin->nb_files; i++)
+        if (!strcmp(origin->files[i].name, name)) {
+            file = &origin->files[i];
+            break;
+        }
+    if (!file) {
+        if (!(files = av_realloc_array(origin->files, origin->nb_files + 1, sizeof(*files)))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        origin->files = files;
+        file = &files[origin->nb_files];
+        if (!(file->name = av_strdup(name))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        file->data = NULL;
+        origin->nb_files++;
+    }
+    av_buffer_unref(&file->data);
+    file->data = *data;
+    *data = NULL;
+
+end:
+    pthread_mutex_unlock(&origin->lock);
+    av_buffer_unref(data);
+    return ret;
+}
+
+static int io_open(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options)
+{
+    HlsOrigin *origin = s->opaque;
+    OpenFile *open_files;
+    const char *base, *extension;
+    char *name;
+    int ret;
+
+    if (flags & AVIO_FLAG_READ)
+        return origin->io_open(s, pb, url, flags, options);
+    /*
+     * hlsenc writes a playlist to "<name>.tmp" and renames it after closing
+     * it. Nothing is on disk to rename, so it is published under the name
+     * the rename would have given it, and the failed rename is only logged.
+     */
+    base = av_basename(url);
+    extension = strrchr(base, '.');
+    if (!(name = extension && !strcmp(extension, ".tmp") ? av_strndup(base, extension - base) : av_strdup(base)))
+        return AVERROR(ENOMEM);
+    if ((ret = avio_open_dyn_buf(pb)) < 0) {
+        av_free(name);
+        return ret;
+    }
+
+    pthread_mutex_lock(&origin->lock);
+    open_files = av_realloc_array(origin->open_files, origin->nb_open_files + 1, sizeof(*open_files));
+    if (open_files) {
+        origin->open_files = open_files;
+        open_files[origin->nb_open_files++] = (OpenFile){ .pb = *pb, .name = name };
+    }
+    pthread_mutex_unlock(&origin->lock);
+    if (!open_files) {
+        uint8_t *data;
+
+        avio_close_dyn_buf(*pb, &data);
+        av_free(data);
+        av_free(name);
+        *pb = NULL;
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static void io_close(AVFormatContext *s, AVIOContext *pb)
+{
+    HlsOrigin *origin = s->opaque;
+    AVBufferRef *buffer;
+    uint8_t *data;
+    char *name = NULL;
+    int size;
+
+    pthread_mutex_lock(&origin->lock);
+    for (int i = 0; i < origin->nb_open_files; i++)
+        if (origin->open_files[i].pb == pb) {
+            name = origin->open_files[i].name;
+            origin->open_files[i] = origin->open_files[--origin->nb_open_files];
+            break;
+        }
+    pthread_mutex_unlock(&origin->lock);
+    if (!name) {
+        origin->io_close(s, pb);
+        return;
+    }
+
+    size = avio_close_dyn_buf(pb, &data);
+    if (!(buffer = av_buffer_create(data, size, av_buffer_default_free, NULL, 0)))
+        av_free(data);
+    if (!buffer || hls_origin_publish(origin, name, &buffer) < 0)
+        log_error("origin: cannot keep %s", name);
+    av_free(name);
+}
+
+void hls_origin_attach(HlsOrigin *origin, AVFormatContext *format_context)
+{
+    /* every muxer context starts out with the same defaults */
+    if (!origin->io_open) {
+        origin->io_open = format_context->io_open;
+        origin->io_close = format_context->io_close;
+    }
+    format_context->opaque = origin;
+    format_context->io_open = io_open;
+    format_context->io_close = io_close;
+}
+
+void hls_origin_stop(HlsOrigin **origin)
+{
+    HlsOrigin *o = *origin;
+    uint64_t one = 1;
+    int64_t bytes = 0;
+
+    if (!o)
+        return;
+    if (write(o->wake_fd, &one, sizeof(one)) < 0)
+        log_warning("origin: cannot wake the server thread");
+    pthread_join(o->thread, NULL);
+    while (o->connections)
+        close_connection(o, o->connections);
+
+    for (int i = 0; i < o->nb_files; i++) {
+        bytes += o->files[i].data->size;
+        av_free(o->files[i].name);
+        av_buffer_unref(&o->files[i].data);
+    }
+    log_info("origin: %d files, %"PRId64" KB held, %"PRId64" connections, %"PRId64" requests "
+             "(%"PRId64" not found), %.1f MB sent", o->nb_files, bytes / 1024, o->nb_connections,
+             o->nb_requests, o->nb_not_found, o->bytes_sent / 1048576.0);
+    av_free(o->files);
+    for (int i = 0; i < o->nb_open_files; i++) {
+        uint8_t *data;
+
+        avio_close_dyn_buf(o->open_files[i].pb, &data);
+        av_free(data);
+        av_free(o->open_files[i].name);
+    }
+    av_free(o->open_files);
+
+    close(o->wake_fd);
+    close(o->epoll_fd);
+    close(o->listen_fd);
+    pthread_mutex_destroy(&o->lock);
+    av_freep(origin);
+}
@@ -0,0 +1,31 @@
+#ifndef HLS_ORIGIN_H
+#define HLS_ORIGIN_H
+
+#include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+
+/*
+ * HTTP/1.1 origin for HLS output kept in memory, to load-test delivery with
+ * no disk and no separate web server in the way. One thread runs an epoll
+ * loop over non-blocking sockets bound to 127.0.0.1 only. GET and HEAD of
+ * "/<name>" are answered from the stored buffer: header and body go out
+ * together in one sendmsg() with two iovecs, straight from the buffer, and
+ * keep-alive and pipelined requests are served on the same connection.
+ * Publishing a name again replaces the file; responses already under way
+ * keep the reference they took to the old one.
+ */
+typedef struct HlsOrigin HlsOrigin;
+
+int hls_origin_start(HlsOrigin **origin, int port);
+/* serves *data as /name from now on, taking the reference over */
+int hls_origin_publish(HlsOrigin *origin, const char *name, AVBufferRef **data);
+/*
+ * Takes over io_open/io_close of a muxer: the files it writes are kept in
+ * memory and published under their base name when closed, nothing goes to
+ * disk. Reads still go through the muxer's own callbacks.
+ */
+void hls_origin_attach(HlsOrigin *origin, AVFormatContext *format_context);
+/* closes every connection, then frees the files */
+void hls_origin_stop(HlsOrigin **origin);
+
+#endif
@@ -0,0 +1,329 @@
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavutil/timestamp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "keyframe_index.h"
+#include "log.h"
+
+static const char index_magic[8] = "KFINDEX";
+
+/* keyframes of one stream while the input is scanned */
+typedef struct StreamScan
+{
+    KeyframeEntry *entries;
+    int nb_entries;
+    int capacity;
+    int64_t nb_packets;
+    int64_t last_pts;
+} StreamScan;
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* points header, streams and entries into index->data once it checks out */
+static int parse_index(KeyframeIndex *index, const struct stat *input)
+{
+    const KeyframeIndexHeader *header = (const KeyframeIndexHeader *)index->data;
+    const KeyframeIndexStream *streams;
+    uint64_t nb_entries = 0;
+    size_t tables;
+
+    if (index->size < sizeof(*header) || memcmp(header->magic, index_magic, sizeof(index_magic)) ||
+        header->version != KEYFRAME_INDEX_VERSION)
+        return AVERROR_INVALIDDATA;
+    /* the input changed since the index was written */
+    if (header->input_size != input->st_size || header->input_mtime_ns != mtime_ns(input))
+        return AVERROR_INVALIDDATA;
+
+    tables = sizeof(*header) + (size_t)header->nb_streams * sizeof(*streams);
+    if (header->nb_streams > 65536 || index->size < tables)
+        return AVERROR_INVALIDDATA;
+    streams = (const KeyframeIndexStream *)(index->data + sizeof(*header));
+    for (uint32_t i = 0; i < header->nb_streams; i++) {
+        if (streams[i].first_entry != nb_entries)
+            return AVERROR_INVALIDDATA;
+        nb_entries += streams[i].nb_keyframes;
+    }
+    if (index->size != tables + nb_entries * sizeof(KeyframeEntry))
+        return AVERROR_INVALIDDATA;
+
+    index->header = header;
+    index->streams = streams;
+    index->entries = (const KeyframeEntry *)(index->data + tables);
+    return 0;
+}
+
+static int map_index(KeyframeIndex *index, const char *filename)
+{
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return AVERROR(errno);
+
+    index->data = data;
+    index->size = st.st_size;
+    index->mapped = 1;
+    return 0;
+}
+
+static int add_keyframe(StreamScan *scan, const AVPacket *packet, int64_t pts)
+{
+    KeyframeEntry *entry;
+
+    if (scan->nb_entries == scan->capacity) {
+        int capacity = scan->capacity ? scan->capacity * 2 : 64;
+        KeyframeEntry *grown = av_realloc_array(scan->entries, capacity, sizeof(*grown));
+
+        if (!grown)
+            return AVERROR(ENOMEM);
+        scan->entries = grown;
+        scan->capacity = capacity;
+    }
+    if (scan->nb_entries > 0) {
+        entry = &scan->entries[scan->nb_entries - 1];
+        entry->gop_length = scan->nb_packets - entry->packet_number;
+    }
+
+    entry = &scan->entries[scan->nb_entries++];
+    entry->pts = pts;
+    entry->pos = packet->pos;
+    entry->packet_number = scan->nb_packets;
+    entry->size = packet->size;
+    entry->gop_length = 0;
+    return 0;
+}
+
+/* reads every packet once, nothing is decoded, into a heap copy of the sidecar */
+static int build_index(KeyframeIndex *index, const char *input_filename, const struct stat *input)
+{
+    AVFormatContext *format_context = NULL;
+    AVPacket *packet = NULL;
+    StreamScan *scans = NULL;
+    KeyframeIndexHeader *header;
+    KeyframeIndexStream *streams;
+    KeyframeEntry *entries;
+    unsigned int nb_scans = 0;
+    uint64_t nb_entries = 0;
+    int ret;
+
+    if ((ret = avformat_open_input(&format_context, input_filename, NULL, NULL)) < 0) {
+        log_error("Cannot open input file %s", input_filename);
+        return ret;
+    }
+    if (!(packet = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while ((ret = av_read_frame(format_context, packet)) >= 0) {
+        StreamScan *scan;
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+        /* streams may show up while reading, MPEG-TS announces them late */
+        if (packet->stream_index >= nb_scans) {
+            StreamScan *grown = av_realloc_array(scans, format_context->nb_streams, sizeof(*scans));
+
+            if (!grown) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            scans = grown;
+            for (unsigned int i = nb_scans; i < format_context->nb_streams; i++) {
+                memset(&scans[i], 0, sizeof(scans[i]));
+                scans[i].last_pts = AV_NOPTS_VALUE;
+            }
+            nb_scans = format_context->nb_streams;
+        }
+        scan = &scans[packet->stream_index];
+
+        if (pts != AV_NOPTS_VALUE && (scan->last_pts == AV_NOPTS_VALUE || pts > scan->last_pts))
+            scan->last_pts = pts;
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+            log_trace("index: stream %d keyframe pts %s pos %"PRId64" size %d", packet->stream_index,
+                      av_ts2str(pts), packet->pos, packet->size);
+            if ((ret = add_keyframe(scan, packet, pts)) < 0)
+                goto end;
+        }
+        scan->nb_packets++;
+        av_packet_unref(packet);
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+
+    for (unsigned int i = 0; i < nb_scans; i++) {
+        StreamScan *scan = &scans[i];
+
+        if (scan->nb_entries > 0) {
+            KeyframeEntry *last = &scan->entries[scan->nb_entries - 1];
+            last->gop_length = scan->nb_packets - last->packet_number;
+        }
+        /* nothing to look up when every packet is a keyframe, as with most audio */
+        if (scan->nb_entries == scan->nb_packets)
+            scan->nb_entries = 0;
+        nb_entries += scan->nb_entries;
+    }
+
+    index->size = sizeof(*header) + nb_scans * sizeof(*streams) + nb_entries * sizeof(*entries);
+    if (!(index->data = av_mallocz(index->size))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    header = (KeyframeIndexHeader *)index->data;
+    streams = (KeyframeIndexStream *)(index->data + sizeof(*header));
+    entries = (KeyframeEntry *)(index->data + sizeof(*header) + nb_scans * sizeof(*streams));
+
+    memcpy(header->magic, index_magic, sizeof(index_magic));
+    header->version = KEYFRAME_INDEX_VERSION;
+    header->nb_streams = nb_scans;
+    header->input_size = input->st_size;
+    header->input_mtime_ns = mtime_ns(input);
+
+    nb_entries = 0;
+    for (unsigned int i = 0; i < nb_scans; i++) {
+        AVStream *stream = format_context->streams[i];
+
+        streams[i].time_base_num = stream->time_base.num;
+        streams[i].time_base_den = stream->time_base.den;
+        streams[i].codec_type = stream->codecpar->codec_type;
+        streams[i].nb_keyframes = scans[i].nb_entries;
+        streams[i].nb_packets = scans[i].nb_packets;
+        streams[i].last_pts = scans[i].last_pts;
+        streams[i].first_entry = nb_entries;
+        if (scans[i].nb_entries)
+            memcpy(entries + nb_entries, scans[i].entries, scans[i].nb_entries * sizeof(*entries));
+        nb_entries += scans[i].nb_entries;
+    }
+    ret = 0;
+
+end:
+    for (unsigned int i = 0; i < nb_scans; i++)
+        av_free(scans[i].entries);
+    av_free(scans);
+    av_packet_free(&packet);
+    avformat_close_input(&format_context);
+    return ret;
+}
+
+/* written under a temporary name and renamed, so readers never see half a file */
+static int write_index(const KeyframeIndex *index, const char *filename)
+{
+    char temporary[1024];
+    size_t written = 0;
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return AVERROR(errno);
+    while (written < index->size) {
+        ssize_t n = write(fd, index->data + written, index->size - written);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            unlink(temporary);
+            return AVERROR(errno);
+        }
+        written += n;
+    }
+    if (close(fd) < 0 || rename(temporary, filename) < 0) {
+        unlink(temporary);
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+int keyframe_index_open(KeyframeIndex *index, const char *input_filename)
+{
+    char index_filename[1024];
+    struct stat input;
+    int64_t started;
+    int ret;
+
+    memset(index, 0, sizeof(*index));
+    if (stat(input_filename, &input) < 0 || !S_ISREG(input.st_mode)) {
+        log_warning("No keyframe index for %s, it is not a local file", input_filename);
+        return AVERROR(EINVAL);
+    }
+    snprintf(index_filename, sizeof(index_filename), "%s.kfi", input_filename);
+
+    if (map_index(index, index_filename) >= 0 && parse_index(index, &input) >= 0)
+        return 0;
+    keyframe_index_close(index);
+
+    started = av_gettime_relative();
+    if ((ret = build_index(index, input_filename, &input)) < 0 ||
+        (ret = parse_index(index, &input)) < 0) {
+        keyframe_index_close(index);
+        return ret;
+    }
+    if ((ret = write_index(index, index_filename)) < 0)
+        log_warning("Cannot write keyframe index %s (%s), keeping it in memory",
+                    index_filename, av_err2str(ret));
+    log_info("keyframe index of %s built in %"PRId64" ms, %zu bytes", input_filename,
+             (av_gettime_relative() - started) / 1000, index->size);
+    return 0;
+}
+
+void keyframe_index_close(KeyframeIndex *index)
+{
+    if (index->mapped)
+        munmap(index->data, index->size);
+    else
+        av_free(index->data);
+    memset(index, 0, sizeof(*index));
+}
+
+const KeyframeEntry *keyframe_index_find(const KeyframeIndex *index, int stream_index, int64_t pts)
+{
+    const KeyframeIndexStream *stream;
+    const KeyframeEntry *entries;
+    int64_t low = 0, high;
+
+    if (!index->header || stream_index < 0 || stream_index >= index->header->nb_streams)
+        return NULL;
+    stream = &index->streams[stream_index];
+    entries = index->entries + stream->first_entry;
+    high = stream->nb_keyframes;
+
+    /* keyframes come in pts order; find the first one after pts */
+    while (low < high) {
+        int64_t middle = low + (high - low) / 2;
+
+        if (entries[middle].pts <= pts)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low > 0 ? &entries[low - 1] : NULL;
+}
+
+int keyframe_index_seek(AVFormatContext *format_context, int stream_index,
+                        const KeyframeEntry *entry)
+{
+    int ret = av_seek_frame(format_context, stream_index, entry->pts, AVSEEK_FLAG_BACKWARD);
+
+    if (ret < 0 && entry->pos >= 0 && !(format_context->iformat->flags & AVFMT_NO_BYTE_SEEK))
+        ret = av_seek_frame(format_context, stream_index, entry->pos, AVSEEK_FLAG_BYTE);
+    return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+#include <libavformat/avformat.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sidecar file "<input>.kfi" listing every keyframe of every stream, built
+ * from one pass over the packet headers (nothing is decoded). The layout is
+ * a header, one KeyframeIndexStream per input stream, then all entries,
+ * stream after stream, in native byte order. A later run maps it and looks
+ * keyframes up with a binary search instead of scanning the input again.
+ * The input's size and modification time are recorded, a changed input gets
+ * a fresh index.
+ */
+#define KEYFRAME_INDEX_VERSION 1
+
+typedef struct KeyframeIndexHeader
+{
+    char magic[8];              /* "KFINDEX\0" */
+    uint32_t version;
+    uint32_t nb_streams;
+    int64_t input_size;
+    int64_t input_mtime_ns;
+} KeyframeIndexHeader;
+
+typedef struct KeyframeIndexStream
+{
+    int32_t time_base_num, time_base_den;
+    int32_t codec_type;         /* enum AVMediaType */
+    uint32_t nb_keyframes;      /* entries, 0 when every packet is a keyframe */
+    int64_t nb_packets;
+    int64_t last_pts;           /* highest pts in the stream, AV_NOPTS_VALUE if none */
+    uint64_t first_entry;       /* of this stream, counted over the whole entry table */
+} KeyframeIndexStream;
+
+typedef struct KeyframeEntry
+{
+    int64_t pts;                /* stream time base; dts when the packet has no pts */
+    int64_t pos;                /* byte offset of the packet in the input, -1 if unknown */
+    int64_t packet_number;      /* packets of the stream before this one, decode order */
+    int32_t size;               /* packet size in bytes */
+    int32_t gop_length;         /* packets from this keyframe up to the next one */
+} KeyframeEntry;
+
+typedef struct KeyframeIndex
+{
+    uint8_t *data;              /* mapped sidecar, or a heap copy when it could not be written */
+    size_t size;
+    int mapped;
+
+    const KeyframeIndexHeader *header;
+    const KeyframeIndexStream *streams;
+    const KeyframeEntry *entries;
+} KeyframeIndex;
+
+/*
+ * Maps "<input>.kfi", or scans the input and writes it first when it is
+ * missing, stale or broken. Failing to write the sidecar is not an error:
+ * the index then lives in memory for this run only.
+ */
+int keyframe_index_open(KeyframeIndex *index, const char *input_filename);
+void keyframe_index_close(KeyframeIndex *index);
+
+/* last keyframe of the stream at or before pts (its time base); NULL if none */
+const KeyframeEntry *keyframe_index_find(const KeyframeIndex *index, int stream_index, int64_t pts);
+
+/*
+ * Puts the demuxer on the keyframe: by its exact timestamp, or by its byte
+ * offset for demuxers that cannot seek by time.
+ */
+int keyframe_index_seek(AVFormatContext *format_context, int stream_index,
+                        const KeyframeEntry *entry);
+
+#endif
@@ -0,0 +1,307 @@
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "live_hls.h"
+#include "log.h"
+
+/* segments kept on disk past the window, for players still fetching them */
+#define LIVE_HLS_KEEP 2
+/* finished segments whose parts stay listed, as LL-HLS asks for the last few */
+#define LIVE_HLS_PART_SEGMENTS 3
+
+typedef struct LivePart
+{
+    double duration;
+    int64_t offset, size;   /* byte range in the segment file */
+    int independent;        /* starts with a keyframe */
+} LivePart;
+
+typedef struct LiveSegment
+{
+    int64_t sequence;
+    char filename[1024];
+    double duration;
+    LivePart *parts;
+    int nb_parts;
+} LiveSegment;
+
+struct LiveHls
+{
+    const AVFormatContext *streams_from;
+    LiveHlsOptions options;
+    char playlist[1024];
+    char stem[1024];
+    int reference;          /* stream cutting segments and parts: the first video one, else 0 */
+
+    LiveSegment *segments;  /* oldest first, the last one is open while muxer is */
+    int nb_segments;
+    int64_t next_sequence;
+    int target_duration;    /* seconds, fixed for the whole stream as HLS requires */
+
+    AVFormatContext *muxer; /* of the segment being written */
+    int64_t segment_start, part_start, last_time; /* AV_TIME_BASE, on the reference stream */
+    int64_t part_offset;
+    int part_independent;
+};
+
+static LiveSegment *current_segment(LiveHls *live)
+{
+    return &live->segments[live->nb_segments - 1];
+}
+
+/* the filename relative to the playlist, which lives in the same directory */
+static const char *segment_uri(const LiveSegment *segment)
+{
+    const char *slash = strrchr(segment->filename, '/');
+
+    return slash ? slash + 1 : segment->filename;
+}
+
+/* written under a temporary name and renamed, so players never read half a playlist */
+static int write_playlist(LiveHls *live, int ended)
+{
+    const LiveHlsOptions *options = &live->options;
+    int nb_finished = live->nb_segments - (live->muxer != NULL);
+    int first = FFMAX(nb_finished - options->window, 0);
+    char temporary[1040];
+    FILE *playlist;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", live->playlist);
+    if (!(playlist = fopen(temporary, "w")))
+        return AVERROR(errno);
+
+    fprintf(playlist, "#EXTM3U\n#EXT-X-VERSION:6\n#EXT-X-TARGETDURATION:%d\n", live->target_duration);
+    /* plain files cannot hold a _HLS_msn request open, so no CAN-BLOCK-RELOAD: players poll */
+    if (options->part_time > 0)
+        fprintf(playlist, "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n"
+                "#EXT-X-PART-INF:PART-TARGET=%.3f\n", 3 * options->part_time, options->part_time);
+    fprintf(playlist, "#EXT-X-MEDIA-SEQUENCE:%"PRId64"\n",
+            first < live->nb_segments ? live->segments[first].sequence : live->next_sequence);
+
+    for (int i = first; i < live->nb_segments; i++) {
+        const LiveSegment *segment = &live->segments[i];
+
+        if (options->part_time > 0 && i >= nb_finished - LIVE_HLS_PART_SEGMENTS)
+            for (int p = 0; p < segment->nb_parts; p++)
+                fprintf(playlist, "#EXT-X-PART:DURATION=%.3f,URI=\"%s\",BYTERANGE=\"%"PRId64"@%"PRId64"\"%s\n",
+                        segment->parts[p].duration, segment_uri(segment), segment->parts[p].size,
+                        segment->parts[p].offset, segment->parts[p].independent ? ",INDEPENDENT=YES" : "");
+        if (i < nb_finished)
+            fprintf(playlist, "#EXTINF:%.3f,\n%s\n", segment->duration, segment_uri(segment));
+    }
+    if (live->muxer && options->part_time > 0)
+        fprintf(playlist, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\",BYTERANGE-START=%"PRId64"\n",
+                segment_uri(current_segment(live)), live->part_offset);
+    if (ended)
+        fprintf(playlist, "#EXT-X-ENDLIST\n");
+
+    if (fclose(playlist) || rename(temporary, live->playlist) < 0) {
+        unlink(temporary);
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+static int open_segment(LiveHls *live, int64_t time, int independent)
+{
+    const AVFormatContext *streams_from = live->streams_from;
+    AVDictionary *muxer_options = NULL;
+    LiveSegment *segments, *segment;
+    int ret;
+
+    segments = av_realloc_array(live->segments, live->nb_segments + 1, sizeof(*segments));
+    if (!segments)
+        return AVERROR(ENOMEM);
+    live->segments = segments;
+    segment = &segments[live->nb_segments++];
+    memset(segment, 0, sizeof(*segment));
+    segment->sequence = live->next_sequence++;
+    snprintf(segment->filename, sizeof(segment->filename), "%s%"PRId64".ts", live->stem, segment->sequence);
+
+    if ((ret = avformat_alloc_output_context2(&live->muxer, NULL, "mpegts", segment->filename)) < 0)
+        return ret;
+    for (unsigned int i = 0; i < streams_from->nb_streams; i++) {
+        AVStream *stream = avformat_new_stream(live->muxer, NULL);
+
+        if (!stream)
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_parameters_copy(stream->codecpar, streams_from->streams[i]->codecpar)) < 0)
+            return ret;
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = streams_from->streams[i]->time_base;
+    }
+    live->muxer->output_ts_offset = streams_from->output_ts_offset;
+    if ((ret = avio_open(&live->muxer->pb, segment->filename, AVIO_FLAG_WRITE)) < 0)
+        return ret;
+
+    /* every packet goes out as it comes in, audio is not gathered into bigger PES packets */
+    av_dict_set(&muxer_options, "pes_payload_size", "0", 0);
+    ret = avformat_write_header(live->muxer, &muxer_options);
+    av_dict_free(&muxer_options);
+    if (ret < 0)
+        return ret;
+
+    live->segment_start = live->part_start = time;
+    live->part_offset = 0;
+    live->part_independent = independent;
+    return write_playlist(live, 0);
+}
+
+/* everything written up to now becomes a part readers can fetch */
+static int finish_part(LiveHls *live, int64_t end)
+{
+    LiveSegment *segment = current_segment(live);
+    LivePart *parts, *part;
+    int64_t offset;
+    int ret;
+
+    if ((ret = av_interleaved_write_frame(live->muxer, NULL)) < 0)
+        return ret;
+    avio_flush(live->muxer->pb);
+    offset = avio_tell(live->muxer->pb);
+
+    if (live->options.part_time > 0 && offset > live->part_offset) {
+        parts = av_realloc_array(segment->parts, segment->nb_parts + 1, sizeof(*parts));
+        if (!parts)
+            return AVERROR(ENOMEM);
+        segment->parts = parts;
+        part = &parts[segment->nb_parts++];
+        part->duration = (end - live->part_start) / (double)AV_TIME_BASE;
+        part->offset = live->part_offset;
+        part->size = offset - live->part_offset;
+        part->independent = live->part_independent;
+    }
+    live->part_start = end;
+    live->part_offset = offset;
+    return 0;
+}
+
+static void free_segment(LiveSegment *segment)
+{
+    av_freep(&segment->parts);
+}
+
+static int finish_segment(LiveHls *live, int64_t end)
+{
+    LiveSegment *segment = current_segment(live);
+    int ret;
+
+    if ((ret = finish_part(live, end)) < 0 || (ret = av_write_trailer(live->muxer)) < 0)
+        return ret;
+    avio_closep(&live->muxer->pb);
+    avformat_free_context(live->muxer);
+    live->muxer = NULL;
+
+    segment->duration = (end - live->segment_start) / (double)AV_TIME_BASE;
+    /* keyframes too far apart, as in copied video; the target cannot grow mid-stream */
+    if (lrint(segment->duration) > live->target_duration)
+        log_warning("live: %s lasts %.3f s, longer than the %d s target duration", segment->filename,
+                    segment->duration, live->target_duration);
+    log_debug("live: %s, %.3f s in %d parts", segment->filename, segment->duration, segment->nb_parts);
+
+    while (live->nb_segments > live->options.window + LIVE_HLS_KEEP) {
+        if (unlink(live->segments[0].filename) < 0)
+            log_warning("live: cannot delete %s", live->segments[0].filename);
+        free_segment(&live->segments[0]);
+        memmove(&live->segments[0], &live->segments[1], --live->nb_segments * sizeof(*live->segments));
+    }
+    return 0;
+}
+
+int live_hls_open(LiveHls **live, const AVFormatContext *streams_from, const char *playlist_filename,
+                  const LiveHlsOptions *options)
+{
+    LiveHls *l;
+    const char *extension = strrchr(playlist_filename, '.');
+    int stem_length = extension ? extension - playlist_filename : strlen(playlist_filename);
+
+    if (!(l = av_mallocz(sizeof(*l))))
+        return AVERROR(ENOMEM);
+    l->streams_from = streams_from;
+    l->options = *options;
+    snprintf(l->playlist, sizeof(l->playlist), "%s", playlist_filename);
+    snprintf(l->stem, sizeof(l->stem), "%.*s", stem_length, playlist_filename);
+    l->segment_start = l->part_start = l->last_time = AV_NOPTS_VALUE;
+    /* segments are cut at the first keyframe past segment_time, encoded video has one right there */
+    l->target_duration = FFMAX((int)ceil(options->segment_time), 1);
+
+    for (unsigned int i = 0; i < streams_from->nb_streams; i++)
+        if (streams_from->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            l->reference = i;
+            break;
+        }
+
+    log_info("live: %s, %.1f s segments, %.3f s parts, %d in the window", playlist_filename,
+             options->segment_time, options->part_time, options->window);
+    *live = l;
+    return 0;
+}
+
+int live_hls_write_packet(LiveHls *live, AVPacket *packet)
+{
+    AVStream *stream = live->streams_from->streams[packet->stream_index];
+
+    if (packet->stream_index == live->reference && packet->pts != AV_NOPTS_VALUE) {
+        int64_t time = av_rescale_q(packet->pts, stream->time_base, AV_TIME_BASE_Q);
+        int64_t duration = av_rescale_q(packet->duration, stream->time_base, AV_TIME_BASE_Q);
+        int key = (packet->flags & AV_PKT_FLAG_KEY) || stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO;
+        int ret = 0;
+
+        if (!live->muxer) {
+            if (key)
+                ret = open_segment(live, time, 1);
+        } else if (key && time - live->segment_start >= live->options.segment_time * AV_TIME_BASE) {
+            if ((ret = finish_segment(live, time)) >= 0)
+                ret = open_segment(live, time, 1);
+        } else if (live->options.part_time > 0 && time > live->part_start &&
+                   time - live->part_start + duration > live->options.part_time * AV_TIME_BASE) {
+            /* cut before the frame that would take the part past its target */
+            if ((ret = finish_part(live, time)) >= 0)
+                ret = write_playlist(live, 0);
+            live->part_independent = key;
+        }
+        if (ret < 0) {
+            av_packet_unref(packet);
+            return ret;
+        }
+        live->last_time = FFMAX(live->last_time, time + duration);
+    }
+
+    /* nothing to show before the first keyframe */
+    if (!live->muxer) {
+        av_packet_unref(packet);
+        return 0;
+    }
+    av_packet_rescale_ts(packet, stream->time_base, live->muxer->streams[packet->stream_index]->time_base);
+    return av_interleaved_write_frame(live->muxer, packet);
+}
+
+int live_hls_close(LiveHls *live)
+{
+    int ret;
+
+    if (live->muxer && (ret = finish_segment(live, live->last_time)) < 0)
+        return ret;
+    return write_playlist(live, 1);
+}
+
+void live_hls_free(LiveHls **live)
+{
+    LiveHls *l = *live;
+
+    if (!l)
+        return;
+    if (l->muxer) {
+        avio_closep(&l->muxer->pb);
+        avformat_free_context(l->muxer);
+    }
+    for (int i = 0; i < l->nb_segments; i++)
+        free_segment(&l->segments[i]);
+    av_free(l->segments);
+    av_freep(live);
+}
@@ -0,0 +1,35 @@
+#ifndef LIVE_HLS_H
+#define LIVE_HLS_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Live HLS packager for an input that is still growing. Packets are cut into
+ * MPEG-TS segments at keyframes; each segment is written as it comes in, in
+ * LL-HLS partial segments addressed by byte range, and the playlist is
+ * rewritten after every part. The playlist slides: it lists the last
+ * window segments, and files further back are deleted.
+ */
+typedef struct LiveHlsOptions
+{
+    double segment_time;    /* target segment duration in seconds */
+    double part_time;       /* target part duration in seconds, 0 = no partial segments */
+    int window;             /* segments listed in the playlist */
+} LiveHlsOptions;
+
+typedef struct LiveHls LiveHls;
+
+/*
+ * The streams, their codec parameters and time bases are taken from
+ * streams_from, a muxer context that is never opened itself. Segments are
+ * written next to the playlist as <stem><sequence>.ts.
+ */
+int live_hls_open(LiveHls **live, const AVFormatContext *streams_from, const char *playlist_filename,
+                  const LiveHlsOptions *options);
+/* packet in the time base of its stream in streams_from; takes the reference over */
+int live_hls_write_packet(LiveHls *live, AVPacket *packet);
+/* finishes the last segment and ends the playlist */
+int live_hls_close(LiveHls *live);
+void live_hls_free(LiveHls **live);
+
+#endif
@@ -0,0 +1,213 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+#define LOG_SLOTS 4096 /* power of two */
+#define LOG_MESSAGE_SIZE 256
+#define LOG_BATCH_SIZE 65536
+
+/*
+ * Bounded multi-producer ring after Dmitry Vyukov's queue. Every slot
+ * carries a sequence number: a producer may fill slot i % LOG_SLOTS when its
+ * sequence is i, and marks it i + 1 when the text is in. The writer thread
+ * empties it and hands it to the next lap as i + LOG_SLOTS. Producers only
+ * race each other on the enqueue counter, with a compare-and-swap.
+ */
+typedef struct LogSlot
+{
+    atomic_size_t sequence;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static LogSlot slots[LOG_SLOTS];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;        /* writer thread only */
+static atomic_size_t written_pos; /* everything before it is on stderr */
+static atomic_int_fast64_t dropped;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_t writer;
+static sem_t wake;
+static atomic_int sleeping;
+static atomic_int stopping;
+static atomic_int running;
+
+static void write_direct(const char *text)
+{
+    fprintf(stderr, "LOG: %s\n", text);
+}
+
+static void wake_writer(void)
+{
+    // pairs with the fence in writer_main: either the writer sees the new
+    // slot, or this sees it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sleeping))
+        sem_post(&wake);
+}
+
+/* moves every filled slot into batch, writing the batch out whenever it fills */
+static void drain(char *batch)
+{
+    size_t length = 0;
+    int64_t lost;
+
+    for (;;) {
+        LogSlot *slot = &slots[dequeue_pos & (LOG_SLOTS - 1)];
+        size_t text_length;
+
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != dequeue_pos + 1)
+            break;
+
+        text_length = strlen(slot->text);
+        if (length + text_length + 6 > LOG_BATCH_SIZE) {
+            fwrite(batch, 1, length, stderr);
+            length = 0;
+        }
+        memcpy(batch + length, "LOG: ", 5);
+        memcpy(batch + length + 5, slot->text, text_length);
+        batch[length + 5 + text_length] = '\n';
+        length += text_length + 6;
+
+        atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_SLOTS, memory_order_release);
+        dequeue_pos++;
+    }
+    if (length)
+        fwrite(batch, 1, length, stderr);
+
+    if ((lost = atomic_exchange(&dropped, 0)) > 0)
+        fprintf(stderr, "LOG: %"PRId64" messages dropped, the log could not keep up\n", lost);
+    atomic_store(&written_pos, dequeue_pos);
+}
+
+static void *writer_main(void *arg)
+{
+    static char batch[LOG_BATCH_SIZE];
+
+    while (!atomic_load(&stopping)) {
+        drain(batch);
+
+        // announce the nap, then look once more so a message queued in
+        // between is not left waiting for the next one
+        atomic_store(&sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&slots[dequeue_pos & (LOG_SLOTS - 1)].sequence,
+                                 memory_order_acquire) != dequeue_pos + 1 &&
+            !atomic_load(&stopping))
+            sem_wait(&wake);
+        atomic_store(&sleeping, 0);
+    }
+    drain(batch);
+    return NULL;
+}
+
+static void log_shutdown(void)
+{
+    // later messages go straight to stderr, the writer empties the ring
+    atomic_store(&running, 0);
+    atomic_store(&stopping, 1);
+    sem_post(&wake);
+    pthread_join(writer, NULL);
+}
+
+static void log_start(void)
+{
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+        atomic_init(&slots[i].sequence, i);
+
+    if (sem_init(&wake, 0, 0) < 0)
+        return;
+    if (pthread_create(&writer, NULL, writer_main, NULL)) {
+        sem_destroy(&wake);
+        return;
+    }
+    atomic_store(&running, 1);
+    atexit(log_shutdown);
+}
+
+void log_message(enum LogLevel level, const char *fmt, ...)
+{
+    va_list args;
+    size_t pos;
+    LogSlot *slot;
+
+    pthread_once(&start_once, log_start);
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        // no writer thread (it could not start, or the process is exiting)
+        char text[LOG_MESSAGE_SIZE];
+        va_start(args, fmt);
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        write_direct(text);
+        return;
+    }
+
+    pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        intptr_t diff;
+
+        slot = &slots[pos & (LOG_SLOTS - 1)];
+        diff = (intptr_t)atomic_load_explicit(&slot->sequence, memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // full: the writer is a whole ring behind
+            if (level == LOG_LEVEL_ERROR) {
+                char text[LOG_MESSAGE_SIZE];
+                va_start(args, fmt);
+                vsnprintf(text, sizeof(text), fmt, args);
+                va_end(args);
+                write_direct(text);
+            } else {
+                atomic_fetch_add(&dropped, 1);
+            }
+            wake_writer();
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    va_start(args, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    wake_writer();
+}
+
+void log_set_level(enum LogLevel level)
+{
+    atomic_store(&log_level, level);
+}
+
+int log_parse_level(const char *name)
+{
+    static const char *const names[] = { "error", "warning", "info", "debug", "trace" };
+
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (!strcmp(name, names[i]))
+            return i;
+    return -1;
+}
+
+void log_flush(void)
+{
+    size_t target = atomic_load(&enqueue_pos);
+
+    while (atomic_load(&running) && (intptr_t)(atomic_load(&written_pos) - target) < 0) {
+        sem_post(&wake);
+        sched_yield();
+    }
+}
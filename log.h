@@ -0,0 +1,56 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+enum LogLevel
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE, /* per packet / per frame */
+};
+
+/*
+ * Levels above LOG_MAX_LEVEL are compiled out, arguments and all:
+ * build with -DLOG_MAX_LEVEL=LOG_LEVEL_INFO to drop debug and trace.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_TRACE
+#endif
+
+/* messages above this level are skipped at run time, INFO by default */
+extern atomic_int log_level;
+
+#define log_enabled(level) \
+    ((level) <= LOG_MAX_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define log_at(level, ...)                      \
+    do {                                        \
+        if (log_enabled(level))                 \
+            log_message((level), __VA_ARGS__);  \
+    } while (0)
+
+#define log_error(...)   log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_at(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...)    log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)   log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...)   log_at(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/*
+ * Formats the message on the calling thread into a slot of a lock-free ring
+ * and returns; a background thread started on first use writes the ring out
+ * to stderr in batches. When the ring is full the message is dropped and
+ * counted, except errors, which are then written directly. Everything still
+ * queued is written at exit. Messages longer than 255 bytes are cut.
+ */
+void log_message(enum LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void log_set_level(enum LogLevel level);
+/* "error", "warning", "info", "debug" or "trace"; < 0 if unknown */
+int log_parse_level(const char *name);
+/* blocks until every message logged before the call has been written */
+void log_flush(void);
+
+#endif
@@ -0,0 +1,159 @@
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "mmap_input.h"
+
+/* what one demuxer read asks for at most */
+#define MMAP_INPUT_BUFFER_SIZE (256 * 1024)
+/* requested ahead of the read position, topped up once half of it is read */
+#define MMAP_INPUT_READ_AHEAD (16 * 1024 * 1024)
+/* kept mapped behind it, demuxers step back a little now and then */
+#define MMAP_INPUT_KEEP_BEHIND (32 * 1024 * 1024)
+
+struct MmapInput
+{
+    uint8_t *data;
+    int64_t size;
+    int64_t position;
+    int64_t advised;        /* end of the range asked for with MADV_WILLNEED */
+    int64_t released;       /* everything before this was dropped with MADV_DONTNEED */
+    size_t page_size;
+    AVIOContext *pb;
+
+    int64_t nb_reads, nb_seeks;
+};
+
+static int64_t page_floor(const MmapInput *input, int64_t offset)
+{
+    return offset & ~(int64_t)(input->page_size - 1);
+}
+
+static void read_ahead(MmapInput *input)
+{
+    int64_t start, behind;
+
+    if (input->position + MMAP_INPUT_READ_AHEAD / 2 > input->advised && input->advised < input->size) {
+        start = page_floor(input, FFMAX(input->advised, input->position));
+        input->advised = FFMIN(start + MMAP_INPUT_READ_AHEAD, input->size);
+        madvise(input->data + start, input->advised - start, MADV_WILLNEED);
+    }
+
+    behind = page_floor(input, input->position - MMAP_INPUT_KEEP_BEHIND);
+    if (behind - input->released >= MMAP_INPUT_KEEP_BEHIND) {
+        /* a private read-only mapping: the pages stay in the page cache, only the mapping goes */
+        madvise(input->data + input->released, behind - input->released, MADV_DONTNEED);
+        input->released = behind;
+    }
+}
+
+static int read_packet(void *opaque, uint8_t *buffer, int buffer_size)
+{
+    MmapInput *input = opaque;
+    int64_t size = FFMIN(buffer_size, input->size - input->position);
+
+    if (size <= 0)
+        return AVERROR_EOF;
+    read_ahead(input);
+    memcpy(buffer, input->data + input->position, size);
+    input->position += size;
+    input->nb_reads++;
+    return size;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence)
+{
+    MmapInput *input = opaque;
+    int64_t position;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return input->size;
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = input->position + offset;
+        break;
+    case SEEK_END:
+        position = input->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (position < 0 || position > input->size)
+        return AVERROR(EINVAL);
+
+    /* a jump out of the window starts a new one where the demuxer went */
+    if (position < input->released || position > input->advised) {
+        input->advised = page_floor(input, position);
+        input->released = FFMIN(input->released, input->advised);
+    }
+    input->position = position;
+    input->nb_seeks++;
+    return position;
+}
+
+int mmap_input_open(MmapInput **input, const char *filename, AVIOContext **pb)
+{
+    MmapInput *m;
+    uint8_t *buffer;
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return AVERROR(errno);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    if (!(m = av_mallocz(sizeof(*m))) || !(buffer = av_malloc(MMAP_INPUT_BUFFER_SIZE))) {
+        av_free(m);
+        munmap(data, st.st_size);
+        return AVERROR(ENOMEM);
+    }
+    m->data = data;
+    m->size = st.st_size;
+    m->page_size = sysconf(_SC_PAGESIZE);
+    m->pb = avio_alloc_context(buffer, MMAP_INPUT_BUFFER_SIZE, 0, m, read_packet, NULL, seek);
+    if (!m->pb) {
+        av_free(buffer);
+        mmap_input_close(&m);
+        return AVERROR(ENOMEM);
+    }
+
+    log_debug("mmap input: %s, %"PRId64" bytes", filename, m->size);
+    *input = m;
+    *pb = m->pb;
+    return 0;
+}
+
+void mmap_input_close(MmapInput **input)
+{
+    MmapInput *m = *input;
+
+    if (!m)
+        return;
+    log_debug("mmap input: %"PRId64" reads, %"PRId64" seeks", m->nb_reads, m->nb_seeks);
+    if (m->pb) {
+        av_freep(&m->pb->buffer);
+        avio_context_free(&m->pb);
+    }
+    munmap(m->data, m->size);
+    av_freep(input);
+}
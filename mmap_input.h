@@ -0,0 +1,23 @@
+#ifndef MMAP_INPUT_H
+#define MMAP_INPUT_H
+
+#include <libavformat/avio.h>
+#include <stdint.h>
+
+/*
+ * Input file served to the demuxer out of an mmap of the whole file, so a
+ * read is a copy out of the page cache rather than a read() call. The
+ * kernel is told the access is sequential, and as the demuxer moves along a
+ * window ahead of it is requested with MADV_WILLNEED, which the kernel reads
+ * in the background before the demuxer gets there. Pages far behind the
+ * read position are unmapped again, so a long input does not pile up in
+ * the resident set. Seeks just move the position.
+ */
+typedef struct MmapInput MmapInput;
+
+/* a regular, non-empty local file; *pb goes into AVFormatContext.pb before avformat_open_input */
+int mmap_input_open(MmapInput **input, const char *filename, AVIOContext **pb);
+/* after avformat_close_input, which leaves a custom pb alone */
+void mmap_input_close(MmapInput **input);
+
+#endif
@@ -0,0 +1,94 @@
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include "object_pool.h"
+
+#define OBJECT_POOL_INITIAL_CAPACITY 16
+
+static void *alloc_object(enum ObjectPoolType type)
+{
+    if (type == OBJECT_POOL_PACKETS)
+        return av_packet_alloc();
+    return av_frame_alloc();
+}
+
+static void free_object(enum ObjectPoolType type, void *object)
+{
+    if (type == OBJECT_POOL_PACKETS) {
+        AVPacket *packet = object;
+        av_packet_free(&packet);
+    } else {
+        AVFrame *frame = object;
+        av_frame_free(&frame);
+    }
+}
+
+int object_pool_init(ObjectPool *pool, enum ObjectPoolType type)
+{
+    pool->items = av_malloc_array(OBJECT_POOL_INITIAL_CAPACITY, sizeof(*pool->items));
+    if (!pool->items)
+        return AVERROR(ENOMEM);
+
+    pool->type = type;
+    pool->count = 0;
+    pool->capacity = OBJECT_POOL_INITIAL_CAPACITY;
+    pool->taken = 0;
+    pool->allocated = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    return 0;
+}
+
+void object_pool_destroy(ObjectPool *pool)
+{
+    if (!pool->items)
+        return;
+
+    for (int i = 0; i < pool->count; i++)
+        free_object(pool->type, pool->items[i]);
+
+    pthread_mutex_destroy(&pool->lock);
+    av_freep(&pool->items);
+    pool->count = 0;
+}
+
+void *object_pool_get(ObjectPool *pool)
+{
+    void *object = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->taken++;
+    if (pool->count > 0)
+        object = pool->items[--pool->count];
+    else
+        pool->allocated++;
+    pthread_mutex_unlock(&pool->lock);
+
+    return object ? object : alloc_object(pool->type);
+}
+
+void object_pool_put(ObjectPool *pool, void *object)
+{
+    if (!object)
+        return;
+
+    if (pool->type == OBJECT_POOL_PACKETS)
+        av_packet_unref(object);
+    else
+        av_frame_unref(object);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->capacity) {
+        void **grown = av_realloc_array(pool->items, pool->capacity * 2, sizeof(*pool->items));
+
+        if (!grown) {
+            pthread_mutex_unlock(&pool->lock);
+            free_object(pool->type, object);
+            return;
+        }
+        pool->items = grown;
+        pool->capacity *= 2;
+    }
+    pool->items[pool->count++] = object;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,39 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+enum ObjectPoolType
+{
+    OBJECT_POOL_PACKETS, /* AVPacket */
+    OBJECT_POOL_FRAMES,  /* AVFrame */
+};
+
+/*
+ * Free list of blank AVPacket or AVFrame shells. Put unreferences the object
+ * and keeps it for the next get, so a pool only allocates until it holds as
+ * many shells as are ever in flight at once and steady-state transcoding
+ * allocates none. allocated / taken is the allocations per object handed out.
+ */
+typedef struct ObjectPool
+{
+    enum ObjectPoolType type;
+    void **items;
+    int count;
+    int capacity;
+
+    pthread_mutex_t lock;
+
+    int64_t taken;
+    int64_t allocated;
+} ObjectPool;
+
+int object_pool_init(ObjectPool *pool, enum ObjectPoolType type);
+/* frees every pooled shell; objects still out are the caller's to free */
+void object_pool_destroy(ObjectPool *pool);
+/* a blank object, NULL when it cannot be allocated */
+void *object_pool_get(ObjectPool *pool);
+void object_pool_put(ObjectPool *pool, void *object);
+
+#endif
@@ -0,0 +1,22 @@
+#include <libavutil/common.h>
+#include <stdlib.h>
+#include "percentile.h"
+
+static int compare_values(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void percentile_sort(int64_t *values, int64_t count)
+{
+    qsort(values, count, sizeof(*values), compare_values);
+}
+
+int64_t percentile(const int64_t *sorted, int64_t count, int percent)
+{
+    if (count <= 0)
+        return 0;
+    return sorted[FFMIN(count * percent / 100, count - 1)];
+}
@@ -0,0 +1,14 @@
+#ifndef PERCENTILE_H
+#define PERCENTILE_H
+
+#include <stdint.h>
+
+/* sorts values in ascending order, as percentile() needs them */
+void percentile_sort(int64_t *values, int64_t count);
+/*
+ * The value percent % of sorted values are at or below, rounded down to an
+ * element: p50 is the median, p100 the maximum. 0 when there are none.
+ */
+int64_t percentile(const int64_t *sorted, int64_t count, int percent);
+
+#endif
@@ -1,610 +1,403 @@
 #include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavfilter/buffersink.h>
-#include <libavfilter/buffersrc.h>
-#include <libavutil/opt.h>
-#include <libavutil/pixdesc.h>
-
-typedef struct StreamContext
-{
-    AVCodecContext *decode_context;
-    AVCodecContext *encode_context;
-
-    AVFrame *decode_frame;
-} StreamContext;
-static StreamContext *stream_context;
-
-typedef struct FilteringContext
-{
-    AVFilterContext *buffersink_context;
-    AVFilterContext *buffersrc_context;
-    AVFilterGraph *filter_graph;
-
-    AVPacket *encode_packet;
-    AVFrame *filtered_frame;
-} FilteringContext;
-static FilteringContext *filter_context;
-int thumbnail_frame,chosen_frame;
-int res_h,res_w,bitrate;
-
-AVFormatContext *output_format_context;
-
-static void logging(const char *fmt, ...)
-{
-    va_list args;
-    fprintf(stderr, "LOG: ");
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
-
-void dump_stream_info(AVStream *stream)
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "log.h"
+#include "thumbnail.h"
+#include "transcode.h"
+
+#define BATCH_MAX_ARGS 64
+
+static void usage(void)
 {
-    logging("Stream Info");
-    logging("r_frame_rate : %d %d\n", stream->r_frame_rate.den, stream->r_frame_rate.num);
-    logging("duration : %d\n", stream->duration);
-    logging("nb_frames : %d\n", stream->nb_frames);
-}
-void dump_codec_info(AVCodec *codec)
-{
-    logging("Codec Info\n");
-    logging("name : %s\n", codec->name);
-    logging("long_name : %s\n", codec->long_name);
+    log_info("inputfile outputfile thumbnailframe resolution_heigt resolution_width bitrate [options]");
+    log_info("to skip any value put -1");
+    log_info("   or: --batch manifest [--jobs n] [--core-budget n] [--pin] [options], one job per manifest line");
+    log_info("       on n workers (default half the cores), admitted by estimated cost within n cores (0 = all), pinned to them");
+    log_info("options: --serial               run demux/decode/filter/encode/mux on one thread");
+    log_info("         --ladder h:w:bitrate,.. decode once, write one HLS rendition per entry plus a master playlist");
+    log_info("         --outputs file[:h:w:bitrate],.. more outputs from the same decode, an image file is a thumbnail strip");
+    log_info("         --scaler name           resize algorithm: fast_bilinear, bilinear, bicubic (default), area, lanczos, ...");
+    log_info("         --filter-threads n      slice threads per filter graph, 0 = one per core (default)");
+    log_info("         --decoder-threads n     threads per video decoder, 0 = one per core (default)");
+    log_info("         --encoder-threads n     threads per video encoder, 0 = one per core (default)");
+    log_info("         --thread-type type      codec threading: frame, slice or both (default)");
+    log_info("         --auto-threads n        time a short trial run and split n cores between decoder, filters and encoders, 0 = all");
+    log_info("         --thumbnail-only        seek to the thumbnail frame and write it to outputfile, no transcode");
+    log_info("         --thumbnail-at seconds  with --thumbnail-only, pick the frame by time instead of number");
+    log_info("         --thumbnail-format ext  png (default), jpg or webp for the transcode thumbnail");
+    log_info("         --start seconds         seek to the keyframe before this time and start the output there at 0");
+    log_info("         --duration seconds      stop after this many seconds of the input");
+    log_info("         --smart-cut             with --start/--duration, copy whole GOPs and encode only the cut ones");
+    log_info("         --live                  follow a growing input, sliding-window HLS with LL-HLS parts");
+    log_info("         --live-segment seconds  live segment target duration (default 2)");
+    log_info("         --live-part seconds     live partial segment target (default 0.334), 0 = no parts");
+    log_info("         --live-window n         segments in the live playlist (default 6)");
+    log_info("         --cmaf                  with an .mpd output, also write HLS playlists over the same fMP4 segments");
+    log_info("         --cmaf-segment seconds  CMAF segment duration (default 4)");
+    log_info("         --no-copy               re-encode streams even when nothing about them changes");
+    log_info("         --segments n            cut the video at keyframes into n chunks encoded in parallel, 0 = one per core");
+    log_info("         --mmap-input            serve input reads from an mmap with read-ahead instead of read() calls");
+    log_info("         --async-output          write outputs from an I/O thread, each file renamed into place when complete");
+    log_info("         --serve port            keep the HLS output in memory and serve it on http://127.0.0.1:port/ until Ctrl-C");
+    log_info("         --resume                checkpoint the .m3u8 output at each segment, continue an interrupted run from there");
+    log_info("         --keyframe-index        seek and plan chunks with the <input>.kfi sidecar, built on first use");
+    log_info("         --trace file.json       time every stage, write a Chrome trace and log p50/p99 per stage");
+    log_info("         --log-level name        error, warning, info (default), debug or trace (every packet)");
 }
 
-static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
-        AVCodecContext *enc_ctx, const char *filter_spec)
+/* the flags after the positional arguments, from argv[first] on */
+static int parse_options(TranscodeConfig *config, int argc, char **argv, int first,
+                         int *thumbnail_only, double *thumbnail_at)
 {
-    char args[512];
-    int ret = 0;
-    const AVFilter *buffersrc = NULL;
-    const AVFilter *buffersink = NULL;
-    AVFilterContext *buffersrc_ctx = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
-    AVFilterInOut *outputs = avfilter_inout_alloc();
-    AVFilterInOut *inputs  = avfilter_inout_alloc();
-    AVFilterGraph *filter_graph = avfilter_graph_alloc();
- 
-    if (!outputs || !inputs || !filter_graph) {
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
- 
-    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-        buffersrc = avfilter_get_by_name("buffer");
-        buffersink = avfilter_get_by_name("buffersink");
-        
-        dec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-        logging("%d %d",dec_ctx->pix_fmt,dec_ctx->height);
-        logging("%d %d",enc_ctx->pix_fmt,enc_ctx->height);
- 
-        snprintf(args, sizeof(args),
-                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-                dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-                dec_ctx->time_base.num, dec_ctx->time_base.den,
-                dec_ctx->sample_aspect_ratio.num,
-                dec_ctx->sample_aspect_ratio.den);
- 
-        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                args, NULL, filter_graph);
-       
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                NULL, NULL, filter_graph);
-       
- 
-        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts",
-                (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
-                AV_OPT_SEARCH_CHILDREN);
-        
-    } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-        buffersrc = avfilter_get_by_name("abuffer");
-        buffersink = avfilter_get_by_name("abuffersink");
-        
- 
-        if (!dec_ctx->channel_layout)
-            dec_ctx->channel_layout =
-                av_get_default_channel_layout(dec_ctx->channels);
-        snprintf(args, sizeof(args),
-                "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-                dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
-                av_get_sample_fmt_name(dec_ctx->sample_fmt),
-                dec_ctx->channel_layout);
-        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                args, NULL, filter_graph);
-        
- 
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                NULL, NULL, filter_graph);
-        
- 
-        ret = av_opt_set_bin(buffersink_ctx, "sample_fmts",
-                (uint8_t*)&enc_ctx->sample_fmt, sizeof(enc_ctx->sample_fmt),
-                AV_OPT_SEARCH_CHILDREN);
-        
- 
-        ret = av_opt_set_bin(buffersink_ctx, "channel_layouts",
-                (uint8_t*)&enc_ctx->channel_layout,
-                sizeof(enc_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
-        
- 
-        ret = av_opt_set_bin(buffersink_ctx, "sample_rates",
-                (uint8_t*)&enc_ctx->sample_rate, sizeof(enc_ctx->sample_rate),
-                AV_OPT_SEARCH_CHILDREN);
-        
-    } else {
-        ret = AVERROR_UNKNOWN;
-        goto end;
+    for (int arg = first; arg < argc; arg++)
+    {
+        if (!strcmp(argv[arg], "--serial"))
+            config->serial = 1;
+        else if (!strcmp(argv[arg], "--ladder") && arg + 1 < argc)
+            config->ladder = argv[++arg];
+        else if (!strcmp(argv[arg], "--outputs") && arg + 1 < argc)
+            config->outputs = argv[++arg];
+        else if (!strcmp(argv[arg], "--scaler") && arg + 1 < argc)
+            config->scaler = argv[++arg];
+        else if (!strcmp(argv[arg], "--filter-threads") && arg + 1 < argc)
+            config->filter_threads = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--decoder-threads") && arg + 1 < argc)
+            config->decoder_threads = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--encoder-threads") && arg + 1 < argc)
+            config->encoder_threads = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--thread-type") && arg + 1 < argc)
+        {
+            const char *type = argv[++arg];
+            if (!strcmp(type, "frame"))
+                config->codec_thread_type = FF_THREAD_FRAME;
+            else if (!strcmp(type, "slice"))
+                config->codec_thread_type = FF_THREAD_SLICE;
+            else if (!strcmp(type, "both"))
+                config->codec_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            else
+            {
+                log_error("Unknown thread type %s", type);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[arg], "--auto-threads") && arg + 1 < argc)
+        {
+            config->thread_budget = atoi(argv[++arg]);
+            if (config->thread_budget <= 0)
+                config->thread_budget = av_cpu_count();
+        }
+        else if (!strcmp(argv[arg], "--thumbnail-only"))
+            *thumbnail_only = 1;
+        else if (!strcmp(argv[arg], "--thumbnail-at") && arg + 1 < argc)
+            *thumbnail_at = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--thumbnail-format") && arg + 1 < argc)
+            config->thumbnail_format = argv[++arg];
+        else if (!strcmp(argv[arg], "--start") && arg + 1 < argc)
+            config->start = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--duration") && arg + 1 < argc)
+            config->duration = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--smart-cut"))
+            config->smart_cut = 1;
+        else if (!strcmp(argv[arg], "--live"))
+            config->live = 1;
+        else if (!strcmp(argv[arg], "--live-segment") && arg + 1 < argc)
+            config->live_segment_time = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--live-part") && arg + 1 < argc)
+            config->live_part_time = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--live-window") && arg + 1 < argc)
+            config->live_window = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--cmaf"))
+            config->cmaf = 1;
+        else if (!strcmp(argv[arg], "--cmaf-segment") && arg + 1 < argc)
+            config->cmaf_segment_time = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--no-copy"))
+            config->no_stream_copy = 1;
+        else if (!strcmp(argv[arg], "--mmap-input"))
+            config->mmap_input = 1;
+        else if (!strcmp(argv[arg], "--async-output"))
+            config->async_output = 1;
+        else if (!strcmp(argv[arg], "--serve") && arg + 1 < argc)
+            config->serve_port = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--resume"))
+            config->resume = 1;
+        else if (!strcmp(argv[arg], "--keyframe-index"))
+            config->keyframe_index = 1;
+        else if (!strcmp(argv[arg], "--trace") && arg + 1 < argc)
+            config->trace_filename = argv[++arg];
+        else if (!strcmp(argv[arg], "--segments") && arg + 1 < argc)
+        {
+            config->segments = atoi(argv[++arg]);
+            if (config->segments <= 0)
+                config->segments = av_cpu_count();
+        }
+        else if (!strcmp(argv[arg], "--log-level") && arg + 1 < argc)
+        {
+            int level = log_parse_level(argv[++arg]);
+            if (level < 0)
+            {
+                log_error("Unknown log level %s", argv[arg]);
+                return -1;
+            }
+            log_set_level(level);
+        }
+        else
+        {
+            log_error("Unknown option %s", argv[arg]);
+            return -1;
+        }
     }
- 
-    outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
-    outputs->pad_idx    = 0;
-    outputs->next       = NULL;
- 
-    inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx    = 0;
-    inputs->next       = NULL;
- 
-    if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec,
-                    &inputs, &outputs, NULL)) < 0)
-        goto end;
- 
-    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
-        goto end;
- 
-    
-    fctx->buffersrc_context = buffersrc_ctx;
-    fctx->buffersink_context = buffersink_ctx;
-    fctx->filter_graph = filter_graph;
- 
-end:
-    avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
- 
-    return ret;
+    return 0;
 }
 
-void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame)
+/* inputfile outputfile thumbnailframe height width bitrate, from argv[0] on */
+static int parse_positionals(TranscodeConfig *config, char **argv)
 {
-    FILE *pFile;
-    char szFilename[32];
-    int y;
-
-     
-    sprintf(szFilename, "thumbnail_frame_%d.png", iFrame);
-    pFile = fopen(szFilename, "wb");
-    if (pFile == NULL)
-        return;
-
-    // Write header
-    fprintf(pFile, "P6\n%d %d\n255\n", width, height);
-
-    // Write pixel data
-    for (y = 0; y < height; y++)
-        fwrite(pFrame->data[0] + y * pFrame->linesize[0], 1, width * 3, pFile);
-
-    // Close file
-    fclose(pFile);
-}
-
-static int encode_write_frame(unsigned int stream_index, int flush)
-{
-    StreamContext *stream = &stream_context[stream_index];
-    FilteringContext *filter = &filter_context[stream_index];
-    AVFrame *filt_frame = flush ? NULL : filter->filtered_frame;
-    AVPacket *enc_pkt = filter->encode_packet;
-    int ret;
- 
-   
-    av_packet_unref(enc_pkt);
- 
-    ret = avcodec_send_frame(stream->encode_context, filt_frame);
- 
-    if (ret < 0)
-        return ret;
- 
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(stream->encode_context, enc_pkt);
- 
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return 0;
- 
-        /* prepare packet for muxing */
-        enc_pkt->stream_index = stream_index;
-        av_packet_rescale_ts(enc_pkt,
-                             stream->encode_context->time_base,
-                             output_format_context->streams[stream_index]->time_base);
- 
-        
-        /* mux encoded frame */
-        ret = av_interleaved_write_frame(output_format_context, enc_pkt);
-    }
- 
-    return ret;
-}
+    char *p;
 
-static int filter_encode_write_frame(AVFrame *frame, unsigned int stream_index)
-{
-    FilteringContext *filter = &filter_context[stream_index];
-    int ret;
- 
-    
-    /* push the decoded frame into the filtergraph */
-    ret = av_buffersrc_add_frame_flags(filter->buffersrc_context,
-            frame, 0);
+    config->input_filename = argv[0];
+    config->output_filename = argv[1];
+    config->thumbnail_frame = strtol(argv[2], &p, 10);
+    config->res_h = strtol(argv[3], &p, 10);
+    config->res_w = strtol(argv[4], &p, 10);
+    config->bitrate = strtol(argv[5], &p, 10);
     
- 
-    /* pull filtered frames from the filtergraph */
-    while (1) {
-       
-        ret = av_buffersink_get_frame(filter->buffersink_context,
-                                      filter->filtered_frame);
-        if (ret < 0) {
-            /* if no more frames for output - returns AVERROR(EAGAIN)
-             * if flushed and no more frames for output - returns AVERROR_EOF
-             * rewrite retcode to 0 to show it as normal procedure completion
-             */
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                ret = 0;
-            break;
-        }
-
-        if(stream_index==0 && filter->filtered_frame->width)++thumbnail_frame;
-        if(thumbnail_frame == chosen_frame)SaveFrame(filter->filtered_frame,filter->filtered_frame->height,filter->filtered_frame->width,thumbnail_frame);
-
-        filter->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret = encode_write_frame(stream_index, 0);
-        av_frame_unref(filter->filtered_frame);
-
-        if (ret < 0)
-            break;
-        
+    errno = 0;
+    if (errno != 0 || *p != '\0' || config->thumbnail_frame < 0){
+        log_error("Wrong parameter passed.3rd parameter must be an integer\n");
+        return -1;
     }
- 
-    return ret;
+    return 0;
 }
 
-static int flush_encoder(unsigned int stream_index)
-{
-    if (!(stream_context[stream_index].encode_context->codec->capabilities &
-                AV_CODEC_CAP_DELAY))
-        return 0;
- 
-   
-    return encode_write_frame(stream_index, 1);
-}
-
-int main(int argc, char **argv)
+/*
+ * One job per manifest line: the six positional arguments and any options,
+ * separated by blanks, on top of the options of the command line. Blank
+ * lines and lines starting with # are skipped. Thread counts left at 0 are
+ * set to threads, the jobs' share of the cores as they run side by side;
+ * threads 0 leaves them to the admission quota.
+ */
+static int read_manifest(const char *filename, const TranscodeConfig *base, int threads,
+                         BatchJob **jobs, int *nb_jobs)
 {
+    FILE *manifest = fopen(filename, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    int ret = 0;
 
-    int ret;
-    AVPacket *packet = NULL;
-    unsigned int stream_index;
-    unsigned int i;
+    if (!manifest)
+    {
+        log_error("Cannot open batch manifest %s", filename);
+        return AVERROR(errno);
+    }
 
-    // check for passed arguments
+    while (getline(&line, &line_size, manifest) >= 0)
     {
-        if (argc != 7)
+        TranscodeConfig config = *base;
+        char *args[BATCH_MAX_ARGS], *save = NULL;
+        int nb_args = 1, thumbnail_only = 0;
+        double thumbnail_at = -1;
+        BatchJob *grown, *job;
+
+        line_number++;
+        args[0] = "batch";
+        for (char *token = strtok_r(line, " \t\r\n", &save); token && nb_args < BATCH_MAX_ARGS;
+             token = strtok_r(NULL, " \t\r\n", &save))
+            args[nb_args++] = token;
+        if (nb_args == 1 || args[1][0] == '#')
+            continue;
+
+        if (nb_args < 7 || parse_positionals(&config, args + 1) < 0 ||
+            parse_options(&config, nb_args, args, 7, &thumbnail_only, &thumbnail_at) < 0 || thumbnail_only ||
+            config.serve_port)
         {
-            logging("%d",argc);
-            logging("Pass atleast 6 filename <input/output> to transcode");
-            logging("inputfile outputfile thumbnailframe resolution_heigt resolution_width bitrate");
-            logging("to skip any value put -1");
-            return -1;
+            log_error("%s:%d: expected inputfile outputfile thumbnailframe height width bitrate [options],"
+                      " --thumbnail-only and --serve are not available in a batch", filename, line_number);
+            ret = AVERROR(EINVAL);
+            break;
         }
-    }
-    char *p;
-
-    chosen_frame = strtol(argv[3], &p, 10);
-    res_h = strtol(argv[4], &p, 10);
-    res_w = strtol(argv[5], &p, 10);
-    bitrate = strtol(argv[6], &p, 10);
-    
-    errno = 0;
-    if (errno != 0 || *p != '\0' || chosen_frame < 0){
-        logging("Wrong parameter passed.3rd parameter must be an integer\n");
-        return -1;
-    }
-    // open_input_file
-    AVFormatContext *input_format_context;
-    const char *input_file_name = argv[1];
-    { // open_input_file
-        int ret;
-        // unsigned int i;
-
-        input_format_context = NULL;
-
-        if ((ret = avformat_open_input(&input_format_context, input_file_name, NULL, NULL)) < 0)
+        if (threads && !config.thread_budget)
         {
-            logging("Cannot opent input file\n");
-            return ret;
+            if (!config.decoder_threads)
+                config.decoder_threads = threads;
+            if (!config.filter_threads)
+                config.filter_threads = threads;
+            if (!config.encoder_threads)
+                config.encoder_threads = threads;
         }
 
-        stream_context = av_mallocz_array(input_format_context->nb_streams, sizeof(*stream_context));
-
-        if (!stream_context)
+        if (!(grown = av_realloc_array(*jobs, *nb_jobs + 1, sizeof(**jobs))))
         {
-            logging("Couldnt allocate memory for stream context\n");
-            return AVERROR(ENOMEM);
+            ret = AVERROR(ENOMEM);
+            break;
         }
-
-        for (int i = 0; i < input_format_context->nb_streams; i++)
+        *jobs = grown;
+        job = &grown[(*nb_jobs)++];
+        memset(job, 0, sizeof(*job));
+        job->name = av_strdup(config.input_filename);
+        if (!job->name || !(job->job = transcode_job_create()))
         {
-            AVStream *stream = input_format_context->streams[i];
-            // dump_stream_info(stream);
-            AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
-            // dump_codec_info(decoder);
-
-            if (!decoder)
-            {
-                logging("Failed to find decoder for stream_%d", i);
-                return AVERROR_DECODER_NOT_FOUND;
-            }
-
-            AVCodecContext *codec_context;
-            codec_context = avcodec_alloc_context3(decoder);
-
-            if (!codec_context)
-            {
-                logging("failed to allocate the decoder context for stream_%d\n", i);
-                return AVERROR(ENOMEM);
-            }
-
-            ret = avcodec_parameters_to_context(codec_context, stream->codecpar);
-            if (ret < 0)
-            {
-                logging("Failed to copy decoder parameters to input decoder context for stream_%d\n", i);
-                return ret;
-            }
-
-            if (codec_context->codec_type == AVMEDIA_TYPE_VIDEO || codec_context->codec_type == AVMEDIA_TYPE_AUDIO)
-            {
-                if (codec_context->codec_type == AVMEDIA_TYPE_VIDEO)
-                {
-                    codec_context->framerate = av_guess_frame_rate(input_format_context, stream, NULL);
-                }
-
-                ret = avcodec_open2(codec_context, decoder, NULL);
-
-                if (ret < 0)
-                {
-                    logging("Failed to opend decoder for strem_%d", i);
-                    return ret;
-                }
-            }
-
-            stream_context[i].decode_context = codec_context;
-            stream_context[i].decode_frame = av_frame_alloc();
-
-            if (!stream_context[i].decode_frame)
-            {
-                logging("Error on allocating for stream context decode frame\n");
-                return AVERROR(ENOMEM);
-            }
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if ((ret = transcode_job_configure(job->job, &config)) < 0)
+        {
+            log_error("%s:%d: invalid job", filename, line_number);
+            break;
         }
-
-        // av_dump_format(input_format_context, 0, NULL, 0);
     }
 
-    
-    const char *output_filename = argv[2];
-    { 
-
-        AVStream *output_stream, *input_stream;
-        AVCodecContext *decode_context, *encoder_context;
-        AVCodec *encoder;
-
-        int ret;
+    free(line);
+    fclose(manifest);
+    return ret;
+}
 
-        output_format_context = NULL;
-        avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_filename);
+/* out.o --batch manifest [--jobs n] [--core-budget n] [--pin] [options for every job] */
+static int run_batch(TranscodeConfig *config, int argc, char **argv)
+{
+    BatchJob *jobs = NULL;
+    AdmissionGate gate;
+    int nb_jobs = 0;
+    int nb_workers = 0, budget = 0, admission = 0, pin = 0;
+    int first = 3, thumbnail_only = 0;
+    double thumbnail_at = -1;
+    int ret;
 
-        if (!output_format_context)
+    for (; first < argc; first++)
+    {
+        if (!strcmp(argv[first], "--jobs") && first + 1 < argc)
         {
-            logging("Couldnt create output context\n");
-            return AVERROR_UNKNOWN;
+            nb_workers = atoi(argv[++first]);
+            if (nb_workers <= 0)
+                nb_workers = av_cpu_count();
         }
-
-       
-
-        for (int i = 0; i < input_format_context->nb_streams; i++)
+        else if (!strcmp(argv[first], "--core-budget") && first + 1 < argc)
         {
-            output_stream = avformat_new_stream(output_format_context, NULL);
-            if (!output_stream)
-            {
-                logging("Failed allocation output stream\n");
-                return AVERROR_UNKNOWN;
-            }
-
-            input_stream = input_format_context->streams[i];
-            decode_context = stream_context[i].decode_context;
-
-            if (decode_context->codec_type == AVMEDIA_TYPE_VIDEO || decode_context->codec_type == AVMEDIA_TYPE_AUDIO)
-            {
-
-                
-                encoder = avcodec_find_encoder(decode_context->codec_id);
-                
-                encoder_context = avcodec_alloc_context3(encoder);
-                
-                logging("-----%d",decode_context->pix_fmt);
-                if (decode_context->codec_type == AVMEDIA_TYPE_VIDEO)
-                {
-                    encoder_context->height = res_h > 0 ? res_h : decode_context->height;
-                    encoder_context->width = res_w > 0 ? res_w : decode_context->width;
-                    encoder_context->sample_aspect_ratio = decode_context->sample_aspect_ratio;
-                    encoder_context->bit_rate = bitrate > 0 ? bitrate : decode_context->bit_rate;
-                    encoder_context->time_base = av_inv_q(decode_context->framerate);
-                    
-                    if (encoder->pix_fmts)
-                    {
-                        encoder_context->pix_fmt = encoder->pix_fmts[0];
-                    }
-                    else
-                    {
-                        encoder_context->pix_fmt = decode_context->pix_fmt;
-                    }
-                }
-                else
-                {
-                    encoder_context->sample_rate = decode_context->sample_rate;
-                    encoder_context->channel_layout = decode_context->channel_layout;
-                    encoder_context->channels = av_get_channel_layout_nb_channels(encoder_context->channel_layout);
-                    encoder_context->sample_fmt = encoder->sample_fmts[0];
-                    encoder_context->time_base = (AVRational){1, encoder_context->sample_rate};
-                }
-
-                if (output_format_context->oformat->flags & AVFMT_GLOBALHEADER)
-                    encoder_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-                ret = avcodec_open2(encoder_context, encoder, NULL);
-                ret = avcodec_parameters_from_context(output_stream->codecpar, encoder_context);
-                output_stream->time_base = encoder_context->time_base;
-                stream_context[i].encode_context = encoder_context;
-            }
-            else
-            {
-                ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
-                output_stream->time_base = input_stream->time_base;
-            }
+            budget = atoi(argv[++first]);
+            admission = 1;
         }
+        else if (!strcmp(argv[first], "--pin"))
+            admission = pin = 1;
+        else
+            break;
+    }
+    if (parse_options(config, argc, argv, first, &thumbnail_only, &thumbnail_at) < 0)
+        return -1;
+    if (thumbnail_only || config->serve_port)
+    {
+        log_error("--thumbnail-only and --serve are not available with --batch");
+        return -1;
+    }
 
-        
-
-       
-
-        if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
-        {
-            ret = avio_open(&output_format_context->pb, output_filename, AVIO_FLAG_WRITE);
-           
-        }
-        ret = avformat_write_header(output_format_context, NULL);
-        
+    if (admission && (ret = admission_init(&gate, budget, pin)) < 0)
+        return 1;
+    /* admitted jobs get at least a core each, the gate holds the rest back */
+    if (!nb_workers)
+        nb_workers = admission ? gate.budget : FFMAX(av_cpu_count() / 2, 1);
+
+    ret = read_manifest(argv[2], config, admission ? 0 : FFMAX(av_cpu_count() / nb_workers, 1),
+                        &jobs, &nb_jobs);
+    if (ret >= 0)
+        ret = batch_run(jobs, nb_jobs, nb_workers, admission ? &gate : NULL);
+    for (int i = 0; i < nb_jobs; i++)
+    {
+        transcode_job_destroy(&jobs[i].job);
+        av_free((char *)jobs[i].name);
     }
-    
-    
-    
-    
-    { 
-        const char *filter_spec;
-        
-        filter_context = av_malloc_array(input_format_context->nb_streams, sizeof(*filter_context));
-        if (!filter_context)
-            return AVERROR(ENOMEM);
-         
-        for (int i = 0; i < input_format_context->nb_streams; i++)
-        {
-            filter_context[i].buffersrc_context = NULL;
-            filter_context[i].buffersink_context = NULL;
-            filter_context[i].filter_graph = NULL;
-            if (!(input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO || input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
-                continue;
-            
-            if (input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-                filter_spec = "null"; 
-            else
-                filter_spec = "anull"; 
-              
-            ret = init_filter(&filter_context[i], stream_context[i].decode_context,stream_context[i].encode_context, filter_spec);
-             
-            if (ret)
-                return ret;
+    av_free(jobs);
+    if (admission)
+        admission_destroy(&gate);
 
-            filter_context[i].encode_packet = av_packet_alloc();
-            if (!filter_context[i].encode_packet)
-                return AVERROR(ENOMEM);
+    return ret ? 1 : 0;
+}
 
-            filter_context[i].filtered_frame = av_frame_alloc();
-            if (!filter_context[i].filtered_frame)
-                return AVERROR(ENOMEM);
-        }
-    }
-   
-    if (!(packet = av_packet_alloc()))
-        goto end;
+static sem_t stop_serving;
 
-    { 
-        while (1)
-        {
-            if ((ret = av_read_frame(input_format_context, packet)) < 0)
-                break;
-            stream_index = packet->stream_index;
-            
+static void on_stop_signal(int signal_number)
+{
+    sem_post(&stop_serving);
+}
 
-            if (filter_context[stream_index].filter_graph)
-            {
-                StreamContext *stream = &stream_context[stream_index];
+/* the origin keeps serving the finished output for load tests until Ctrl-C */
+static void serve_until_interrupted(void)
+{
+    struct sigaction action = { .sa_handler = on_stop_signal };
+
+    sem_init(&stop_serving, 0, 0);
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    log_info("Transcode done, still serving; Ctrl-C to stop");
+    while (sem_wait(&stop_serving) < 0 && errno == EINTR)
+        ;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sem_destroy(&stop_serving);
+}
 
-                
-                av_packet_rescale_ts(packet,
-                                     input_format_context->streams[stream_index]->time_base,
-                                     stream->decode_context->time_base);
-                ret = avcodec_send_packet(stream->decode_context, packet);
-                
+int main(int argc, char **argv)
+{
 
-                while (ret >= 0)
-                {
-                    ret = avcodec_receive_frame(stream->decode_context, stream->decode_frame);
-                    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-                        break;
-                    else if (ret < 0)
-                        goto end;
+    int ret;
+    TranscodeConfig config;
+    TranscodeJob *job;
+    int thumbnail_only = 0;
+    double thumbnail_at = -1;
 
-                    stream->decode_frame->pts = stream->decode_frame->best_effort_timestamp;
-                    ret = filter_encode_write_frame(stream->decode_frame, stream_index);
-                    if (ret < 0)
-                        goto end;
-                }
-            }
-            else
-            {
-                
-                av_packet_rescale_ts(packet,
-                                     input_format_context->streams[stream_index]->time_base,
-                                     output_format_context->streams[stream_index]->time_base);
+    transcode_config_default(&config);
 
-                ret = av_interleaved_write_frame(output_format_context, packet);
-                if (ret < 0)
-                    goto end;
-            }
-            av_packet_unref(packet);
-        }
+    if (argc >= 3 && !strcmp(argv[1], "--batch"))
+        return run_batch(&config, argc, argv);
 
-        for (i = 0; i < input_format_context->nb_streams; i++) {
-            
-            if (!filter_context[i].filter_graph)
-                continue;
-            ret = filter_encode_write_frame(NULL, i);
-            ret = flush_encoder(i);
-            
-        }
-    
-        av_write_trailer(output_format_context);
+    // check for passed arguments
+    if (argc < 7)
+    {
+        log_info("%d",argc);
+        log_error("Pass atleast 6 filename <input/output> to transcode");
+        usage();
+        return -1;
     }
-end:
-      av_packet_free(&packet);
-    for (i = 0; i < input_format_context->nb_streams; i++) {
-        avcodec_free_context(&stream_context[i].decode_context);
-        if (output_format_context && output_format_context->nb_streams > i && output_format_context->streams[i] && stream_context[i].encode_context)
-            avcodec_free_context(&stream_context[i].encode_context);
-        if (filter_context && filter_context[i].filter_graph) {
-            avfilter_graph_free(&filter_context[i].filter_graph);
-            av_packet_free(&filter_context[i].encode_packet);
-            av_frame_free(&filter_context[i].filtered_frame);
-        }
- 
-        av_frame_free(&stream_context[i].decode_frame);
+    if (parse_options(&config, argc, argv, 7, &thumbnail_only, &thumbnail_at) < 0)
+        return -1;
+    if (parse_positionals(&config, argv + 1) < 0)
+        return -1;
+
+    if (thumbnail_only)
+    {
+        ThumbnailRequest request = {
+            .input_filename = argv[1],
+            .output_filename = argv[2],
+            .frame_number = config.thumbnail_frame,
+            .timestamp = thumbnail_at,
+            .width = config.res_w,
+            .height = config.res_h,
+        };
+        KeyframeIndex index;
+
+        if (config.keyframe_index && keyframe_index_open(&index, argv[1]) >= 0)
+            request.index = &index;
+        ret = extract_thumbnail(&request);
+        if (request.index)
+            keyframe_index_close(&index);
+        return ret < 0 ? 1 : 0;
     }
-    av_free(filter_context);
-    av_free(stream_context);
-    avformat_close_input(&input_format_context);
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_format_context->pb);
-    avformat_free_context(output_format_context);
- 
-    
- 
-    return ret ? 1 : 0;  
-}
\ No newline at end of file
+
+    if (!(job = transcode_job_create()))
+        return 1;
+    if ((ret = transcode_job_configure(job, &config)) >= 0)
+        ret = transcode_job_run(job);
+    if (ret >= 0 && config.serve_port)
+        serve_until_interrupted();
+    transcode_job_destroy(&job);
+
+    return ret ? 1 : 0;
+}
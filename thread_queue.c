@@ -0,0 +1,86 @@
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include "thread_queue.h"
+
+int thread_queue_init(ThreadQueue *queue, int capacity)
+{
+    queue->items = av_malloc_array(capacity, sizeof(*queue->items));
+    if (!queue->items)
+        return AVERROR(ENOMEM);
+
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->aborted = 0;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+void thread_queue_destroy(ThreadQueue *queue, void (*free_data)(void *data))
+{
+    if (!queue->items)
+        return;
+
+    /* items left behind after an abort still own their payload */
+    while (queue->count > 0) {
+        QueueItem *item = &queue->items[queue->head];
+        if (item->data && free_data)
+            free_data(item->data);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    av_freep(&queue->items);
+}
+
+int thread_queue_push(ThreadQueue *queue, QueueItem item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->aborted)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+
+    if (queue->aborted) {
+        pthread_mutex_unlock(&queue->lock);
+        return AVERROR_EXIT;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+int thread_queue_pop(ThreadQueue *queue, QueueItem *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->aborted)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+    if (queue->aborted) {
+        pthread_mutex_unlock(&queue->lock);
+        return AVERROR_EXIT;
+    }
+
+    *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+void thread_queue_abort(ThreadQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->aborted = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
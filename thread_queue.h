@@ -0,0 +1,46 @@
+#ifndef THREAD_QUEUE_H
+#define THREAD_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+enum QueueItemType
+{
+    QUEUE_ITEM_DATA,   /* carries an AVPacket* or AVFrame* */
+    QUEUE_ITEM_MARKER, /* everything produced for `seq` has been queued */
+    QUEUE_ITEM_EOF,    /* the producer is done, no more items follow */
+};
+
+typedef struct QueueItem
+{
+    enum QueueItemType type;
+    void *data;
+    int64_t seq;
+    int stream_index;
+} QueueItem;
+
+/*
+ * Bounded FIFO used to join the pipeline stages. Push blocks while the queue
+ * is full so a slow stage throttles the ones feeding it, pop blocks while it
+ * is empty. Aborting wakes every waiter and makes both calls fail.
+ */
+typedef struct ThreadQueue
+{
+    QueueItem *items;
+    int capacity;
+    int head;
+    int count;
+    int aborted;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ThreadQueue;
+
+int thread_queue_init(ThreadQueue *queue, int capacity);
+void thread_queue_destroy(ThreadQueue *queue, void (*free_data)(void *data));
+int thread_queue_push(ThreadQueue *queue, QueueItem item);
+int thread_queue_pop(ThreadQueue *queue, QueueItem *item);
+void thread_queue_abort(ThreadQueue *queue);
+
+#endif
@@ -0,0 +1,367 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <strings.h>
+#include "log.h"
+#include "thumbnail.h"
+
+
+typedef struct ThumbnailFormat
+{
+    const char *extension;
+    enum AVCodecID codec_id;
+    enum AVPixelFormat pix_fmt;
+} ThumbnailFormat;
+
+static const ThumbnailFormat thumbnail_formats[] = {
+    { ".png",  AV_CODEC_ID_PNG,   AV_PIX_FMT_RGB24 },
+    { ".jpg",  AV_CODEC_ID_MJPEG, AV_PIX_FMT_YUVJ420P },
+    { ".jpeg", AV_CODEC_ID_MJPEG, AV_PIX_FMT_YUVJ420P },
+    { ".webp", AV_CODEC_ID_WEBP,  AV_PIX_FMT_YUV420P },
+};
+
+static const ThumbnailFormat *find_thumbnail_format(const char *filename)
+{
+    const char *extension = strrchr(filename, '.');
+
+    if (!extension)
+        return NULL;
+    for (int i = 0; i < sizeof(thumbnail_formats) / sizeof(thumbnail_formats[0]); i++)
+        if (!strcasecmp(extension, thumbnail_formats[i].extension))
+            return &thumbnail_formats[i];
+    return NULL;
+}
+
+int thumbnail_format_supported(const char *filename)
+{
+    const ThumbnailFormat *format = find_thumbnail_format(filename);
+
+    return format && avcodec_find_encoder(format->codec_id);
+}
+
+int write_thumbnail(const AVFrame *frame, int width, int height, const char *filename)
+{
+    const ThumbnailFormat *format = find_thumbnail_format(filename);
+    const AVCodec *encoder;
+    AVCodecContext *encode_context = NULL;
+    struct SwsContext *sws_context = NULL;
+    AVFrame *image = NULL;
+    AVPacket *packet = NULL;
+    FILE *file = NULL;
+    int ret;
+
+    /* a single given dimension keeps the aspect ratio */
+    if (width <= 0 && height > 0)
+        width = av_rescale(frame->width, height, frame->height) & ~1;
+    else if (height <= 0 && width > 0)
+        height = av_rescale(frame->height, width, frame->width) & ~1;
+    if (width <= 0)
+        width = frame->width;
+    if (height <= 0)
+        height = frame->height;
+
+    if (!format) {
+        log_error("Unknown thumbnail format for %s, use .png, .jpg or .webp", filename);
+        return AVERROR(EINVAL);
+    }
+    if (!(encoder = avcodec_find_encoder(format->codec_id)))
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    encode_context = avcodec_alloc_context3(encoder);
+    image = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!encode_context || !image || !packet) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    image->format = format->pix_fmt;
+    image->width = width;
+    image->height = height;
+    if ((ret = av_frame_get_buffer(image, 0)) < 0)
+        goto end;
+
+    sws_context = sws_getContext(frame->width, frame->height, frame->format,
+                                 width, height, format->pix_fmt,
+                                 SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws_context) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    sws_scale(sws_context, (const uint8_t * const *)frame->data, frame->linesize,
+              0, frame->height, image->data, image->linesize);
+
+    encode_context->width = width;
+    encode_context->height = height;
+    encode_context->pix_fmt = format->pix_fmt;
+    encode_context->time_base = (AVRational){1, 25};
+    if (format->codec_id == AV_CODEC_ID_MJPEG) {
+        /* fixed quantizer, roughly "quality 90" */
+        encode_context->flags |= AV_CODEC_FLAG_QSCALE;
+        encode_context->global_quality = image->quality = 2 * FF_QP2LAMBDA;
+    }
+    if ((ret = avcodec_open2(encode_context, encoder, NULL)) < 0)
+        goto end;
+
+    if ((ret = avcodec_send_frame(encode_context, image)) < 0 ||
+        (ret = avcodec_send_frame(encode_context, NULL)) < 0 ||
+        (ret = avcodec_receive_packet(encode_context, packet)) < 0)
+        goto end;
+
+    file = fopen(filename, "wb");
+    if (!file) {
+        log_error("Cannot open thumbnail file %s", filename);
+        ret = AVERROR(errno);
+        goto end;
+    }
+    if (fwrite(packet->data, 1, packet->size, file) != packet->size)
+        ret = AVERROR(EIO);
+    fclose(file);
+
+end:
+    sws_freeContext(sws_context);
+    av_packet_free(&packet);
+    av_frame_free(&image);
+    avcodec_free_context(&encode_context);
+    return ret < 0 ? ret : 0;
+}
+
+typedef struct ThumbnailJob
+{
+    AVFrame *frame;
+    char *filename;
+} ThumbnailJob;
+
+static void free_thumbnail_job(void *data)
+{
+    ThumbnailJob *job = data;
+
+    av_frame_free(&job->frame);
+    av_free(job->filename);
+    av_free(job);
+}
+
+static void *thumbnail_worker_main(void *arg)
+{
+    ThumbnailWriter *writer = arg;
+    QueueItem item;
+
+    while (thread_queue_pop(&writer->queue, &item) >= 0 && item.type == QUEUE_ITEM_DATA) {
+        ThumbnailJob *job = item.data;
+        int ret = write_thumbnail(job->frame, writer->width, writer->height, job->filename);
+
+        if (ret < 0) {
+            log_error("Failed to write thumbnail %s: %s", job->filename, av_err2str(ret));
+            atomic_fetch_add(&writer->failed, 1);
+        }
+        free_thumbnail_job(job);
+    }
+    return NULL;
+}
+
+int thumbnail_writer_init(ThumbnailWriter *writer, int nb_threads, int width, int height)
+{
+    int ret;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->width = width;
+    writer->height = height;
+    atomic_init(&writer->wait_us, 0);
+    atomic_init(&writer->submitted, 0);
+    atomic_init(&writer->failed, 0);
+
+    writer->threads = av_calloc(nb_threads, sizeof(*writer->threads));
+    if (!writer->threads)
+        return AVERROR(ENOMEM);
+    if ((ret = thread_queue_init(&writer->queue, 2 * nb_threads)) < 0)
+        return ret;
+
+    for (; writer->nb_threads < nb_threads; writer->nb_threads++) {
+        if ((ret = pthread_create(&writer->threads[writer->nb_threads], NULL,
+                                  thumbnail_worker_main, writer))) {
+            thumbnail_writer_close(writer);
+            return AVERROR(ret);
+        }
+    }
+    return 0;
+}
+
+int thumbnail_writer_submit(ThumbnailWriter *writer, const AVFrame *frame, const char *filename)
+{
+    QueueItem item = { .type = QUEUE_ITEM_DATA };
+    ThumbnailJob *job = av_mallocz(sizeof(*job));
+    int64_t started;
+    int ret;
+
+    if (!job)
+        return AVERROR(ENOMEM);
+    job->frame = av_frame_clone(frame);
+    job->filename = av_strdup(filename);
+    if (!job->frame || !job->filename) {
+        free_thumbnail_job(job);
+        return AVERROR(ENOMEM);
+    }
+
+    item.data = job;
+    started = av_gettime_relative();
+    ret = thread_queue_push(&writer->queue, item);
+    atomic_fetch_add(&writer->wait_us, av_gettime_relative() - started);
+
+    if (ret < 0)
+        free_thumbnail_job(job);
+    else
+        atomic_fetch_add(&writer->submitted, 1);
+    return ret;
+}
+
+int thumbnail_writer_close(ThumbnailWriter *writer)
+{
+    QueueItem eof = { .type = QUEUE_ITEM_EOF };
+    int failed;
+
+    for (int i = 0; i < writer->nb_threads; i++)
+        thread_queue_push(&writer->queue, eof);
+    for (int i = 0; i < writer->nb_threads; i++)
+        pthread_join(writer->threads[i], NULL);
+
+    failed = atomic_load(&writer->failed);
+    if (atomic_load(&writer->submitted))
+        log_info("thumbnail writer: %d written, %d failed, transcode loop waited %"PRId64" us",
+                atomic_load(&writer->submitted) - failed, failed,
+                (int64_t)atomic_load(&writer->wait_us));
+
+    thread_queue_destroy(&writer->queue, free_thumbnail_job);
+    av_freep(&writer->threads);
+    writer->nb_threads = 0;
+    return failed ? AVERROR(EIO) : 0;
+}
+
+/* target presentation timestamp in the stream time base */
+static int64_t thumbnail_target(const ThumbnailRequest *request, AVFormatContext *format_context,
+        AVStream *stream)
+{
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    AVRational frame_rate = av_guess_frame_rate(format_context, stream, NULL);
+
+    if (request->timestamp >= 0)
+        return start + av_rescale_q((int64_t)(request->timestamp * AV_TIME_BASE),
+                                    AV_TIME_BASE_Q, stream->time_base);
+
+    if (!frame_rate.num || !frame_rate.den)
+        frame_rate = (AVRational){25, 1};
+    return start + av_rescale_q(FFMAX(request->frame_number - 1, 0),
+                                av_inv_q(frame_rate), stream->time_base);
+}
+
+int extract_thumbnail(const ThumbnailRequest *request)
+{
+    AVFormatContext *format_context = NULL;
+    AVCodecContext *decode_context = NULL;
+    const AVCodec *decoder = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL, *last = NULL;
+    AVStream *stream;
+    int64_t started = av_gettime_relative();
+    const KeyframeEntry *entry;
+    int64_t target;
+    int video_index, have_frame = 0;
+    int ret;
+
+    if ((ret = avformat_open_input(&format_context, request->input_filename, NULL, NULL)) < 0) {
+        log_error("Cannot open input file %s", request->input_filename);
+        return ret;
+    }
+
+    video_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    if (video_index < 0) {
+        log_error("No video stream in %s", request->input_filename);
+        ret = video_index;
+        goto end;
+    }
+    stream = format_context->streams[video_index];
+
+    /* let the demuxer skip every other stream */
+    for (unsigned int i = 0; i < format_context->nb_streams; i++)
+        if (i != video_index)
+            format_context->streams[i]->discard = AVDISCARD_ALL;
+
+    decode_context = avcodec_alloc_context3(decoder);
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    last = av_frame_alloc();
+    if (!decode_context || !packet || !frame || !last) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(decode_context, stream->codecpar)) < 0)
+        goto end;
+    decode_context->pkt_timebase = stream->time_base;
+    if ((ret = avcodec_open2(decode_context, decoder, NULL)) < 0)
+        goto end;
+
+    target = thumbnail_target(request, format_context, stream);
+    if (request->index && (entry = keyframe_index_find(request->index, video_index, target)))
+        ret = keyframe_index_seek(format_context, video_index, entry);
+    else
+        ret = av_seek_frame(format_context, video_index, target, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        log_warning("Seek to %"PRId64" failed, decoding from the start", target);
+        av_seek_frame(format_context, video_index, 0, AVSEEK_FLAG_BACKWARD);
+    }
+
+    /* decode from the keyframe until the first frame at or after the target */
+    while (!have_frame) {
+        int eof = av_read_frame(format_context, packet) < 0;
+
+        if (!eof && packet->stream_index != video_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        ret = avcodec_send_packet(decode_context, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (ret < 0 && ret != AVERROR_EOF)
+            goto end;
+
+        while ((ret = avcodec_receive_frame(decode_context, frame)) >= 0) {
+            if (frame->best_effort_timestamp == AV_NOPTS_VALUE ||
+                frame->best_effort_timestamp >= target) {
+                have_frame = 1;
+                break;
+            }
+            av_frame_unref(last);
+            av_frame_move_ref(last, frame);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+
+        if (eof)
+            break;
+    }
+
+    /* target past the end: fall back to the last frame there is */
+    if (!have_frame && last->data[0]) {
+        av_frame_move_ref(frame, last);
+        have_frame = 1;
+    }
+
+    if (!have_frame) {
+        log_error("No frame found at or after the target");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    ret = write_thumbnail(frame, request->width, request->height, request->output_filename);
+    log_info("thumbnail at pts %"PRId64" written to %s in %"PRId64" ms",
+            frame->best_effort_timestamp, request->output_filename,
+            (av_gettime_relative() - started) / 1000);
+
+end:
+    av_frame_free(&frame);
+    av_frame_free(&last);
+    av_packet_free(&packet);
+    avcodec_free_context(&decode_context);
+    avformat_close_input(&format_context);
+    return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <libavutil/frame.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "keyframe_index.h"
+#include "thread_queue.h"
+
+typedef struct ThumbnailRequest
+{
+    const char *input_filename;
+    const char *output_filename;
+    int64_t frame_number; /* 1-based, like the positional thumbnail argument */
+    double timestamp;     /* seconds from the start, used instead when >= 0 */
+    int width, height;    /* <= 0 keeps the source size */
+    const KeyframeIndex *index; /* optional, seek with it instead of the demuxer's own */
+} ThumbnailRequest;
+
+/*
+ * Seeks to the keyframe before the requested frame, decodes only from there
+ * to the target and writes it as an image. Nothing else in the file is read.
+ */
+int extract_thumbnail(const ThumbnailRequest *request);
+
+/*
+ * Converts frame to the image codec's pixel format, scaled to width x height
+ * when given (a single given dimension keeps the aspect ratio), and writes
+ * it. The filename extension picks the codec: .png, .jpg/.jpeg or .webp.
+ */
+int write_thumbnail(const AVFrame *frame, int width, int height, const char *filename);
+
+/* checks that filename has an image extension write_thumbnail understands */
+int thumbnail_format_supported(const char *filename);
+
+/*
+ * Background pool running write_thumbnail, so the transcode loop only pays
+ * for a frame reference. wait_us counts how long submit blocked the caller
+ * because every worker was busy and the queue was full.
+ */
+typedef struct ThumbnailWriter
+{
+    ThreadQueue queue;
+    pthread_t *threads;
+    int nb_threads;
+    int width, height;
+
+    atomic_int_fast64_t wait_us;
+    atomic_int submitted;
+    atomic_int failed;
+} ThumbnailWriter;
+
+int thumbnail_writer_init(ThumbnailWriter *writer, int nb_threads, int width, int height);
+int thumbnail_writer_submit(ThumbnailWriter *writer, const AVFrame *frame, const char *filename);
+/* waits for the queued thumbnails, returns < 0 if any of them failed */
+int thumbnail_writer_close(ThumbnailWriter *writer);
+
+#endif
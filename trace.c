@@ -0,0 +1,202 @@
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "log.h"
+#include "percentile.h"
+#include "trace.h"
+
+_Thread_local TraceThread *trace_current_thread;
+
+static const char *const stage_names[TRACE_NB_STAGES] = {
+    "demux", "decode", "filter", "encode", "mux", "wait"
+};
+
+
+int tracer_init(Tracer *tracer)
+{
+    int ret;
+
+    tracer->threads = NULL;
+    tracer->nb_threads = 0;
+    tracer->origin = av_gettime_relative();
+    if ((ret = pthread_mutex_init(&tracer->lock, NULL)))
+        return AVERROR(ret);
+    return 0;
+}
+
+void tracer_free(Tracer *tracer)
+{
+    TraceThread *thread = tracer->threads;
+
+    while (thread) {
+        TraceThread *next = thread->next;
+
+        av_free(thread->events);
+        av_free(thread);
+        thread = next;
+    }
+    tracer->threads = NULL;
+    pthread_mutex_destroy(&tracer->lock);
+}
+
+int tracer_attach_thread(Tracer *tracer, const char *name)
+{
+    TraceThread *thread;
+
+    trace_current_thread = NULL;
+    if (!tracer)
+        return 0;
+
+    thread = av_mallocz(sizeof(*thread));
+    if (!thread)
+        return AVERROR(ENOMEM);
+    snprintf(thread->name, sizeof(thread->name), "%s", name);
+    /* the name goes into a JSON string as is */
+    for (char *c = thread->name; *c; c++)
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+            *c = '_';
+
+    pthread_mutex_lock(&tracer->lock);
+    thread->id = ++tracer->nb_threads;
+    thread->next = tracer->threads;
+    tracer->threads = thread;
+    pthread_mutex_unlock(&tracer->lock);
+
+    trace_current_thread = thread;
+    return 0;
+}
+
+void tracer_detach_thread(void)
+{
+    trace_current_thread = NULL;
+}
+
+void trace_push(TraceThread *thread)
+{
+    if (thread->depth < TRACE_MAX_DEPTH) {
+        thread->open_start[thread->depth] = av_gettime_relative();
+        thread->open_nested[thread->depth] = 0;
+    }
+    thread->depth++;
+}
+
+void trace_pop(TraceThread *thread, enum TraceStage stage, int stream_index)
+{
+    int64_t end = av_gettime_relative(), duration;
+    int depth = --thread->depth;
+    TraceEvent *event;
+
+    /* deeper than the stack, the event is dropped */
+    if (depth >= TRACE_MAX_DEPTH || depth < 0)
+        return;
+
+    duration = end - thread->open_start[depth];
+    if (depth > 0)
+        thread->open_nested[depth - 1] += duration;
+
+    if (thread->nb_events == thread->capacity) {
+        int capacity = thread->capacity ? thread->capacity * 2 : 4096;
+        TraceEvent *grown = av_realloc_array(thread->events, capacity, sizeof(*grown));
+
+        if (!grown)
+            return;
+        thread->events = grown;
+        thread->capacity = capacity;
+    }
+
+    event = &thread->events[thread->nb_events++];
+    event->start = thread->open_start[depth];
+    event->duration = duration;
+    event->self = duration - thread->open_nested[depth];
+    event->stream_index = stream_index;
+    event->stage = stage;
+}
+
+int tracer_write_json(const Tracer *tracer, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    const char *separator = "";
+
+    if (!file) {
+        log_error("Cannot open trace file %s", filename);
+        return AVERROR(errno);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (const TraceThread *thread = tracer->threads; thread; thread = thread->next) {
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", separator, thread->id, thread->name);
+        separator = ",";
+
+        for (int i = 0; i < thread->nb_events; i++) {
+            const TraceEvent *event = &thread->events[i];
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%"PRId64",\"dur\":%d,\"args\":{\"stream\":%d,\"self\":%d}}",
+                    stage_names[event->stage], thread->id, event->start - tracer->origin,
+                    event->duration, event->stream_index, event->self);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file)) {
+        log_error("Failed to write trace file %s", filename);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+void tracer_log_summary(const Tracer *tracer)
+{
+    int count[TRACE_NB_STAGES] = { 0 };
+    int64_t *self[TRACE_NB_STAGES] = { NULL };
+
+    for (const TraceThread *thread = tracer->threads; thread; thread = thread->next)
+        for (int i = 0; i < thread->nb_events; i++)
+            count[thread->events[i].stage]++;
+
+    for (int stage = 0; stage < TRACE_NB_STAGES; stage++) {
+        if (count[stage] && !(self[stage] = av_malloc_array(count[stage], sizeof(**self))))
+            goto end;
+        count[stage] = 0;
+    }
+    for (const TraceThread *thread = tracer->threads; thread; thread = thread->next) {
+        for (int i = 0; i < thread->nb_events; i++) {
+            const TraceEvent *event = &thread->events[i];
+
+            self[event->stage][count[event->stage]++] = event->self;
+        }
+    }
+
+    log_info("%-8s %10s %12s %10s %10s", "stage", "events", "total ms", "p50 us", "p99 us");
+    for (int stage = 0; stage < TRACE_NB_STAGES; stage++) {
+        int n = count[stage];
+        int64_t total = 0;
+
+        if (!n)
+            continue;
+        percentile_sort(self[stage], n);
+        for (int i = 0; i < n; i++)
+            total += self[stage][i];
+        log_info("%-8s %10d %12.1f %10"PRId64" %10"PRId64, stage_names[stage], n, total / 1000.0,
+                percentile(self[stage], n, 50), percentile(self[stage], n, 99));
+    }
+
+end:
+    for (int stage = 0; stage < TRACE_NB_STAGES; stage++)
+        av_free(self[stage]);
+}
+
+void tracer_stage_totals(const Tracer *tracer, int64_t totals[TRACE_NB_STAGES])
+{
+    for (int stage = 0; stage < TRACE_NB_STAGES; stage++)
+        totals[stage] = 0;
+    for (const TraceThread *thread = tracer->threads; thread; thread = thread->next)
+        for (int i = 0; i < thread->nb_events; i++)
+            totals[thread->events[i].stage] += thread->events[i].self;
+}
@@ -0,0 +1,90 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+enum TraceStage
+{
+    TRACE_DEMUX,
+    TRACE_DECODE,
+    TRACE_FILTER,
+    TRACE_ENCODE,
+    TRACE_MUX,
+    TRACE_WAIT,     /* blocked pushing into a full queue */
+    TRACE_NB_STAGES,
+};
+
+typedef struct TraceEvent
+{
+    int64_t start;          /* us since the tracer started */
+    int32_t duration;       /* us, including nested events */
+    int32_t self;           /* us, nested events taken out */
+    int16_t stream_index;   /* -1 when the event is not about one stream */
+    uint8_t stage;
+} TraceEvent;
+
+#define TRACE_MAX_DEPTH 8
+
+/* events of one thread, only ever written by that thread */
+typedef struct TraceThread
+{
+    char name[64];
+    int id;
+    TraceEvent *events;
+    int nb_events;
+    int capacity;
+
+    /* open events: start time and time spent in nested ones */
+    int64_t open_start[TRACE_MAX_DEPTH];
+    int64_t open_nested[TRACE_MAX_DEPTH];
+    int depth;
+
+    struct TraceThread *next;
+} TraceThread;
+
+/*
+ * Per-stage timers for one run. Every thread that takes part attaches itself
+ * and records into its own buffer, so recording never takes a lock. Threads
+ * that are not attached pay one thread-local NULL check per timer.
+ */
+typedef struct Tracer
+{
+    pthread_mutex_t lock;
+    TraceThread *threads;
+    int nb_threads;
+    int64_t origin;
+} Tracer;
+
+int tracer_init(Tracer *tracer);
+void tracer_free(Tracer *tracer);
+/* makes the calling thread record into tracer; tracer == NULL detaches it */
+int tracer_attach_thread(Tracer *tracer, const char *name);
+void tracer_detach_thread(void);
+
+extern _Thread_local TraceThread *trace_current_thread;
+
+void trace_push(TraceThread *thread);
+void trace_pop(TraceThread *thread, enum TraceStage stage, int stream_index);
+
+/* wrap one piece of stage work; events nest, begin/end must pair up */
+static inline void trace_begin(void)
+{
+    if (trace_current_thread)
+        trace_push(trace_current_thread);
+}
+
+static inline void trace_end(enum TraceStage stage, int stream_index)
+{
+    if (trace_current_thread)
+        trace_pop(trace_current_thread, stage, stream_index);
+}
+
+/* Chrome trace event format, open it in chrome://tracing or ui.perfetto.dev */
+int tracer_write_json(const Tracer *tracer, const char *filename);
+/* count, total and p50/p99 self time of every stage */
+void tracer_log_summary(const Tracer *tracer);
+/* self time of every stage in us, summed over all threads */
+void tracer_stage_totals(const Tracer *tracer, int64_t totals[TRACE_NB_STAGES]);
+
+#endif
@@ -0,0 +1,3775 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/avstring.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavutil/timestamp.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "async_output.h"
+#include "checkpoint.h"
+#include "hls_origin.h"
+#include "keyframe_index.h"
+#include "live_hls.h"
+#include "log.h"
+#include "mmap_input.h"
+#include "object_pool.h"
+#include "thread_queue.h"
+#include "thumbnail.h"
+#include "trace.h"
+#include "transcode.h"
+
+typedef struct StreamContext
+{
+    AVCodecContext *decode_context;
+
+    AVFrame *decode_frame;
+    int finished; /* every packet up to the end of the range has been read */
+
+    /* what the decoded frames cost and how they went out, see account_fan_out */
+    int64_t frames_decoded, frame_bytes, frame_references, copied_bytes;
+} StreamContext;
+
+typedef struct FilteringContext
+{
+    AVFilterContext *buffersink_context;
+    AVFilterContext *buffersrc_context;
+    AVFilterGraph *filter_graph;
+
+    AVPacket *encode_packet;
+    AVFrame *filtered_frame;
+} FilteringContext;
+
+/*
+ * One output file. A plain run has a single output; a ladder run has one per
+ * rendition, each with its own filters and encoders fed from the same decode.
+ */
+typedef struct OutputContext
+{
+    char *filename;
+    const char *format_name;    /* NULL = guessed from the filename */
+    int res_h, res_w, bitrate;
+    int strip;                  /* an image of tiles over the first video stream, nothing else */
+    unsigned int strip_stream;
+
+    AVFormatContext *format_context;
+    AVCodecContext **encode_context;  /* per input stream, NULL when copied */
+    FilteringContext *filter_context; /* per input stream */
+    LiveHls *live;                    /* stands in for the hls muxer of a live output */
+    Checkpoint *checkpoint;           /* resume state of the playlist with --resume */
+} OutputContext;
+
+/*
+ * Everything one transcode of one input owns. A plain run has one of these;
+ * segment-parallel mode runs one per chunk on its own thread.
+ */
+typedef struct TranscodeContext
+{
+    AVFormatContext *input_format_context;
+    MmapInput *mmap_input;  /* serves input_format_context's reads with --mmap-input */
+    AsyncOutput *async_output;        /* writes every output file with --async-output */
+    StreamContext *stream_context;    /* per input stream */
+    OutputContext *output_context;
+    int nb_outputs;
+    int nb_renditions;      /* ladder outputs, listed first, that go into the master playlist */
+
+    /* input range in AV_TIME_BASE units, AV_NOPTS_VALUE for an open end */
+    int64_t range_start, range_end;
+    int64_t seek_start;     /* AV_TIME_BASE, keyframe the demuxer starts at, AV_NOPTS_VALUE = range_start */
+    int rebase_output;      /* output timestamps count from range_start instead */
+    int range_on_keyframe;  /* range_start falls just before a keyframe, video may be copied */
+    int resume;             /* appends to the playlist of an earlier run, from range_start on */
+    int splice_video;       /* encode video that splices with copied input packets */
+    /* streams whose media type has no bit set here are left empty */
+    unsigned int media_mask;
+    int no_stream_copy;
+    /* threads per video decoder, filter graph and video encoder, 0 = one per core */
+    int decoder_threads, filter_threads, encoder_threads;
+    int open_decoders;      /* 0 leaves the decoder contexts with the stream parameters only */
+
+    int thumbnail_frame;
+    ThumbnailWriter *thumbnail_writer; /* NULL when this run takes no thumbnail */
+
+    TranscodeJob *job;
+    const TranscodeConfig *config;
+    int track_progress;     /* adds this run's position to the job's progress */
+    int64_t progress_pos;   /* AV_TIME_BASE, already added */
+} TranscodeContext;
+
+struct TranscodeJob
+{
+    TranscodeConfig config;     /* strings are owned copies */
+
+    /*
+     * transcode_job_cancel calls so far, those earlier runs stopped for, and
+     * the most the current run has seen: a cancel no run has seen yet is
+     * left for the next one.
+     */
+    atomic_int cancel_requests;
+    int cancels_handled;
+    atomic_int cancels_seen;
+    atomic_int core_quota;      /* 0 = every core */
+    atomic_int_fast64_t progress_us;
+    atomic_int_fast64_t duration_us;    /* 0 while unknown */
+
+    Tracer *tracer;     /* while a traced run is going on */
+    HlsOrigin *origin;  /* with config.serve_port, started by the first run, serving up to destroy */
+    KeyframeIndex index;    /* while a run with config.keyframe_index is going on */
+};
+
+/* a cancel came in that no earlier run stopped for; any thread of the run */
+static int job_cancelled(TranscodeJob *job)
+{
+    int requests = atomic_load(&job->cancel_requests);
+    int seen = atomic_load(&job->cancels_seen);
+
+    if (requests == job->cancels_handled)
+        return 0;
+    while (seen < requests && !atomic_compare_exchange_weak(&job->cancels_seen, &seen, requests))
+        ;
+    return 1;
+}
+
+/* swscale algorithm used by the scale filter, see --scaler */
+static const char *const scaler_names[] = {
+    "fast_bilinear", "bilinear", "bicubic", "experimental", "neighbor", "area",
+    "bicublin", "gauss", "sinc", "lanczos", "spline", NULL
+};
+
+
+void dump_stream_info(AVStream *stream)
+{
+    log_debug("Stream Info");
+    log_debug("r_frame_rate : %d %d\n", stream->r_frame_rate.den, stream->r_frame_rate.num);
+    log_debug("duration : %"PRId64"\n", stream->duration);
+    log_debug("nb_frames : %"PRId64"\n", stream->nb_frames);
+}
+void dump_codec_info(AVCodec *codec)
+{
+    log_debug("Codec Info\n");
+    log_debug("name : %s\n", codec->name);
+    log_debug("long_name : %s\n", codec->long_name);
+}
+
+static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
+        AVCodecContext *enc_ctx, const char *filter_spec, int nb_threads)
+{
+    char args[512];
+    int ret = 0;
+    const AVFilter *buffersrc = NULL;
+    const AVFilter *buffersink = NULL;
+    AVFilterContext *buffersrc_ctx = NULL;
+    AVFilterContext *buffersink_ctx = NULL;
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs  = avfilter_inout_alloc();
+    AVFilterGraph *filter_graph = avfilter_graph_alloc();
+ 
+    if (!outputs || !inputs || !filter_graph) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* slice threads for filters that support them (scale does); 0 = one per core */
+    filter_graph->nb_threads = nb_threads;
+ 
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        buffersrc = avfilter_get_by_name("buffer");
+        buffersink = avfilter_get_by_name("buffersink");
+ 
+        snprintf(args, sizeof(args),
+                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+                dec_ctx->time_base.num, dec_ctx->time_base.den,
+                dec_ctx->sample_aspect_ratio.num,
+                dec_ctx->sample_aspect_ratio.den);
+ 
+        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
+                args, NULL, filter_graph);
+        if (ret < 0) {
+            log_error("Cannot create buffer source\n");
+            goto end;
+        }
+
+        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
+                NULL, NULL, filter_graph);
+        if (ret < 0) {
+            log_error("Cannot create buffer sink\n");
+            goto end;
+        }
+
+        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts",
+                (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
+                AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            log_error("Cannot set output pixel format\n");
+            goto end;
+        }
+    } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        buffersrc = avfilter_get_by_name("abuffer");
+        buffersink = avfilter_get_by_name("abuffersink");
+        
+ 
+        if (!dec_ctx->channel_layout)
+            dec_ctx->channel_layout =
+                av_get_default_channel_layout(dec_ctx->channels);
+        snprintf(args, sizeof(args),
+                "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
+                dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
+                av_get_sample_fmt_name(dec_ctx->sample_fmt),
+                dec_ctx->channel_layout);
+        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
+                args, NULL, filter_graph);
+        if (ret < 0) {
+            log_error("Cannot create audio buffer source\n");
+            goto end;
+        }
+
+        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
+                NULL, NULL, filter_graph);
+        if (ret < 0) {
+            log_error("Cannot create audio buffer sink\n");
+            goto end;
+        }
+
+        ret = av_opt_set_bin(buffersink_ctx, "sample_fmts",
+                (uint8_t*)&enc_ctx->sample_fmt, sizeof(enc_ctx->sample_fmt),
+                AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            log_error("Cannot set output sample format\n");
+            goto end;
+        }
+
+        ret = av_opt_set_bin(buffersink_ctx, "channel_layouts",
+                (uint8_t*)&enc_ctx->channel_layout,
+                sizeof(enc_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            log_error("Cannot set output channel layout\n");
+            goto end;
+        }
+
+        ret = av_opt_set_bin(buffersink_ctx, "sample_rates",
+                (uint8_t*)&enc_ctx->sample_rate, sizeof(enc_ctx->sample_rate),
+                AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            log_error("Cannot set output sample rate\n");
+            goto end;
+        }
+    } else {
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+ 
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = buffersrc_ctx;
+    outputs->pad_idx    = 0;
+    outputs->next       = NULL;
+ 
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = buffersink_ctx;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+ 
+    if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec,
+                    &inputs, &outputs, NULL)) < 0)
+        goto end;
+ 
+    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
+        goto end;
+ 
+    
+    fctx->buffersrc_context = buffersrc_ctx;
+    fctx->buffersink_context = buffersink_ctx;
+    fctx->filter_graph = filter_graph;
+ 
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0)
+        avfilter_graph_free(&filter_graph);
+ 
+    return ret;
+}
+
+typedef int (*packet_sink)(unsigned int stream_index, AVPacket *packet, void *opaque);
+typedef int (*frame_sink)(unsigned int stream_index, AVFrame *frame, void *opaque);
+
+/*
+ * Video codecs get the configured threading; audio codecs are cheap next to
+ * them and mostly single threaded anyway, so they get one thread.
+ */
+static void set_codec_threads(AVCodecContext *codec_context, int nb_threads, int thread_type)
+{
+    if (codec_context->codec_type != AVMEDIA_TYPE_VIDEO)
+    {
+        codec_context->thread_count = 1;
+        return;
+    }
+    codec_context->thread_count = nb_threads;
+    codec_context->thread_type = thread_type ? thread_type : FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+/*
+ * Names the calling thread in the job's trace, "stage output:stream" with the
+ * parts that apply. Does nothing when the job is not traced.
+ */
+static void attach_trace(TranscodeContext *tc, const char *stage, int output_index, int stream_index)
+{
+    char name[64];
+
+    if (!tc->job->tracer)
+        return;
+    if (output_index >= 0 && stream_index >= 0)
+        snprintf(name, sizeof(name), "%s %d:%d", stage, output_index, stream_index);
+    else if (output_index >= 0 || stream_index >= 0)
+        snprintf(name, sizeof(name), "%s %d", stage, output_index >= 0 ? output_index : stream_index);
+    else
+        snprintf(name, sizeof(name), "%s", stage);
+    tracer_attach_thread(tc->job->tracer, name);
+}
+
+/* av_read_frame, timed as the demux stage */
+static int read_packet(AVFormatContext *input_format_context, AVPacket *packet)
+{
+    int ret;
+
+    trace_begin();
+    ret = av_read_frame(input_format_context, packet);
+    trace_end(TRACE_DEMUX, ret >= 0 ? packet->stream_index : -1);
+    if (ret >= 0)
+        log_trace("demux: stream %d pts %s dts %s size %d%s", packet->stream_index,
+                  av_ts2str(packet->pts), av_ts2str(packet->dts), packet->size,
+                  packet->flags & AV_PKT_FLAG_KEY ? " key" : "");
+    return ret;
+}
+
+/* av_interleaved_write_frame, timed as the mux stage */
+static int mux_packet(AVFormatContext *output_format_context, AVPacket *packet)
+{
+    int stream_index = packet->stream_index;
+    int ret;
+
+    log_trace("mux: %s stream %d pts %s dts %s size %d", output_format_context->url, stream_index,
+              av_ts2str(packet->pts), av_ts2str(packet->dts), packet->size);
+    trace_begin();
+    ret = av_interleaved_write_frame(output_format_context, packet);
+    trace_end(TRACE_MUX, stream_index);
+    return ret;
+}
+
+/* mux_packet, or the live packager of a live output */
+static int write_output_packet(OutputContext *output, AVPacket *packet)
+{
+    int stream_index = packet->stream_index;
+    int ret, reference;
+
+    if (output->checkpoint)
+    {
+        /* the hls muxer may start a segment at any packet of the stream it cuts on */
+        if ((reference = checkpoint_packet(output->checkpoint, output->format_context, packet)) < 0)
+            return reference;
+        if ((ret = mux_packet(output->format_context, packet)) >= 0 && reference)
+            checkpoint_update(output->checkpoint);
+        return ret;
+    }
+    if (!output->live)
+        return mux_packet(output->format_context, packet);
+    trace_begin();
+    ret = live_hls_write_packet(output->live, packet);
+    trace_end(TRACE_MUX, stream_index);
+    return ret;
+}
+
+static int write_output_trailer(OutputContext *output)
+{
+    return output->live ? live_hls_close(output->live) : av_write_trailer(output->format_context);
+}
+
+static int write_packet(unsigned int stream_index, AVPacket *packet, void *opaque)
+{
+    OutputContext *output = opaque;
+
+    return write_output_packet(output, packet);
+}
+
+/* frame == NULL drains the encoder; every packet it hands back goes to sink */
+static int encode_frame(OutputContext *output, unsigned int stream_index,
+        AVFrame *filt_frame, packet_sink sink, void *opaque)
+{
+    AVCodecContext *encode_context = output->encode_context[stream_index];
+    FilteringContext *filter = &output->filter_context[stream_index];
+    AVPacket *enc_pkt = filter->encode_packet;
+    int ret;
+ 
+   
+    trace_begin();
+    av_packet_unref(enc_pkt);
+
+    /* fixed quantizer encoders read it from every frame */
+    if (filt_frame && (encode_context->flags & AV_CODEC_FLAG_QSCALE))
+        filt_frame->quality = encode_context->global_quality;
+ 
+    ret = avcodec_send_frame(encode_context, filt_frame);
+ 
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(encode_context, enc_pkt);
+ 
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            ret = 0;
+            break;
+        }
+ 
+        /* prepare packet for muxing */
+        enc_pkt->stream_index = stream_index;
+        av_packet_rescale_ts(enc_pkt,
+                             encode_context->time_base,
+                             output->format_context->streams[stream_index]->time_base);
+ 
+        
+        /* mux encoded frame */
+        ret = sink(stream_index, enc_pkt, opaque);
+    }
+ 
+    trace_end(TRACE_ENCODE, stream_index);
+    return ret;
+}
+
+static int encode_write_frame(OutputContext *output, unsigned int stream_index, int flush)
+{
+    FilteringContext *filter = &output->filter_context[stream_index];
+
+    return encode_frame(output, stream_index, flush ? NULL : filter->filtered_frame,
+                        write_packet, output);
+}
+
+/*
+ * frame == NULL flushes the graph; every frame it hands back goes to sink.
+ * The caller keeps its reference to frame, so one decoded frame can be fed
+ * to every output.
+ */
+static int filter_frame(TranscodeContext *tc, OutputContext *output, AVFrame *frame,
+        unsigned int stream_index, frame_sink sink, void *opaque)
+{
+    FilteringContext *filter = &output->filter_context[stream_index];
+    int ret;
+ 
+    
+    trace_begin();
+    /* push the decoded frame into the filtergraph */
+    ret = av_buffersrc_add_frame_flags(filter->buffersrc_context,
+            frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    
+ 
+    /* pull filtered frames from the filtergraph */
+    while (1) {
+       
+        ret = av_buffersink_get_frame(filter->buffersink_context,
+                                      filter->filtered_frame);
+        if (ret < 0) {
+            /* if no more frames for output - returns AVERROR(EAGAIN)
+             * if flushed and no more frames for output - returns AVERROR_EOF
+             * rewrite retcode to 0 to show it as normal procedure completion
+             */
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                ret = 0;
+            break;
+        }
+
+        /* thumbnails are taken from the first output only */
+        if (tc->thumbnail_writer && output == &tc->output_context[0]) {
+            if(stream_index==0 && filter->filtered_frame->width &&
+               ++tc->thumbnail_frame == tc->config->thumbnail_frame)
+            {
+                char thumbnail_filename[64];
+
+                snprintf(thumbnail_filename, sizeof(thumbnail_filename), "thumbnail_frame_%d.%s",
+                         tc->thumbnail_frame, tc->config->thumbnail_format);
+                /* a failed thumbnail is reported when the writer closes, it does not stop the transcode */
+                thumbnail_writer_submit(tc->thumbnail_writer, filter->filtered_frame, thumbnail_filename);
+            }
+        }
+
+        filter->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        ret = sink(stream_index, filter->filtered_frame, opaque);
+        av_frame_unref(filter->filtered_frame);
+
+        if (ret < 0)
+            break;
+        
+    }
+ 
+    trace_end(TRACE_FILTER, stream_index);
+    return ret;
+}
+
+static int encode_filtered_frame(unsigned int stream_index, AVFrame *frame, void *opaque)
+{
+    return encode_write_frame(opaque, stream_index, 0);
+}
+
+static int filter_encode_write_frame(TranscodeContext *tc, OutputContext *output,
+        AVFrame *frame, unsigned int stream_index)
+{
+    return filter_frame(tc, output, frame, stream_index, encode_filtered_frame, output);
+}
+
+static int flush_encoder(OutputContext *output, unsigned int stream_index)
+{
+    if (!(output->encode_context[stream_index]->codec->capabilities &
+                AV_CODEC_CAP_DELAY))
+        return 0;
+ 
+   
+    return encode_write_frame(output, stream_index, 1);
+}
+
+static int is_transcoded(const OutputContext *output, unsigned int stream_index)
+{
+    return output->filter_context[stream_index].filter_graph != NULL;
+}
+
+/* a stream is decoded once if at least one output transcodes it */
+static int is_decoded(const TranscodeContext *tc, unsigned int stream_index)
+{
+    for (int o = 0; o < tc->nb_outputs; o++)
+        if (is_transcoded(&tc->output_context[o], stream_index))
+            return 1;
+    return 0;
+}
+
+static int nb_transcoding_outputs(const TranscodeContext *tc, unsigned int stream_index)
+{
+    int count = 0;
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+        count += is_transcoded(&tc->output_context[o], stream_index);
+    return count;
+}
+
+/*
+ * Every output transcoding the stream gets a reference to the decoder's
+ * frame. av_frame_ref only copies a frame without reference counted
+ * buffers; such frames are counted as copied once per output, every other
+ * frame is decoded into memory exactly once however many outputs use it.
+ * Called by the one thread decoding the stream.
+ */
+static void account_fan_out(const TranscodeContext *tc, unsigned int stream_index, const AVFrame *frame)
+{
+    StreamContext *stream = &tc->stream_context[stream_index];
+    int nb_outputs = nb_transcoding_outputs(tc, stream_index);
+    int64_t size = 0;
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    for (int i = 0; i < frame->nb_extended_buf; i++)
+        size += frame->extended_buf[i]->size;
+    if (!frame->buf[0])
+    {
+        size = frame->nb_samples
+             ? av_samples_get_buffer_size(NULL, frame->channels, frame->nb_samples, frame->format, 1)
+             : av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+        stream->copied_bytes += FFMAX(size, 0) * nb_outputs;
+    }
+
+    stream->frames_decoded++;
+    stream->frame_bytes += FFMAX(size, 0);
+    stream->frame_references += nb_outputs;
+}
+
+static void log_fan_out(const TranscodeContext *tc)
+{
+    for (unsigned int i = 0; i < tc->input_format_context->nb_streams; i++)
+    {
+        const StreamContext *stream = &tc->stream_context[i];
+        int nb_outputs = nb_transcoding_outputs(tc, i);
+
+        if (nb_outputs < 2 || !stream->frames_decoded)
+            continue;
+        log_info("fan-out: stream %u decoded once for %d outputs, %"PRId64" frames in %.1f MB, "
+                 "handed out as %"PRId64" references, %.1f MB copied", i, nb_outputs,
+                 stream->frames_decoded, stream->frame_bytes / 1048576.0, stream->frame_references,
+                 stream->copied_bytes / 1048576.0);
+    }
+}
+
+/*
+ * Output frame size from the requested height/width. When only one of them
+ * is given the other follows the input aspect ratio, rounded to an even
+ * number so 4:2:0 encoders accept it.
+ */
+static void output_video_size(const OutputContext *output, const AVCodecContext *decode_context,
+        int *width, int *height)
+{
+    *width = output->res_w > 0 ? output->res_w : decode_context->width;
+    *height = output->res_h > 0 ? output->res_h : decode_context->height;
+
+    if (output->res_h > 0 && output->res_w <= 0 && decode_context->height)
+        *width = av_rescale(decode_context->width, output->res_h, decode_context->height) & ~1;
+    else if (output->res_w > 0 && output->res_h <= 0 && decode_context->width)
+        *height = av_rescale(decode_context->height, output->res_w, decode_context->width) & ~1;
+}
+
+/*
+ * A stream is remuxed packet for packet when the output would re-encode it
+ * with the same codec at the same size and bitrate, and the container takes
+ * that codec. A query answer of "unknown" (< 0) is treated as yes, muxers
+ * like hls only know their default codecs.
+ */
+static int can_stream_copy(const TranscodeContext *tc, const OutputContext *output,
+        const AVOutputFormat *oformat, const AVStream *input_stream,
+        const AVCodecContext *decode_context)
+{
+    const AVCodecParameters *par = input_stream->codecpar;
+
+    if (tc->no_stream_copy || output->strip)
+        return 0;
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        int width, height;
+
+        /* the first packet of a cut is rarely a keyframe, only the encoder can make one */
+        if (tc->range_start != AV_NOPTS_VALUE && !tc->range_on_keyframe)
+            return 0;
+        output_video_size(output, decode_context, &width, &height);
+        if (width != par->width || height != par->height)
+            return 0;
+        if (output->bitrate > 0 && output->bitrate != par->bit_rate)
+            return 0;
+    }
+    else if (par->codec_type != AVMEDIA_TYPE_AUDIO)
+        return 0;
+
+    return avformat_query_codec(oformat, par->codec_id, FF_COMPLIANCE_NORMAL) != 0;
+}
+
+static int in_media_mask(const TranscodeContext *tc, const AVStream *stream)
+{
+    enum AVMediaType type = stream->codecpar->codec_type;
+
+    return type >= 0 && (tc->media_mask & (1u << type));
+}
+
+/*
+ * Encoder settings for video spliced between copied GOPs of the input: the
+ * same profile, level, pixel format and colour description, so a player
+ * sees one consistent stream across the seams.
+ */
+static void match_input_stream(AVCodecContext *encoder_context, const AVCodec *encoder,
+        const AVCodecContext *decode_context, const AVCodecParameters *par)
+{
+    encoder_context->profile = par->profile;
+    encoder_context->level = par->level;
+    for (const enum AVPixelFormat *format = encoder->pix_fmts; format && *format != AV_PIX_FMT_NONE; format++)
+        if (*format == decode_context->pix_fmt)
+            encoder_context->pix_fmt = decode_context->pix_fmt;
+    encoder_context->color_range = decode_context->color_range;
+    encoder_context->color_primaries = decode_context->color_primaries;
+    encoder_context->color_trc = decode_context->color_trc;
+    encoder_context->colorspace = decode_context->colorspace;
+    encoder_context->chroma_sample_location = decode_context->chroma_sample_location;
+}
+
+/* a keyframe at every segment boundary, since segmenters only cut at keyframes */
+static void set_segment_gop(AVCodecContext *encoder_context, const AVCodecContext *decode_context,
+        double segment_time)
+{
+    if (decode_context->framerate.num && decode_context->framerate.den)
+        encoder_context->gop_size = lrint(segment_time * av_q2d(decode_context->framerate));
+}
+
+/* no encoder lookahead holding frames back: libx264/libx265 otherwise buffer more than a second */
+static void set_live_encoding(const TranscodeConfig *config, AVCodecContext *encoder_context,
+        const AVCodecContext *decode_context)
+{
+    set_segment_gop(encoder_context, decode_context,
+                    config->live_segment_time > 0 ? config->live_segment_time : 2);
+    av_opt_set(encoder_context->priv_data, "tune", "zerolatency", 0);
+}
+
+/*
+ * One set of CMAF fMP4 segments for both protocols: the dash muxer writes the
+ * MPD and, with hls_playlist, an HLS master playlist plus one media playlist
+ * per stream, all pointing at the same segment files.
+ */
+static void set_cmaf_options(const TranscodeConfig *config, AVDictionary **options)
+{
+    char segment_time[32];
+
+    /* a duration option, parsed as seconds */
+    snprintf(segment_time, sizeof(segment_time), "%.3f",
+             config->cmaf_segment_time > 0 ? config->cmaf_segment_time : 4);
+    av_dict_set(options, "seg_duration", segment_time, 0);
+    av_dict_set(options, "dash_segment_type", "mp4", 0);
+    av_dict_set(options, "hls_playlist", "1", 0);
+    av_dict_set(options, "use_template", "1", 0);
+    av_dict_set(options, "use_timeline", "1", 0);
+}
+
+/* tiles in a strip, and their height when the output gives no size */
+#define STRIP_TILES 10
+#define STRIP_TILE_HEIGHT 90
+
+/* a strip leaves every stream but its video out, no packet of them is written */
+static int takes_stream(const OutputContext *output, unsigned int stream_index)
+{
+    return !output->strip || stream_index == output->strip_stream;
+}
+
+static void strip_tile_size(const OutputContext *output, const AVCodecContext *decode_context,
+        int *width, int *height)
+{
+    OutputContext tile = *output;
+
+    if (tile.res_h <= 0 && tile.res_w <= 0)
+        tile.res_h = STRIP_TILE_HEIGHT;
+    output_video_size(&tile, decode_context, width, height);
+}
+
+/* seconds the tiles are spread over: the range, or the whole input */
+static double strip_duration(const TranscodeContext *tc)
+{
+    const AVFormatContext *input = tc->input_format_context;
+    int64_t start = tc->range_start != AV_NOPTS_VALUE ? tc->range_start
+                  : input->start_time != AV_NOPTS_VALUE ? input->start_time : 0;
+    int64_t end = tc->range_end;
+
+    if (end == AV_NOPTS_VALUE && input->duration != AV_NOPTS_VALUE)
+        end = (input->start_time != AV_NOPTS_VALUE ? input->start_time : 0) + input->duration;
+    /* a tile every ten seconds when nobody knows how long the input is */
+    return end != AV_NOPTS_VALUE && end > start ? (end - start) / (double)AV_TIME_BASE : STRIP_TILES * 10.0;
+}
+
+/* the image codec the strip's extension asks for, whatever muxer writes it */
+static AVCodec *strip_encoder(const OutputContext *output)
+{
+    return avcodec_find_encoder(av_guess_codec(av_guess_format("image2", NULL, NULL), NULL,
+                                               output->filename, NULL, AVMEDIA_TYPE_VIDEO));
+}
+
+static int open_output(TranscodeContext *tc, OutputContext *output)
+{
+    AVFormatContext *input_format_context = tc->input_format_context;
+    AVFormatContext *output_format_context = NULL;
+    AVStream *output_stream, *input_stream;
+    AVCodecContext *decode_context, *encoder_context;
+    AVCodec *encoder;
+    AVDictionary *muxer_options = NULL;
+
+    int ret;
+
+    output->encode_context = av_mallocz_array(input_format_context->nb_streams,
+                                              sizeof(*output->encode_context));
+    if (!output->encode_context)
+        return AVERROR(ENOMEM);
+
+    avformat_alloc_output_context2(&output_format_context, NULL, output->format_name, output->filename);
+
+    if (!output_format_context)
+    {
+        log_error("Couldnt create output context\n");
+        return AVERROR_UNKNOWN;
+    }
+    output->format_context = output_format_context;
+
+    if (output->strip)
+    {
+        unsigned int i = 0;
+
+        while (i < input_format_context->nb_streams &&
+               input_format_context->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+            i++;
+        if (i == input_format_context->nb_streams || !strip_encoder(output))
+        {
+            log_error("%s: a thumbnail strip needs a video stream and an image encoder", output->filename);
+            return AVERROR(EINVAL);
+        }
+        output->strip_stream = i;
+        /* one image, rewritten should the tiles ever run over */
+        av_dict_set(&muxer_options, "update", "1", 0);
+    }
+    /* applied by the muxer to every packet, copied or encoded alike */
+    if (tc->rebase_output && tc->range_start != AV_NOPTS_VALUE)
+        output_format_context->output_ts_offset = -tc->range_start;
+
+    for (int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        output_stream = avformat_new_stream(output_format_context, NULL);
+        if (!output_stream)
+        {
+            log_error("Failed allocation output stream\n");
+            av_dict_free(&muxer_options);
+            return AVERROR_UNKNOWN;
+        }
+
+        input_stream = input_format_context->streams[i];
+        decode_context = tc->stream_context[i].decode_context;
+
+        if (!in_media_mask(tc, input_stream) || !takes_stream(output, i))
+        {
+            /* keeps stream indexes lined up with the input, no packet is ever written */
+            ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+            output_stream->codecpar->codec_tag = 0;
+            output_stream->time_base = input_stream->time_base;
+        }
+        else if (can_stream_copy(tc, output, output_format_context->oformat, input_stream, decode_context))
+        {
+            log_info("%s: stream %d copied without re-encoding", output->filename, i);
+            ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+            /* the input container's tag may mean nothing in the output one */
+            output_stream->codecpar->codec_tag = 0;
+            output_stream->time_base = input_stream->time_base;
+        }
+        else if (decode_context->codec_type == AVMEDIA_TYPE_VIDEO || decode_context->codec_type == AVMEDIA_TYPE_AUDIO)
+        {
+
+            
+            encoder = output->strip ? strip_encoder(output) : avcodec_find_encoder(decode_context->codec_id);
+            
+            if (!encoder)
+            {
+                log_error("%s: no encoder for stream %d", output->filename, i);
+                av_dict_free(&muxer_options);
+                return AVERROR_ENCODER_NOT_FOUND;
+            }
+            encoder_context = avcodec_alloc_context3(encoder);
+            if (!encoder_context)
+            {
+                av_dict_free(&muxer_options);
+                return AVERROR(ENOMEM);
+            }
+
+            if (decode_context->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                output_video_size(output, decode_context,
+                                  &encoder_context->width, &encoder_context->height);
+                encoder_context->sample_aspect_ratio = decode_context->sample_aspect_ratio;
+                encoder_context->bit_rate = output->bitrate > 0 ? output->bitrate : decode_context->bit_rate;
+                encoder_context->time_base = av_inv_q(decode_context->framerate);
+                
+                if (encoder->pix_fmts)
+                {
+                    encoder_context->pix_fmt = encoder->pix_fmts[0];
+                }
+                else
+                {
+                    encoder_context->pix_fmt = decode_context->pix_fmt;
+                }
+                if (output->strip)
+                {
+                    strip_tile_size(output, decode_context, &encoder_context->width, &encoder_context->height);
+                    encoder_context->width *= STRIP_TILES;
+                    encoder_context->bit_rate = 0;
+                    if (encoder->id == AV_CODEC_ID_MJPEG)
+                    {
+                        /* fixed quantizer, like the single thumbnails */
+                        encoder_context->flags |= AV_CODEC_FLAG_QSCALE;
+                        encoder_context->global_quality = 2 * FF_QP2LAMBDA;
+                    }
+                }
+                if (tc->splice_video)
+                    match_input_stream(encoder_context, encoder, decode_context, input_stream->codecpar);
+                if (tc->config->live)
+                    set_live_encoding(tc->config, encoder_context, decode_context);
+                else if (tc->config->cmaf)
+                    set_segment_gop(encoder_context, decode_context,
+                                    tc->config->cmaf_segment_time > 0 ? tc->config->cmaf_segment_time : 4);
+            }
+            else
+            {
+                encoder_context->sample_rate = decode_context->sample_rate;
+                encoder_context->channel_layout = decode_context->channel_layout;
+                encoder_context->channels = av_get_channel_layout_nb_channels(encoder_context->channel_layout);
+                encoder_context->sample_fmt = encoder->sample_fmts[0];
+                encoder_context->time_base = (AVRational){1, encoder_context->sample_rate};
+            }
+
+            /* spliced video carries its parameter sets in every keyframe instead */
+            if ((output_format_context->oformat->flags & AVFMT_GLOBALHEADER) &&
+                !(tc->splice_video && decode_context->codec_type == AVMEDIA_TYPE_VIDEO))
+                encoder_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+            set_codec_threads(encoder_context, tc->encoder_threads, tc->config->codec_thread_type);
+            /* owned by the output from here on, freed by close_output whatever happens next */
+            output->encode_context[i] = encoder_context;
+            if ((ret = avcodec_open2(encoder_context, encoder, NULL)) < 0 ||
+                (ret = avcodec_parameters_from_context(output_stream->codecpar, encoder_context)) < 0)
+            {
+                log_error("%s: cannot open the %s encoder for stream %d (%s)", output->filename,
+                          encoder->name, i, av_err2str(ret));
+                av_dict_free(&muxer_options);
+                return ret;
+            }
+            output_stream->time_base = encoder_context->time_base;
+        }
+        else
+        {
+            ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+            output_stream->time_base = input_stream->time_base;
+        }
+        if (ret < 0)
+        {
+            av_dict_free(&muxer_options);
+            return ret;
+        }
+    }
+
+    if (tc->config->live && !strcmp(output_format_context->oformat->name, "hls"))
+    {
+        LiveHlsOptions options = {
+            .segment_time = tc->config->live_segment_time > 0 ? tc->config->live_segment_time : 2,
+            .part_time = tc->config->live_part_time,
+            .window = tc->config->live_window > 0 ? tc->config->live_window : 6,
+        };
+
+        return live_hls_open(&output->live, output_format_context, output->filename, &options);
+    }
+
+    /* the hls muxer opens its playlist and segments itself, through io_open */
+    if (tc->job->origin && !strcmp(output_format_context->oformat->name, "hls"))
+        hls_origin_attach(tc->job->origin, output_format_context);
+    if (tc->async_output)
+        async_output_attach(tc->async_output, output_format_context);
+    if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+    {
+        if (tc->async_output)
+            ret = async_output_open(tc->async_output, &output_format_context->pb, output->filename);
+        else
+            ret = avio_open(&output_format_context->pb, output->filename, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            log_error("Could not open %s (%s)", output->filename, av_err2str(ret));
+            av_dict_free(&muxer_options);
+            return ret;
+        }
+    }
+    if (tc->config->cmaf && !strcmp(output_format_context->oformat->name, "dash"))
+        set_cmaf_options(tc->config, &muxer_options);
+    if (output->checkpoint)
+    {
+        /*
+         * Every segment stays listed, and the playlist and segments are
+         * renamed into place whole, so the playlist on disk only ever lists
+         * complete segments. A resumed run reads it back and appends.
+         */
+        av_dict_set(&muxer_options, "hls_list_size", "0", 0);
+        av_dict_set(&muxer_options, "hls_flags", tc->resume ? "temp_file+append_list" : "temp_file", 0);
+    }
+    ret = avformat_write_header(output_format_context, &muxer_options);
+    av_dict_free(&muxer_options);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int init_output_filters(TranscodeContext *tc, OutputContext *output)
+{
+    AVFormatContext *input_format_context = tc->input_format_context;
+    char filter_spec[256];
+    int ret;
+
+    output->filter_context = av_malloc_array(input_format_context->nb_streams, sizeof(*output->filter_context));
+    if (!output->filter_context)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        FilteringContext *filter = &output->filter_context[i];
+        AVCodecContext *decode_context = tc->stream_context[i].decode_context;
+        AVCodecContext *encode_context = output->encode_context[i];
+
+        filter->buffersrc_context = NULL;
+        filter->buffersink_context = NULL;
+        filter->filter_graph = NULL;
+        filter->encode_packet = NULL;
+        filter->filtered_frame = NULL;
+        /* copied streams, and streams that are neither audio nor video, skip decoding */
+        if (!encode_context)
+            continue;
+
+        if (input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            snprintf(filter_spec, sizeof(filter_spec), "anull");
+        else if (output->strip)
+        {
+            int width, height;
+
+            /* evenly spaced frames, cut off at a full strip so a late extra one cannot start another */
+            strip_tile_size(output, decode_context, &width, &height);
+            snprintf(filter_spec, sizeof(filter_spec),
+                     "fps=fps=%f,trim=end_frame=%d,scale=w=%d:h=%d:flags=%s,tile=%dx1",
+                     STRIP_TILES / strip_duration(tc), STRIP_TILES, width, height,
+                     tc->config->scaler, STRIP_TILES);
+        }
+        else if (encode_context->width == decode_context->width &&
+                 encode_context->height == decode_context->height)
+            snprintf(filter_spec, sizeof(filter_spec), "null");
+        else
+            snprintf(filter_spec, sizeof(filter_spec), "scale=w=%d:h=%d:flags=%s",
+                     encode_context->width, encode_context->height, tc->config->scaler);
+
+        ret = init_filter(filter, decode_context, encode_context, filter_spec,
+                          tc->filter_threads);
+         
+        if (ret)
+            return ret;
+
+        filter->encode_packet = av_packet_alloc();
+        if (!filter->encode_packet)
+            return AVERROR(ENOMEM);
+
+        filter->filtered_frame = av_frame_alloc();
+        if (!filter->filtered_frame)
+            return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+static void close_output(OutputContext *output, unsigned int nb_streams)
+{
+    for (unsigned int i = 0; i < nb_streams; i++) {
+        if (output->encode_context)
+            avcodec_free_context(&output->encode_context[i]);
+        if (output->filter_context && output->filter_context[i].filter_graph) {
+            avfilter_graph_free(&output->filter_context[i].filter_graph);
+            av_packet_free(&output->filter_context[i].encode_packet);
+            av_frame_free(&output->filter_context[i].filtered_frame);
+        }
+    }
+    av_freep(&output->encode_context);
+    av_freep(&output->filter_context);
+    live_hls_free(&output->live);
+
+    if (output->format_context && !(output->format_context->oformat->flags & AVFMT_NOFILE))
+        async_output_close(&output->format_context->pb);
+    avformat_free_context(output->format_context);
+    output->format_context = NULL;
+    av_freep(&output->filename);
+}
+
+/*
+ * Ladder spec: comma separated "height:width:bitrate" renditions, with -1 for
+ * "same as the input" exactly like the positional arguments. Each rendition
+ * is written next to the master playlist as <name>_<height>p.m3u8.
+ */
+static int parse_ladder(TranscodeContext *tc, const char *spec, const char *master_filename)
+{
+    const char *extension = strrchr(master_filename, '.');
+    int stem_length;
+    int count = 1;
+
+    if (!extension || strcmp(extension, ".m3u8"))
+    {
+        log_error("--ladder needs a .m3u8 output to write the master playlist to");
+        return AVERROR(EINVAL);
+    }
+    stem_length = extension - master_filename;
+
+    for (const char *c = spec; *c; c++)
+        if (*c == ',')
+            count++;
+
+    tc->output_context = av_mallocz_array(count, sizeof(*tc->output_context));
+    if (!tc->output_context)
+        return AVERROR(ENOMEM);
+    tc->nb_outputs = tc->nb_renditions = count;
+
+    for (int i = 0; i < count; i++)
+    {
+        OutputContext *output = &tc->output_context[i];
+        int consumed = 0;
+
+        if (sscanf(spec, "%d:%d:%d%n", &output->res_h, &output->res_w,
+                   &output->bitrate, &consumed) != 3 ||
+            (spec[consumed] != ',' && spec[consumed] != '\0'))
+        {
+            log_error("Wrong --ladder rendition '%s', expected height:width:bitrate", spec);
+            return AVERROR(EINVAL);
+        }
+        spec += consumed + (spec[consumed] == ',');
+
+        if (output->res_h > 0)
+            output->filename = av_asprintf("%.*s_%dp.m3u8", stem_length, master_filename, output->res_h);
+        else
+            output->filename = av_asprintf("%.*s_%d.m3u8", stem_length, master_filename, i);
+        if (!output->filename)
+            return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+static int64_t output_bandwidth(const OutputContext *output)
+{
+    AVFormatContext *format_context = output->format_context;
+    int64_t bandwidth = 0;
+
+    for (unsigned int i = 0; i < format_context->nb_streams; i++)
+        bandwidth += format_context->streams[i]->codecpar->bit_rate;
+    return bandwidth;
+}
+
+static int write_master_playlist(const TranscodeContext *tc, const char *filename)
+{
+    HlsOrigin *origin = tc->job->origin;
+    char *data = NULL;
+    size_t size = 0;
+    FILE *master = origin || tc->async_output ? open_memstream(&data, &size) : fopen(filename, "w");
+
+    if (!master)
+    {
+        log_error("Cannot open master playlist %s", filename);
+        return AVERROR(errno);
+    }
+
+    fprintf(master, "#EXTM3U\n#EXT-X-VERSION:3\n");
+    for (int i = 0; i < tc->nb_renditions; i++)
+    {
+        OutputContext *output = &tc->output_context[i];
+        const char *uri = strrchr(output->filename, '/');
+        int width = 0, height = 0;
+
+        for (unsigned int s = 0; s < output->format_context->nb_streams; s++)
+        {
+            AVCodecParameters *par = output->format_context->streams[s]->codecpar;
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                width = par->width;
+                height = par->height;
+                break;
+            }
+        }
+
+        fprintf(master, "#EXT-X-STREAM-INF:BANDWIDTH=%"PRId64, output_bandwidth(output));
+        if (width && height)
+            fprintf(master, ",RESOLUTION=%dx%d", width, height);
+        fprintf(master, "\n%s\n", uri ? uri + 1 : output->filename);
+    }
+
+    fclose(master);
+    /* served next to the renditions, from memory as well */
+    if (origin)
+    {
+        AVBufferRef *buffer = av_buffer_alloc(size);
+
+        if (buffer)
+            memcpy(buffer->data, data, size);
+        free(data);
+        if (!buffer)
+            return AVERROR(ENOMEM);
+        return hls_origin_publish(origin, av_basename(filename), &buffer);
+    }
+    /* written by the I/O thread and renamed into place, like the renditions */
+    if (tc->async_output)
+    {
+        AVIOContext *pb;
+        int ret = async_output_open(tc->async_output, &pb, filename);
+
+        if (ret >= 0)
+        {
+            avio_write(pb, (const unsigned char *)data, size);
+            async_output_close(&pb);
+        }
+        else
+            log_error("Cannot open master playlist %s", filename);
+        free(data);
+        return ret;
+    }
+    return 0;
+}
+
+static void init_transcode_context(TranscodeContext *tc, TranscodeJob *job)
+{
+    int quota = atomic_load(&job->core_quota);
+
+    memset(tc, 0, sizeof(*tc));
+    tc->range_start = AV_NOPTS_VALUE;
+    tc->range_end = AV_NOPTS_VALUE;
+    tc->seek_start = AV_NOPTS_VALUE;
+    tc->media_mask = ~0u;
+    tc->job = job;
+    tc->config = &job->config;
+    tc->no_stream_copy = job->config.no_stream_copy;
+    tc->decoder_threads = job->config.decoder_threads;
+    tc->filter_threads = job->config.filter_threads;
+    tc->encoder_threads = job->config.encoder_threads;
+    tc->open_decoders = 1;
+    tc->track_progress = 1;
+
+    /* a scheduler's quota stands in for "one per core" */
+    if (quota > 0 && job->config.thread_budget <= 0)
+    {
+        if (!tc->decoder_threads)
+            tc->decoder_threads = quota;
+        if (!tc->filter_threads)
+            tc->filter_threads = quota;
+        if (!tc->encoder_threads)
+            tc->encoder_threads = quota;
+    }
+}
+
+enum DemuxAction
+{
+    DEMUX_KEEP,
+    DEMUX_SKIP, /* drop this packet, keep reading */
+    DEMUX_DONE, /* every stream is past the end of the range */
+};
+
+static void update_progress(TranscodeContext *tc, const AVPacket *packet, const AVStream *stream)
+{
+    int64_t origin = tc->range_start, position;
+
+    if (!tc->track_progress || packet->pts == AV_NOPTS_VALUE)
+        return;
+    if (origin == AV_NOPTS_VALUE)
+        origin = tc->input_format_context->start_time != AV_NOPTS_VALUE ?
+                 tc->input_format_context->start_time : 0;
+
+    position = av_rescale_q(packet->pts, stream->time_base, AV_TIME_BASE_Q) - origin;
+    if (position > tc->progress_pos)
+    {
+        atomic_fetch_add(&tc->job->progress_us, position - tc->progress_pos);
+        tc->progress_pos = position;
+    }
+}
+
+/* also stops at the first packet after a cancel, so the run drains and finishes */
+static enum DemuxAction demux_action(TranscodeContext *tc, const AVPacket *packet)
+{
+    AVFormatContext *input_format_context = tc->input_format_context;
+    AVStream *stream = input_format_context->streams[packet->stream_index];
+    StreamContext *sc = &tc->stream_context[packet->stream_index];
+
+    if (job_cancelled(tc->job))
+        return DEMUX_DONE;
+    if (!in_media_mask(tc, stream) || sc->finished)
+        return DEMUX_SKIP;
+
+    /* dts <= pts, so nothing the range needs comes after the first packet past its end */
+    if (tc->range_end == AV_NOPTS_VALUE || packet->dts == AV_NOPTS_VALUE ||
+        av_compare_ts(packet->dts, stream->time_base, tc->range_end, AV_TIME_BASE_Q) < 0)
+    {
+        /*
+         * decoded streams are trimmed frame by frame, copied ones packet by
+         * packet: at the end too, where a reordered keyframe may be read
+         * before frames it is shown after
+         */
+        if (!is_decoded(tc, packet->stream_index) && packet->pts != AV_NOPTS_VALUE &&
+            ((tc->range_start != AV_NOPTS_VALUE &&
+              av_compare_ts(packet->pts, stream->time_base, tc->range_start, AV_TIME_BASE_Q) < 0) ||
+             (tc->range_end != AV_NOPTS_VALUE &&
+              av_compare_ts(packet->pts, stream->time_base, tc->range_end, AV_TIME_BASE_Q) >= 0)))
+            return DEMUX_SKIP;
+        update_progress(tc, packet, stream);
+        return DEMUX_KEEP;
+    }
+
+    sc->finished = 1;
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        enum AVMediaType type = input_format_context->streams[i]->codecpar->codec_type;
+
+        if ((type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO) &&
+            in_media_mask(tc, input_format_context->streams[i]) && !tc->stream_context[i].finished)
+            return DEMUX_SKIP;
+    }
+    return DEMUX_DONE;
+}
+
+/* decoding starts at the keyframe before the range, frames outside it are dropped */
+static int frame_in_range(const TranscodeContext *tc, unsigned int stream_index, const AVFrame *frame)
+{
+    AVRational time_base = tc->stream_context[stream_index].decode_context->time_base;
+
+    if (frame->pts == AV_NOPTS_VALUE || !time_base.num)
+        return 1;
+    if (tc->range_start != AV_NOPTS_VALUE &&
+        av_compare_ts(frame->pts, time_base, tc->range_start, AV_TIME_BASE_Q) < 0)
+        return 0;
+    if (tc->range_end != AV_NOPTS_VALUE &&
+        av_compare_ts(frame->pts, time_base, tc->range_end, AV_TIME_BASE_Q) >= 0)
+        return 0;
+    return 1;
+}
+
+/*
+ * Pipelined transcode: demux, per-stream decode, per-output filter and
+ * encode, and per-output mux each run on their own thread, joined by bounded
+ * ThreadQueues.
+ *
+ * Every demuxed packet gets a sequence number. Each stage forwards a MARKER
+ * once it has queued everything produced for a sequence number, and the demux
+ * thread records the stream of every packet on each output's order_queue.
+ * The mux threads replay that order, so av_interleaved_write_frame sees
+ * exactly the packet sequence the serial loop produces and the output stays
+ * byte-identical.
+ */
+#define PIPELINE_PACKET_QUEUE_SIZE 64
+#define PIPELINE_FRAME_QUEUE_SIZE 8
+#define PIPELINE_ORDER_QUEUE_SIZE 256
+
+struct Pipeline;
+
+typedef struct PipelineWorker
+{
+    struct Pipeline *pipeline;
+    OutputContext *output;
+    unsigned int stream_index;
+    int64_t seq;
+} PipelineWorker;
+
+/* input side of one stream, shared by every output */
+typedef struct PipelineStream
+{
+    ThreadQueue packet_queue;   /* demux  -> decode */
+    int decoded;
+
+    /* shells for every packet and frame of this stream in any queue */
+    ObjectPool packet_pool;
+    ObjectPool frame_pool;
+
+    PipelineWorker decode_worker;
+    pthread_t decode_thread;
+    int decode_started;
+} PipelineStream;
+
+/* one output's chain for one stream */
+typedef struct PipelineBranch
+{
+    ThreadQueue frame_queue;    /* decode -> filter */
+    ThreadQueue filtered_queue; /* filter -> encode */
+    ThreadQueue mux_queue;      /* encode (or demux for copied streams) -> mux */
+
+    PipelineWorker workers[2];  /* filter, encode */
+    pthread_t threads[2];
+    int nb_threads;
+} PipelineBranch;
+
+typedef struct PipelineOutput
+{
+    ThreadQueue order_queue;
+
+    PipelineWorker mux_worker;
+    pthread_t mux_thread;
+    int mux_started;
+} PipelineOutput;
+
+typedef struct Pipeline
+{
+    TranscodeContext *tc;
+    AVFormatContext *input_format_context;
+    unsigned int nb_streams;
+
+    PipelineStream *streams;
+    PipelineBranch *branches;   /* nb_outputs * nb_streams, output major */
+    PipelineOutput *outputs;
+
+    pthread_t demux_thread;
+    int demux_started;
+
+    atomic_int error;
+} Pipeline;
+
+static PipelineBranch *pipeline_branch(Pipeline *pipeline, OutputContext *output,
+        unsigned int stream_index)
+{
+    return &pipeline->branches[(output - pipeline->tc->output_context) * pipeline->nb_streams + stream_index];
+}
+
+static void free_queued_packet(void *data)
+{
+    AVPacket *packet = data;
+    av_packet_free(&packet);
+}
+
+static void free_queued_frame(void *data)
+{
+    AVFrame *frame = data;
+    av_frame_free(&frame);
+}
+
+static void pipeline_fail(Pipeline *pipeline, int error)
+{
+    TranscodeContext *tc = pipeline->tc;
+    int expected = 0;
+
+    if (error == AVERROR_EXIT)
+        return;
+    if (!atomic_compare_exchange_strong(&pipeline->error, &expected, error))
+        return;
+
+    log_error("pipeline stopped: %s", av_err2str(error));
+    for (unsigned int i = 0; i < pipeline->nb_streams; i++)
+        thread_queue_abort(&pipeline->streams[i].packet_queue);
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        thread_queue_abort(&pipeline->outputs[o].order_queue);
+        for (unsigned int i = 0; i < pipeline->nb_streams; i++)
+        {
+            PipelineBranch *branch = pipeline_branch(pipeline, &tc->output_context[o], i);
+
+            thread_queue_abort(&branch->frame_queue);
+            thread_queue_abort(&branch->filtered_queue);
+            thread_queue_abort(&branch->mux_queue);
+        }
+    }
+}
+
+/* thread_queue_push, the time it blocks on a full queue is traced as wait */
+static int push_item(ThreadQueue *queue, QueueItem item)
+{
+    int ret;
+
+    trace_begin();
+    ret = thread_queue_push(queue, item);
+    trace_end(TRACE_WAIT, -1);
+    return ret;
+}
+
+static int push_marker(ThreadQueue *queue, enum QueueItemType type, int64_t seq)
+{
+    QueueItem item = { .type = type, .data = NULL, .seq = seq };
+    return push_item(queue, item);
+}
+
+/*
+ * Queues frame in a pooled shell. With move the reference is taken over and
+ * frame is left blank, otherwise the caller keeps its own.
+ */
+static int push_frame(ThreadQueue *queue, ObjectPool *pool, AVFrame *frame, int64_t seq, int move)
+{
+    QueueItem item = { .type = QUEUE_ITEM_DATA, .seq = seq };
+    AVFrame *queued = object_pool_get(pool);
+    int ret;
+
+    if (!queued)
+        return AVERROR(ENOMEM);
+
+    if (move)
+        av_frame_move_ref(queued, frame);
+    else if ((ret = av_frame_ref(queued, frame)) < 0)
+    {
+        object_pool_put(pool, queued);
+        return ret;
+    }
+
+    item.data = queued;
+    if ((ret = push_item(queue, item)) < 0)
+        object_pool_put(pool, queued);
+    return ret;
+}
+
+/* a pooled packet referencing (or with move, taking over) packet */
+static AVPacket *take_packet(ObjectPool *pool, AVPacket *packet, int move)
+{
+    AVPacket *queued = object_pool_get(pool);
+
+    if (!queued)
+        return NULL;
+
+    if (move)
+        av_packet_move_ref(queued, packet);
+    else if (av_packet_ref(queued, packet) < 0)
+    {
+        object_pool_put(pool, queued);
+        return NULL;
+    }
+    return queued;
+}
+
+static int queue_packet(ThreadQueue *queue, ObjectPool *pool, AVPacket *queued, int64_t seq)
+{
+    QueueItem item = { .type = QUEUE_ITEM_DATA, .data = queued, .seq = seq };
+    int ret;
+
+    if ((ret = push_item(queue, item)) < 0)
+        object_pool_put(pool, queued);
+    return ret;
+}
+
+static int push_packet(ThreadQueue *queue, ObjectPool *pool, AVPacket *packet, int64_t seq, int move)
+{
+    AVPacket *queued = take_packet(pool, packet, move);
+
+    if (!queued)
+        return AVERROR(ENOMEM);
+    return queue_packet(queue, pool, queued, seq);
+}
+
+static void *demux_thread_main(void *arg)
+{
+    Pipeline *pipeline = arg;
+    TranscodeContext *tc = pipeline->tc;
+    AVFormatContext *input_format_context = pipeline->input_format_context;
+    AVPacket *packet = av_packet_alloc();
+    int64_t seq = 0;
+    int ret = 0;
+
+    attach_trace(tc, "demux", -1, -1);
+
+    if (!packet)
+    {
+        pipeline_fail(pipeline, AVERROR(ENOMEM));
+        return NULL;
+    }
+
+    while (read_packet(input_format_context, packet) >= 0)
+    {
+        unsigned int stream_index = packet->stream_index;
+        AVRational input_time_base = input_format_context->streams[stream_index]->time_base;
+        QueueItem order = { .type = QUEUE_ITEM_DATA, .seq = seq,
+                            .stream_index = stream_index };
+        enum DemuxAction action = demux_action(tc, packet);
+        PipelineStream *ps = &pipeline->streams[stream_index];
+        int nb_copies = 0;
+
+        if (action == DEMUX_DONE)
+            break;
+        if (action == DEMUX_SKIP)
+        {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        for (int o = 0; o < tc->nb_outputs; o++)
+            nb_copies += !is_transcoded(&tc->output_context[o], stream_index) &&
+                         takes_stream(&tc->output_context[o], stream_index);
+
+        /* the last queue the packet goes to takes it over */
+        if (ps->decoded &&
+            (ret = push_packet(&ps->packet_queue, &ps->packet_pool, packet, seq, !nb_copies)) < 0)
+            goto end;
+
+        for (int o = 0; o < tc->nb_outputs; o++)
+        {
+            OutputContext *output = &tc->output_context[o];
+
+            if (!takes_stream(output, stream_index))
+                continue;
+            if (!is_transcoded(output, stream_index))
+            {
+                AVPacket *copy = take_packet(&ps->packet_pool, packet, !--nb_copies);
+
+                if (!copy)
+                {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                av_packet_rescale_ts(copy, input_time_base,
+                                     output->format_context->streams[stream_index]->time_base);
+                if ((ret = queue_packet(&pipeline_branch(pipeline, output, stream_index)->mux_queue,
+                                        &ps->packet_pool, copy, seq)) < 0)
+                    goto end;
+            }
+            if ((ret = push_item(&pipeline->outputs[o].order_queue, order)) < 0)
+                goto end;
+        }
+
+        av_packet_unref(packet);
+        seq++;
+    }
+
+    for (unsigned int i = 0; i < pipeline->nb_streams; i++)
+    {
+        if (!pipeline->streams[i].decoded)
+            continue;
+        if ((ret = push_marker(&pipeline->streams[i].packet_queue, QUEUE_ITEM_EOF, seq)) < 0)
+            goto end;
+    }
+    for (int o = 0; o < tc->nb_outputs; o++)
+        if ((ret = push_marker(&pipeline->outputs[o].order_queue, QUEUE_ITEM_EOF, seq)) < 0)
+            goto end;
+
+end:
+    if (ret < 0)
+        pipeline_fail(pipeline, ret);
+    av_packet_free(&packet);
+    return NULL;
+}
+
+/* hands item to the filter stage of every output that transcodes the stream */
+static int fan_out(Pipeline *pipeline, unsigned int stream_index,
+        enum QueueItemType type, AVFrame *frame, int64_t seq)
+{
+    TranscodeContext *tc = pipeline->tc;
+    ObjectPool *pool = &pipeline->streams[stream_index].frame_pool;
+    int nb_left = 0, ret;
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+        nb_left += is_transcoded(&tc->output_context[o], stream_index);
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        PipelineBranch *branch = pipeline_branch(pipeline, &tc->output_context[o], stream_index);
+
+        if (!is_transcoded(&tc->output_context[o], stream_index))
+            continue;
+        /* the last output takes the decoder's reference over */
+        if (type == QUEUE_ITEM_DATA)
+            ret = push_frame(&branch->frame_queue, pool, frame, seq, !--nb_left);
+        else
+            ret = push_marker(&branch->frame_queue, type, seq);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static void *decode_thread_main(void *arg)
+{
+    PipelineWorker *worker = arg;
+    Pipeline *pipeline = worker->pipeline;
+    unsigned int stream_index = worker->stream_index;
+    PipelineStream *ps = &pipeline->streams[stream_index];
+    StreamContext *stream = &pipeline->tc->stream_context[stream_index];
+    AVStream *input_stream = pipeline->input_format_context->streams[stream_index];
+    QueueItem item;
+    int ret;
+
+    attach_trace(pipeline->tc, "decode", -1, stream_index);
+
+    while ((ret = thread_queue_pop(&ps->packet_queue, &item)) >= 0)
+    {
+        AVPacket *packet = item.data;
+
+        trace_begin();
+        if (packet)
+        {
+            av_packet_rescale_ts(packet, input_stream->time_base,
+                                 stream->decode_context->time_base);
+            ret = avcodec_send_packet(stream->decode_context, packet);
+            object_pool_put(&ps->packet_pool, packet);
+        }
+        else
+        {
+            /* end of input or of the range: drains the frames held for reordering and by frame threads */
+            ret = avcodec_send_packet(stream->decode_context, NULL);
+        }
+
+        while (ret >= 0)
+        {
+            ret = avcodec_receive_frame(stream->decode_context, stream->decode_frame);
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+                break;
+            else if (ret < 0)
+                goto end;
+
+            stream->decode_frame->pts = stream->decode_frame->best_effort_timestamp;
+            if (!frame_in_range(pipeline->tc, stream_index, stream->decode_frame))
+                continue;
+            account_fan_out(pipeline->tc, stream_index, stream->decode_frame);
+            if ((ret = fan_out(pipeline, stream_index, QUEUE_ITEM_DATA,
+                               stream->decode_frame, item.seq)) < 0)
+                goto end;
+        }
+        trace_end(TRACE_DECODE, stream_index);
+
+        if (item.type == QUEUE_ITEM_EOF)
+        {
+            ret = fan_out(pipeline, stream_index, QUEUE_ITEM_EOF, NULL, item.seq);
+            break;
+        }
+        if ((ret = fan_out(pipeline, stream_index, QUEUE_ITEM_MARKER, NULL, item.seq)) < 0)
+            break;
+    }
+
+end:
+    if (ret < 0)
+        pipeline_fail(pipeline, ret);
+    return NULL;
+}
+
+static int queue_filtered_frame(unsigned int stream_index, AVFrame *frame, void *opaque)
+{
+    PipelineWorker *worker = opaque;
+    PipelineBranch *branch = pipeline_branch(worker->pipeline, worker->output, stream_index);
+
+    return push_frame(&branch->filtered_queue, &worker->pipeline->streams[stream_index].frame_pool,
+                      frame, worker->seq, 1);
+}
+
+static void *filter_thread_main(void *arg)
+{
+    PipelineWorker *worker = arg;
+    Pipeline *pipeline = worker->pipeline;
+    OutputContext *output = worker->output;
+    unsigned int stream_index = worker->stream_index;
+    PipelineBranch *branch = pipeline_branch(pipeline, output, stream_index);
+    QueueItem item;
+    int ret;
+
+    attach_trace(pipeline->tc, "filter", output - pipeline->tc->output_context, stream_index);
+
+    while ((ret = thread_queue_pop(&branch->frame_queue, &item)) >= 0)
+    {
+        AVFrame *frame = item.data;
+
+        worker->seq = item.seq;
+        if (item.type == QUEUE_ITEM_MARKER)
+        {
+            ret = push_marker(&branch->filtered_queue, QUEUE_ITEM_MARKER, item.seq);
+        }
+        else if (item.type == QUEUE_ITEM_EOF)
+        {
+            /* the serial path ignores flush errors as well */
+            filter_frame(pipeline->tc, output, NULL, stream_index, queue_filtered_frame, worker);
+            ret = push_marker(&branch->filtered_queue, QUEUE_ITEM_EOF, item.seq);
+            break;
+        }
+        else
+        {
+            ret = filter_frame(pipeline->tc, output, frame, stream_index, queue_filtered_frame, worker);
+            object_pool_put(&pipeline->streams[stream_index].frame_pool, frame);
+        }
+
+        if (ret < 0)
+            break;
+    }
+
+    if (ret < 0)
+        pipeline_fail(pipeline, ret);
+    return NULL;
+}
+
+static int queue_encoded_packet(unsigned int stream_index, AVPacket *packet, void *opaque)
+{
+    PipelineWorker *worker = opaque;
+    PipelineBranch *branch = pipeline_branch(worker->pipeline, worker->output, stream_index);
+
+    return push_packet(&branch->mux_queue, &worker->pipeline->streams[stream_index].packet_pool,
+                       packet, worker->seq, 1);
+}
+
+static void *encode_thread_main(void *arg)
+{
+    PipelineWorker *worker = arg;
+    Pipeline *pipeline = worker->pipeline;
+    OutputContext *output = worker->output;
+    unsigned int stream_index = worker->stream_index;
+    PipelineBranch *branch = pipeline_branch(pipeline, output, stream_index);
+    QueueItem item;
+    int ret;
+
+    attach_trace(pipeline->tc, "encode", output - pipeline->tc->output_context, stream_index);
+
+    while ((ret = thread_queue_pop(&branch->filtered_queue, &item)) >= 0)
+    {
+        AVFrame *frame = item.data;
+
+        worker->seq = item.seq;
+        if (item.type == QUEUE_ITEM_MARKER)
+        {
+            ret = push_marker(&branch->mux_queue, QUEUE_ITEM_MARKER, item.seq);
+        }
+        else if (item.type == QUEUE_ITEM_EOF)
+        {
+            if (output->encode_context[stream_index]->codec->capabilities &
+                    AV_CODEC_CAP_DELAY)
+                encode_frame(output, stream_index, NULL, queue_encoded_packet, worker);
+            ret = push_marker(&branch->mux_queue, QUEUE_ITEM_EOF, item.seq);
+            break;
+        }
+        else
+        {
+            ret = encode_frame(output, stream_index, frame, queue_encoded_packet, worker);
+            object_pool_put(&pipeline->streams[stream_index].frame_pool, frame);
+        }
+
+        if (ret < 0)
+            break;
+    }
+
+    if (ret < 0)
+        pipeline_fail(pipeline, ret);
+    return NULL;
+}
+
+/* writes everything the stream queued up to its next MARKER (or EOF) */
+static int mux_until_marker(Pipeline *pipeline, OutputContext *output, unsigned int stream_index)
+{
+    PipelineBranch *branch = pipeline_branch(pipeline, output, stream_index);
+    QueueItem item;
+    int ret;
+
+    while ((ret = thread_queue_pop(&branch->mux_queue, &item)) >= 0)
+    {
+        AVPacket *packet = item.data;
+
+        if (item.type != QUEUE_ITEM_DATA)
+            return 0;
+
+        ret = write_output_packet(output, packet);
+        object_pool_put(&pipeline->streams[stream_index].packet_pool, packet);
+        if (ret < 0)
+            return ret;
+
+        /* copied streams carry exactly one packet per demuxed packet */
+        if (!is_transcoded(output, stream_index))
+            return 0;
+    }
+
+    return ret;
+}
+
+static void *mux_thread_main(void *arg)
+{
+    PipelineWorker *worker = arg;
+    Pipeline *pipeline = worker->pipeline;
+    OutputContext *output = worker->output;
+    PipelineOutput *po = &pipeline->outputs[output - pipeline->tc->output_context];
+    QueueItem order;
+    int ret;
+
+    attach_trace(pipeline->tc, "mux", output - pipeline->tc->output_context, -1);
+
+    while ((ret = thread_queue_pop(&po->order_queue, &order)) >= 0)
+    {
+        if (order.type == QUEUE_ITEM_EOF)
+            break;
+        if ((ret = mux_until_marker(pipeline, output, order.stream_index)) < 0)
+            goto end;
+    }
+    if (ret < 0)
+        goto end;
+
+    /* same order as the serial flush loop: stream by stream */
+    for (unsigned int i = 0; i < pipeline->nb_streams; i++)
+    {
+        if (!is_transcoded(output, i))
+            continue;
+        if ((ret = mux_until_marker(pipeline, output, i)) < 0)
+            goto end;
+    }
+
+    ret = write_output_trailer(output);
+
+end:
+    if (ret < 0)
+        pipeline_fail(pipeline, ret);
+    return NULL;
+}
+
+/*
+ * Packet and frame shells allocated against shells handed out; steady state
+ * adds none. Packet data from the demuxer and encoders is not counted, it is
+ * still allocated per packet.
+ */
+static void log_pool_usage(const Pipeline *pipeline)
+{
+    int64_t packets = 0, frames = 0, allocated = 0;
+
+    for (unsigned int i = 0; i < pipeline->nb_streams; i++)
+    {
+        packets += pipeline->streams[i].packet_pool.taken;
+        frames += pipeline->streams[i].frame_pool.taken;
+        allocated += pipeline->streams[i].packet_pool.allocated +
+                     pipeline->streams[i].frame_pool.allocated;
+    }
+    if (packets + frames)
+        log_info("pools: %"PRId64" shell allocations for %"PRId64" packets and %"PRId64" frames queued (%.4f per frame)",
+                allocated, packets, frames, (double)allocated / (frames ? frames : packets));
+}
+
+static int run_pipeline(TranscodeContext *tc)
+{
+    Pipeline pipeline = { 0 };
+    AVFormatContext *input_format_context = tc->input_format_context;
+    unsigned int nb_streams = input_format_context->nb_streams;
+    int ret = 0;
+
+    pipeline.tc = tc;
+    pipeline.input_format_context = input_format_context;
+    pipeline.nb_streams = nb_streams;
+    atomic_init(&pipeline.error, 0);
+
+    pipeline.streams = av_mallocz_array(nb_streams, sizeof(*pipeline.streams));
+    pipeline.branches = av_mallocz_array(tc->nb_outputs * nb_streams, sizeof(*pipeline.branches));
+    pipeline.outputs = av_mallocz_array(tc->nb_outputs, sizeof(*pipeline.outputs));
+    if (!pipeline.streams || !pipeline.branches || !pipeline.outputs)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (unsigned int i = 0; i < nb_streams; i++)
+    {
+        if ((ret = thread_queue_init(&pipeline.streams[i].packet_queue, PIPELINE_PACKET_QUEUE_SIZE)) < 0 ||
+            (ret = object_pool_init(&pipeline.streams[i].packet_pool, OBJECT_POOL_PACKETS)) < 0 ||
+            (ret = object_pool_init(&pipeline.streams[i].frame_pool, OBJECT_POOL_FRAMES)) < 0)
+            goto end;
+        pipeline.streams[i].decoded = is_decoded(tc, i);
+    }
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        if ((ret = thread_queue_init(&pipeline.outputs[o].order_queue, PIPELINE_ORDER_QUEUE_SIZE)) < 0)
+            goto end;
+        for (unsigned int i = 0; i < nb_streams; i++)
+        {
+            PipelineBranch *branch = pipeline_branch(&pipeline, &tc->output_context[o], i);
+
+            if ((ret = thread_queue_init(&branch->frame_queue, PIPELINE_FRAME_QUEUE_SIZE)) < 0 ||
+                (ret = thread_queue_init(&branch->filtered_queue, PIPELINE_FRAME_QUEUE_SIZE)) < 0 ||
+                (ret = thread_queue_init(&branch->mux_queue, PIPELINE_PACKET_QUEUE_SIZE)) < 0)
+                goto end;
+        }
+    }
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        static void *(*const stage_main[2])(void *) = {
+            filter_thread_main, encode_thread_main
+        };
+        PipelineOutput *po = &pipeline.outputs[o];
+
+        for (unsigned int i = 0; i < nb_streams; i++)
+        {
+            PipelineBranch *branch = pipeline_branch(&pipeline, &tc->output_context[o], i);
+
+            if (!is_transcoded(&tc->output_context[o], i))
+                continue;
+
+            for (int stage = 0; stage < 2; stage++)
+            {
+                PipelineWorker *worker = &branch->workers[stage];
+
+                worker->pipeline = &pipeline;
+                worker->output = &tc->output_context[o];
+                worker->stream_index = i;
+                if ((ret = pthread_create(&branch->threads[stage], NULL, stage_main[stage], worker)))
+                {
+                    pipeline_fail(&pipeline, AVERROR(ret));
+                    goto join;
+                }
+                branch->nb_threads++;
+            }
+        }
+
+        po->mux_worker.pipeline = &pipeline;
+        po->mux_worker.output = &tc->output_context[o];
+        if ((ret = pthread_create(&po->mux_thread, NULL, mux_thread_main, &po->mux_worker)))
+        {
+            pipeline_fail(&pipeline, AVERROR(ret));
+            goto join;
+        }
+        po->mux_started = 1;
+    }
+
+    for (unsigned int i = 0; i < nb_streams; i++)
+    {
+        PipelineStream *ps = &pipeline.streams[i];
+
+        if (!ps->decoded)
+            continue;
+
+        ps->decode_worker.pipeline = &pipeline;
+        ps->decode_worker.stream_index = i;
+        if ((ret = pthread_create(&ps->decode_thread, NULL, decode_thread_main, &ps->decode_worker)))
+        {
+            pipeline_fail(&pipeline, AVERROR(ret));
+            goto join;
+        }
+        ps->decode_started = 1;
+    }
+
+    if ((ret = pthread_create(&pipeline.demux_thread, NULL, demux_thread_main, &pipeline)))
+    {
+        pipeline_fail(&pipeline, AVERROR(ret));
+        goto join;
+    }
+    pipeline.demux_started = 1;
+
+join:
+    if (pipeline.demux_started)
+        pthread_join(pipeline.demux_thread, NULL);
+    for (unsigned int i = 0; i < nb_streams; i++)
+        if (pipeline.streams[i].decode_started)
+            pthread_join(pipeline.streams[i].decode_thread, NULL);
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        for (unsigned int i = 0; i < nb_streams; i++)
+        {
+            PipelineBranch *branch = pipeline_branch(&pipeline, &tc->output_context[o], i);
+
+            for (int stage = 0; stage < branch->nb_threads; stage++)
+                pthread_join(branch->threads[stage], NULL);
+        }
+        if (pipeline.outputs[o].mux_started)
+            pthread_join(pipeline.outputs[o].mux_thread, NULL);
+    }
+    ret = atomic_load(&pipeline.error);
+    log_pool_usage(&pipeline);
+
+end:
+    if (pipeline.streams)
+        for (unsigned int i = 0; i < nb_streams; i++)
+            thread_queue_destroy(&pipeline.streams[i].packet_queue, free_queued_packet);
+    if (pipeline.branches)
+    {
+        for (int b = 0; b < tc->nb_outputs * (int)nb_streams; b++)
+        {
+            thread_queue_destroy(&pipeline.branches[b].frame_queue, free_queued_frame);
+            thread_queue_destroy(&pipeline.branches[b].filtered_queue, free_queued_frame);
+            thread_queue_destroy(&pipeline.branches[b].mux_queue, free_queued_packet);
+        }
+    }
+    if (pipeline.outputs)
+        for (int o = 0; o < tc->nb_outputs; o++)
+            thread_queue_destroy(&pipeline.outputs[o].order_queue, NULL);
+    /* after the queues, which hand their leftovers straight to av_*_free */
+    if (pipeline.streams)
+    {
+        for (unsigned int i = 0; i < nb_streams; i++)
+        {
+            object_pool_destroy(&pipeline.streams[i].packet_pool);
+            object_pool_destroy(&pipeline.streams[i].frame_pool);
+        }
+    }
+    av_free(pipeline.streams);
+    av_free(pipeline.branches);
+    av_free(pipeline.outputs);
+    return ret;
+}
+
+/*
+ * Seeks to the keyframe at or before the start of the range: the one the
+ * keyframe index lists for the first video stream when there is an index,
+ * whichever the demuxer finds otherwise.
+ */
+static int seek_to_range(TranscodeContext *tc)
+{
+    AVFormatContext *input_format_context = tc->input_format_context;
+    const KeyframeIndex *index = &tc->job->index;
+    int64_t target = tc->seek_start != AV_NOPTS_VALUE ? tc->seek_start : tc->range_start;
+
+    for (unsigned int i = 0; index->header && i < input_format_context->nb_streams; i++)
+    {
+        AVStream *stream = input_format_context->streams[i];
+        const KeyframeEntry *entry;
+
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+            continue;
+        entry = keyframe_index_find(index, i, av_rescale_q(target, AV_TIME_BASE_Q, stream->time_base));
+        if (entry)
+            return keyframe_index_seek(input_format_context, i, entry);
+        break;
+    }
+    return av_seek_frame(input_format_context, -1, target, AVSEEK_FLAG_BACKWARD);
+}
+
+#define LIVE_INPUT_TIMEOUT_US (5 * AV_TIME_BASE)
+
+static int open_input(TranscodeContext *tc, const char *input_file_name)
+{
+    AVFormatContext *input_format_context = NULL;
+    AVDictionary *options = NULL;
+    int ret;
+
+    if (tc->config->live)
+    {
+        /* a file still being written is read on as it grows, until it stops growing for a while */
+        av_dict_set(&options, "follow", "1", 0);
+        av_dict_set_int(&options, "rw_timeout", LIVE_INPUT_TIMEOUT_US, 0);
+        /* start after a second of probing rather than five */
+        av_dict_set_int(&options, "analyzeduration", AV_TIME_BASE, 0);
+    }
+    else if (tc->config->mmap_input)
+    {
+        AVIOContext *pb;
+
+        if ((ret = mmap_input_open(&tc->mmap_input, input_file_name, &pb)) < 0)
+            log_warning("Cannot map %s (%s), reading it the usual way", input_file_name, av_err2str(ret));
+        else if (!(input_format_context = avformat_alloc_context()))
+        {
+            av_dict_free(&options);
+            return AVERROR(ENOMEM);
+        }
+        else
+            input_format_context->pb = pb;
+    }
+    ret = avformat_open_input(&input_format_context, input_file_name, NULL, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+    {
+        log_error("Cannot opent input file\n");
+        return ret;
+    }
+    tc->input_format_context = input_format_context;
+
+    tc->stream_context = av_mallocz_array(input_format_context->nb_streams, sizeof(*tc->stream_context));
+
+    if (!tc->stream_context)
+    {
+        log_error("Couldnt allocate memory for stream context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    for (int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        AVStream *stream = input_format_context->streams[i];
+        // dump_stream_info(stream);
+        AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+        // dump_codec_info(decoder);
+
+        if (!decoder)
+        {
+            log_error("Failed to find decoder for stream_%d", i);
+            return AVERROR_DECODER_NOT_FOUND;
+        }
+
+        AVCodecContext *codec_context;
+        codec_context = avcodec_alloc_context3(decoder);
+
+        if (!codec_context)
+        {
+            log_error("failed to allocate the decoder context for stream_%d\n", i);
+            return AVERROR(ENOMEM);
+        }
+        tc->stream_context[i].decode_context = codec_context;
+
+        ret = avcodec_parameters_to_context(codec_context, stream->codecpar);
+        if (ret < 0)
+        {
+            log_error("Failed to copy decoder parameters to input decoder context for stream_%d\n", i);
+            return ret;
+        }
+
+        if (codec_context->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            codec_context->framerate = av_guess_frame_rate(input_format_context, stream, NULL);
+        }
+        if (tc->open_decoders &&
+            (codec_context->codec_type == AVMEDIA_TYPE_VIDEO || codec_context->codec_type == AVMEDIA_TYPE_AUDIO))
+        {
+            set_codec_threads(codec_context, tc->decoder_threads, tc->config->codec_thread_type);
+            ret = avcodec_open2(codec_context, decoder, NULL);
+
+            if (ret < 0)
+            {
+                log_error("Failed to opend decoder for strem_%d", i);
+                return ret;
+            }
+        }
+
+        tc->stream_context[i].decode_frame = av_frame_alloc();
+
+        if (!tc->stream_context[i].decode_frame)
+        {
+            log_error("Error on allocating for stream context decode frame\n");
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    // av_dump_format(input_format_context, 0, NULL, 0);
+
+    if (tc->range_start != AV_NOPTS_VALUE &&
+        (ret = seek_to_range(tc)) < 0)
+    {
+        log_error("Failed to seek to %.3f s", tc->range_start / (double)AV_TIME_BASE);
+        return ret;
+    }
+
+    return 0;
+}
+
+/* one output taking the size and bitrate from the job configuration */
+static int init_single_output(TranscodeContext *tc, const char *filename)
+{
+    tc->output_context = av_mallocz(sizeof(*tc->output_context));
+    if (!tc->output_context)
+        return AVERROR(ENOMEM);
+    tc->nb_outputs = 1;
+    tc->output_context[0].filename = av_strdup(filename);
+    if (!tc->output_context[0].filename)
+        return AVERROR(ENOMEM);
+    tc->output_context[0].res_h = tc->config->res_h;
+    tc->output_context[0].res_w = tc->config->res_w;
+    tc->output_context[0].bitrate = tc->config->bitrate;
+    return 0;
+}
+
+/*
+ * --outputs spec: comma separated "file[:height:width:bitrate]", each one
+ * written from the same decode as the main output, -1 or a missing value
+ * keeping the input's. An image file is a thumbnail strip, its size that of
+ * one tile.
+ */
+static int parse_extra_outputs(TranscodeContext *tc, const char *spec)
+{
+    OutputContext *outputs;
+    int count = 1;
+
+    for (const char *c = spec; *c; c++)
+        if (*c == ',')
+            count++;
+
+    outputs = av_realloc_array(tc->output_context, tc->nb_outputs + count, sizeof(*outputs));
+    if (!outputs)
+        return AVERROR(ENOMEM);
+    tc->output_context = outputs;
+    memset(&outputs[tc->nb_outputs], 0, count * sizeof(*outputs));
+
+    for (int i = 0; i < count; i++)
+    {
+        OutputContext *output = &outputs[tc->nb_outputs++];
+        size_t length = strcspn(spec, ",");
+        size_t name_length = strcspn(spec, ":,");
+
+        output->res_h = output->res_w = output->bitrate = -1;
+        if (!name_length ||
+            (spec[name_length] == ':' &&
+             sscanf(spec + name_length, ":%d:%d:%d", &output->res_h, &output->res_w, &output->bitrate) < 1))
+        {
+            log_error("Wrong --outputs entry '%.*s', expected file[:height:width:bitrate]", (int)length, spec);
+            return AVERROR(EINVAL);
+        }
+        if (!(output->filename = av_strndup(spec, name_length)))
+            return AVERROR(ENOMEM);
+        output->strip = thumbnail_format_supported(output->filename);
+        spec += length + (spec[length] == ',');
+    }
+    return 0;
+}
+
+/* the ladder renditions or the single output, then the --outputs ones */
+static int init_outputs(TranscodeContext *tc)
+{
+    const TranscodeConfig *config = tc->config;
+    int ret;
+
+    if (config->ladder)
+        ret = parse_ladder(tc, config->ladder, config->output_filename);
+    else
+        ret = init_single_output(tc, config->output_filename);
+    if (ret >= 0 && config->outputs)
+        ret = parse_extra_outputs(tc, config->outputs);
+    return ret;
+}
+
+static int open_outputs(TranscodeContext *tc)
+{
+    int ret;
+
+    /* the live packager writes its segments bit by bit for partial segments, it cannot wait for a rename */
+    if (tc->config->async_output && !tc->config->live && (ret = async_output_init(&tc->async_output)) < 0)
+        return ret;
+    for (int o = 0; o < tc->nb_outputs; o++)
+    {
+        if ((ret = open_output(tc, &tc->output_context[o])) < 0)
+            return ret;
+        if ((ret = init_output_filters(tc, &tc->output_context[o])) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* packet == NULL drains the decoder */
+static int decode_packet(TranscodeContext *tc, unsigned int stream_index, AVPacket *packet)
+{
+    StreamContext *stream = &tc->stream_context[stream_index];
+    int ret = 0;
+
+    trace_begin();
+    if (packet)
+        av_packet_rescale_ts(packet,
+                             tc->input_format_context->streams[stream_index]->time_base,
+                             stream->decode_context->time_base);
+    /* a packet the decoder rejects is skipped */
+    if (avcodec_send_packet(stream->decode_context, packet) < 0)
+        goto end;
+
+    while (1)
+    {
+        ret = avcodec_receive_frame(stream->decode_context, stream->decode_frame);
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        {
+            ret = 0;
+            break;
+        }
+        else if (ret < 0)
+            break;
+
+        stream->decode_frame->pts = stream->decode_frame->best_effort_timestamp;
+        if (!frame_in_range(tc, stream_index, stream->decode_frame))
+            continue;
+        account_fan_out(tc, stream_index, stream->decode_frame);
+        for (int o = 0; o < tc->nb_outputs; o++)
+        {
+            if (!is_transcoded(&tc->output_context[o], stream_index))
+                continue;
+            ret = filter_encode_write_frame(tc, &tc->output_context[o], stream->decode_frame, stream_index);
+            if (ret < 0)
+                goto end;
+        }
+    }
+
+end:
+    trace_end(TRACE_DECODE, stream_index);
+    return ret;
+}
+
+static int transcode_serial(TranscodeContext *tc)
+{
+    AVFormatContext *input_format_context = tc->input_format_context;
+    AVPacket *packet, *copy;
+    unsigned int stream_index;
+    int ret = 0;
+
+    packet = av_packet_alloc();
+    copy = av_packet_alloc();
+    if (!packet || !copy)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (read_packet(input_format_context, packet) >= 0)
+    {
+        enum DemuxAction action = demux_action(tc, packet);
+
+        if (action == DEMUX_DONE)
+            break;
+        if (action == DEMUX_SKIP)
+        {
+            av_packet_unref(packet);
+            continue;
+        }
+        stream_index = packet->stream_index;
+
+        for (int o = 0; o < tc->nb_outputs; o++)
+        {
+            OutputContext *output = &tc->output_context[o];
+
+            if (is_transcoded(output, stream_index) || !takes_stream(output, stream_index))
+                continue;
+
+            /* the muxer takes the reference over, the shell is reused */
+            if ((ret = av_packet_ref(copy, packet)) < 0)
+                goto end;
+            av_packet_rescale_ts(copy,
+                                 input_format_context->streams[stream_index]->time_base,
+                                 output->format_context->streams[stream_index]->time_base);
+
+            ret = write_output_packet(output, copy);
+            if (ret < 0)
+                goto end;
+        }
+
+        if (is_decoded(tc, stream_index) && (ret = decode_packet(tc, stream_index, packet)) < 0)
+            goto end;
+        av_packet_unref(packet);
+    }
+
+    /* stream by stream, the order the pipeline's mux threads flush in */
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        /* the frames the decoder still holds, held for reordering and by frame threads */
+        if (is_decoded(tc, i) && (ret = decode_packet(tc, i, NULL)) < 0)
+            goto end;
+
+        for (int o = 0; o < tc->nb_outputs; o++)
+        {
+            OutputContext *output = &tc->output_context[o];
+
+            if (!is_transcoded(output, i))
+                continue;
+            filter_encode_write_frame(tc, output, NULL, i);
+            flush_encoder(output, i);
+        }
+    }
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+        if ((ret = write_output_trailer(&tc->output_context[o])) < 0)
+            goto end;
+
+end:
+    av_packet_free(&packet);
+    av_packet_free(&copy);
+    return ret;
+}
+
+/*
+ * finished: the run went through, the outputs need no resume state.
+ * Returns the first error writing the outputs out in the background.
+ */
+static int close_transcode(TranscodeContext *tc, int finished)
+{
+    unsigned int nb_streams = tc->input_format_context ? tc->input_format_context->nb_streams : 0;
+    int ret;
+
+    for (int o = 0; o < tc->nb_outputs; o++)
+        close_output(&tc->output_context[o], nb_streams);
+    ret = async_output_free(&tc->async_output);
+    /* only once the files are all on disk is there nothing left to resume */
+    for (int o = 0; o < tc->nb_outputs; o++)
+        checkpoint_close(&tc->output_context[o].checkpoint, finished && ret >= 0);
+    av_freep(&tc->output_context);
+    tc->nb_outputs = 0;
+
+    if (tc->stream_context) {
+        for (unsigned int i = 0; i < nb_streams; i++) {
+            avcodec_free_context(&tc->stream_context[i].decode_context);
+            av_frame_free(&tc->stream_context[i].decode_frame);
+        }
+    }
+    av_freep(&tc->stream_context);
+    avformat_close_input(&tc->input_format_context);
+    mmap_input_close(&tc->mmap_input);
+    return ret;
+}
+
+/*
+ * Segment-parallel transcode: the video is cut at keyframes into chunks, and
+ * each chunk is decoded, filtered and encoded on its own thread from its own
+ * demuxer into an intermediate NUT file. Every other stream is transcoded in
+ * one piece next to them, so audio frames never straddle a chunk seam. The
+ * pieces are then stitched into the real output without re-encoding.
+ *
+ * A smart cut is planned the same way, with at most three chunks: the
+ * partial GOP before the first keyframe of the range and the one from the
+ * last keyframe on are encoded, every whole GOP in between is copied.
+ */
+typedef struct SegmentPlan
+{
+    int64_t *boundaries;    /* AV_TIME_BASE, half a frame before a keyframe */
+    int nb_boundaries;
+    int64_t half_frame;     /* from a boundary to its keyframe */
+    int has_other_streams;  /* anything besides the video to carry over */
+    int64_t start, end;     /* AV_TIME_BASE range the chunks cover, AV_NOPTS_VALUE = open */
+    int copied_chunk;       /* smart cut: chunk whose video is copied, -1 = none */
+} SegmentPlan;
+
+typedef struct SegmentJob
+{
+    TranscodeJob *transcode_job;
+    char filename[1024];
+    int64_t start, end;
+    int64_t seek;       /* the keyframe after start, AV_NOPTS_VALUE = start */
+    unsigned int media_mask;
+    int nb_threads;     /* per codec and filter graph, when the config leaves it open */
+    int copy;           /* the chunk holds whole GOPs only, its video is copied */
+    int splice;         /* the chunk's video is encoded to splice with a copied one */
+
+    pthread_t thread;
+    int started;
+    int ret;
+} SegmentJob;
+
+/*
+ * The config's start and duration as an input range in AV_TIME_BASE units,
+ * counted from the input's own start time. Returns the length of the range,
+ * AV_NOPTS_VALUE when neither it nor the input's duration is known.
+ */
+static int64_t config_range(const TranscodeConfig *config, const AVFormatContext *input_format_context,
+        int64_t *range_start, int64_t *range_end)
+{
+    int64_t origin = input_format_context->start_time != AV_NOPTS_VALUE ?
+                     input_format_context->start_time : 0;
+    int64_t start = llrint(config->start * AV_TIME_BASE);
+    int64_t length = input_format_context->duration;
+
+    *range_start = *range_end = AV_NOPTS_VALUE;
+    if (config->start > 0)
+    {
+        *range_start = origin + start;
+        if (length != AV_NOPTS_VALUE)
+            length = FFMAX(length - start, 0);
+    }
+    if (config->duration > 0)
+    {
+        int64_t duration = llrint(config->duration * AV_TIME_BASE);
+
+        *range_end = origin + start + duration;
+        if (length == AV_NOPTS_VALUE || duration < length)
+            length = duration;
+    }
+    return length;
+}
+
+/*
+ * Copied GOPs only splice with encoded ones when nothing about the video
+ * changes, and when the codec keeps its parameter sets in the bitstream,
+ * where the encoded chunks repeat their own.
+ */
+static int smart_cut_possible(const TranscodeConfig *config, const AVCodecParameters *par)
+{
+    if (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC)
+    {
+        log_warning("smart cut: only H.264 and HEVC can be spliced, re-encoding the whole range");
+        return 0;
+    }
+    if (config->no_stream_copy || (config->res_w > 0 && config->res_w != par->width) ||
+        (config->res_h > 0 && config->res_h != par->height) ||
+        (config->bitrate > 0 && config->bitrate != par->bit_rate))
+    {
+        log_warning("smart cut: the video changes, re-encoding the whole range");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether frames after the keyframe in decode order are shown before it, as
+ * in an open GOP. Those close the GOP before but need this keyframe to
+ * decode, so they cannot be cut off with that GOP. Reads packet headers from
+ * the keyframe up to the next one; keyframe is in AV_TIME_BASE units.
+ */
+static int has_leading_frames(AVFormatContext *input_format_context, const AVStream *video, int64_t keyframe)
+{
+    AVPacket *packet = av_packet_alloc();
+    int found = 0, leading = 0, ret;
+
+    if (!packet)
+        return AVERROR(ENOMEM);
+    ret = av_seek_frame(input_format_context, video->index,
+                        av_rescale_q(keyframe, AV_TIME_BASE_Q, video->time_base), AVSEEK_FLAG_BACKWARD);
+    while (ret >= 0 && (ret = read_packet(input_format_context, packet)) >= 0)
+    {
+        if (packet->stream_index == video->index && packet->pts != AV_NOPTS_VALUE)
+        {
+            int64_t pts = av_rescale_q(packet->pts, video->time_base, AV_TIME_BASE_Q);
+
+            /* the seek may land on an earlier keyframe */
+            if ((packet->flags & AV_PKT_FLAG_KEY) && (found || pts > keyframe))
+                break;
+            if (packet->flags & AV_PKT_FLAG_KEY)
+                found = pts == keyframe;
+            else if (found && pts < keyframe)
+                leading = 1;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    return ret < 0 && ret != AVERROR_EOF ? ret : leading;
+}
+
+/*
+ * Splits the range at the first keyframe at or after its start and the last
+ * one before its end. Leaves the plan empty when no whole GOP fits, or when
+ * the last keyframe opens a GOP whose leading frames would be left in the
+ * copied chunk without it.
+ */
+static int plan_smart_cut(SegmentPlan *plan, AVFormatContext *input_format_context, const AVStream *video,
+        const int64_t *keyframes, int nb_keyframes, int64_t half_frame)
+{
+    int first = 0, last = nb_keyframes - 1, ret;
+
+    while (first < nb_keyframes && plan->start != AV_NOPTS_VALUE && keyframes[first] < plan->start)
+        first++;
+    while (last >= 0 && plan->end != AV_NOPTS_VALUE && keyframes[last] >= plan->end)
+        last--;
+    if (plan->end != AV_NOPTS_VALUE ? first >= last : first >= nb_keyframes)
+    {
+        log_info("smart cut: no whole GOP in the range, re-encoding all of it");
+        return 0;
+    }
+    if (plan->end != AV_NOPTS_VALUE && (ret = has_leading_frames(input_format_context, video, keyframes[last])))
+    {
+        if (ret == AVERROR(ENOMEM))
+            return ret;
+        log_warning(ret < 0 ? "smart cut: cannot read the GOP at %.3f s, re-encoding all of the range"
+                            : "smart cut: open GOP at %.3f s, re-encoding all of the range",
+                    keyframes[last] / (double)AV_TIME_BASE);
+        return 0;
+    }
+
+    plan->boundaries = av_malloc_array(2, sizeof(*plan->boundaries));
+    if (!plan->boundaries)
+        return AVERROR(ENOMEM);
+    if (plan->start != AV_NOPTS_VALUE && keyframes[first] - half_frame > plan->start)
+        plan->boundaries[plan->nb_boundaries++] = keyframes[first] - half_frame;
+    plan->copied_chunk = plan->nb_boundaries;
+    if (plan->end != AV_NOPTS_VALUE)
+        plan->boundaries[plan->nb_boundaries++] = keyframes[last] - half_frame;
+
+    if (plan->end != AV_NOPTS_VALUE)
+        log_info("smart cut: copying %.3f s to %.3f s, encoding %d partial GOPs",
+                 keyframes[first] / (double)AV_TIME_BASE, keyframes[last] / (double)AV_TIME_BASE,
+                 plan->nb_boundaries);
+    else
+        log_info("smart cut: copying from %.3f s on, encoding %d partial GOPs",
+                 keyframes[first] / (double)AV_TIME_BASE, plan->nb_boundaries);
+    return 0;
+}
+
+/*
+ * Reads the video packet headers once, nothing is decoded, and picks the
+ * keyframe closest after every 1/nb_segments of the duration. Returns no
+ * boundaries when the input cannot be split and should be transcoded whole.
+ * For a smart cut only the keyframes of the range are looked for.
+ */
+static int plan_segments(TranscodeJob *job, SegmentPlan *plan)
+{
+    const TranscodeConfig *config = &job->config;
+    const char *input_filename = config->input_filename;
+    int nb_segments = config->segments;
+    AVFormatContext *input_format_context = NULL;
+    AVPacket *packet = NULL;
+    int64_t *keyframes = NULL;
+    int nb_keyframes = 0, nb_video = 0, video_index = -1;
+    int64_t last_pts = AV_NOPTS_VALUE, half_frame = 0, length;
+    AVRational frame_rate;
+    AVStream *video;
+    int ret;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->start = plan->end = AV_NOPTS_VALUE;
+    plan->copied_chunk = -1;
+
+    if ((ret = avformat_open_input(&input_format_context, input_filename, NULL, NULL)) < 0)
+    {
+        log_error("Cannot opent input file\n");
+        return ret;
+    }
+
+    length = input_format_context->duration;
+    if (config->smart_cut)
+        length = config_range(config, input_format_context, &plan->start, &plan->end);
+    if (length != AV_NOPTS_VALUE)
+        atomic_store(&job->duration_us, length);
+
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++)
+    {
+        AVStream *stream = input_format_context->streams[i];
+
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            nb_video++;
+            video_index = i;
+        }
+        else
+        {
+            plan->has_other_streams = 1;
+        }
+    }
+    if (nb_video != 1)
+    {
+        log_warning("segments: need exactly one video stream, transcoding in one piece");
+        goto end;
+    }
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++)
+        if (i != video_index)
+            input_format_context->streams[i]->discard = AVDISCARD_ALL;
+
+    video = input_format_context->streams[video_index];
+    if (config->smart_cut && !smart_cut_possible(config, video->codecpar))
+        goto end;
+    frame_rate = av_guess_frame_rate(input_format_context, video, NULL);
+    if (frame_rate.num && frame_rate.den)
+        half_frame = av_rescale_q(1, av_inv_q(frame_rate), AV_TIME_BASE_Q) / 2;
+    plan->half_frame = half_frame;
+
+    if (job->index.header && video_index < job->index.header->nb_streams &&
+        job->index.streams[video_index].nb_keyframes > 0)
+    {
+        /* the sidecar already has every keyframe, no need to read the input */
+        const KeyframeIndexStream *indexed = &job->index.streams[video_index];
+        const KeyframeEntry *entries = job->index.entries + indexed->first_entry;
+        AVRational time_base = { indexed->time_base_num, indexed->time_base_den };
+
+        if (!(keyframes = av_malloc_array(indexed->nb_keyframes, sizeof(*keyframes))))
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        for (uint32_t k = 0; k < indexed->nb_keyframes; k++)
+            if (entries[k].pts != AV_NOPTS_VALUE)
+                keyframes[nb_keyframes++] = av_rescale_q(entries[k].pts, time_base, AV_TIME_BASE_Q);
+        if (indexed->last_pts != AV_NOPTS_VALUE)
+            last_pts = av_rescale_q(indexed->last_pts, time_base, AV_TIME_BASE_Q);
+    }
+    else if (!(packet = av_packet_alloc()))
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    else if (plan->start != AV_NOPTS_VALUE &&
+             av_seek_frame(input_format_context, -1, plan->start, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        log_warning("smart cut: seek failed, looking for keyframes from the start");
+    }
+
+    while (packet && !job_cancelled(job) && read_packet(input_format_context, packet) >= 0)
+    {
+        if (packet->stream_index == video_index && packet->pts != AV_NOPTS_VALUE)
+        {
+            int64_t pts = av_rescale_q(packet->pts, video->time_base, AV_TIME_BASE_Q);
+
+            /* anchors are read in display order, nothing after this one is in the range */
+            if (plan->end != AV_NOPTS_VALUE && pts >= plan->end && (packet->flags & AV_PKT_FLAG_KEY))
+                break;
+            if (last_pts == AV_NOPTS_VALUE || pts > last_pts)
+                last_pts = pts;
+            if (packet->flags & AV_PKT_FLAG_KEY)
+            {
+                if (!(nb_keyframes & (nb_keyframes - 1)))
+                {
+                    int64_t *grown = av_realloc_array(keyframes, nb_keyframes ? nb_keyframes * 2 : 1,
+                                                      sizeof(*keyframes));
+                    if (!grown)
+                    {
+                        ret = AVERROR(ENOMEM);
+                        goto end;
+                    }
+                    keyframes = grown;
+                }
+                keyframes[nb_keyframes++] = pts;
+            }
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_unref(packet);
+
+    if (config->smart_cut)
+    {
+        ret = plan_smart_cut(plan, input_format_context, video, keyframes, nb_keyframes, half_frame);
+        goto end;
+    }
+    if (nb_keyframes < 2 || nb_segments < 2)
+    {
+        log_info("segments: %d keyframes, transcoding in one piece", nb_keyframes);
+        goto end;
+    }
+
+    plan->boundaries = av_malloc_array(nb_segments - 1, sizeof(*plan->boundaries));
+    if (!plan->boundaries)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int s = 1, k = 1; s < nb_segments; s++)
+    {
+        int64_t target = keyframes[0] + av_rescale(last_pts - keyframes[0], s, nb_segments);
+
+        while (k < nb_keyframes && keyframes[k] < target)
+            k++;
+        if (k == nb_keyframes)
+            break;
+        plan->boundaries[plan->nb_boundaries++] = keyframes[k++] - half_frame;
+    }
+    log_info("segments: %d keyframes, %d chunks", nb_keyframes, plan->nb_boundaries + 1);
+
+end:
+    av_packet_free(&packet);
+    av_free(keyframes);
+    avformat_close_input(&input_format_context);
+    return ret < 0 ? ret : 0;
+}
+
+static void *segment_thread_main(void *arg)
+{
+    SegmentJob *job = arg;
+    TranscodeContext tc;
+    int ret, close_ret;
+
+    init_transcode_context(&tc, job->transcode_job);
+    tc.range_start = job->start;
+    tc.range_end = job->end;
+    tc.seek_start = job->seek;
+    tc.media_mask = job->media_mask;
+    tc.splice_video = job->splice;
+    /* a chunk's video must come out of its own encoder to start on a keyframe, or hold whole GOPs */
+    if (job->copy)
+        tc.range_on_keyframe = 1;
+    else if (job->media_mask & (1u << AVMEDIA_TYPE_VIDEO))
+        tc.no_stream_copy = 1;
+    else
+        tc.track_progress = 0;  /* the chunks already cover the whole duration */
+
+    /* the chunks already keep every core busy, so they share the cores out */
+    if (!tc.config->decoder_threads || tc.config->thread_budget > 0)
+        tc.decoder_threads = job->nb_threads;
+    if (!tc.config->filter_threads || tc.config->thread_budget > 0)
+        tc.filter_threads = job->nb_threads;
+    if (!tc.config->encoder_threads || tc.config->thread_budget > 0)
+        tc.encoder_threads = job->nb_threads;
+
+    attach_trace(&tc, job->filename, -1, -1);
+    if ((ret = open_input(&tc, tc.config->input_filename)) >= 0 &&
+        (ret = init_single_output(&tc, job->filename)) >= 0 &&
+        (ret = open_outputs(&tc)) >= 0)
+        ret = transcode_serial(&tc);
+    if (ret < 0 && tc.async_output)
+        async_output_cancel(tc.async_output);
+    if ((close_ret = close_transcode(&tc, ret >= 0)) < 0 && ret >= 0)
+        ret = close_ret;
+    if (ret < 0)
+        log_error("%s: %s", job->filename, av_err2str(ret));
+    job->ret = ret;
+    return NULL;
+}
+
+/* the chunked video, part after part */
+typedef struct PartReader
+{
+    const SegmentJob *jobs;
+    int nb_parts;
+    int index;
+    AVFormatContext *part;
+    /* copied H.264/HEVC: parameter sets go in-band, as in the spliced chunks around it */
+    AVBSFContext *annexb;
+} PartReader;
+
+static int open_part(PartReader *reader)
+{
+    const SegmentJob *job = &reader->jobs[reader->index];
+    const AVBitStreamFilter *filter = NULL;
+    int ret;
+
+    if ((ret = avformat_open_input(&reader->part, job->filename, NULL, NULL)) < 0)
+        return ret;
+    if (!job->copy)
+        return 0;
+
+    for (unsigned int i = 0; i < reader->part->nb_streams; i++)
+    {
+        AVStream *stream = reader->part->streams[i];
+
+        if (stream->codecpar->codec_id == AV_CODEC_ID_H264)
+            filter = av_bsf_get_by_name("h264_mp4toannexb");
+        else if (stream->codecpar->codec_id == AV_CODEC_ID_HEVC)
+            filter = av_bsf_get_by_name("hevc_mp4toannexb");
+        else
+            continue;
+
+        if (!filter)
+            return AVERROR_BSF_NOT_FOUND;
+        if ((ret = av_bsf_alloc(filter, &reader->annexb)) < 0 ||
+            (ret = avcodec_parameters_copy(reader->annexb->par_in, stream->codecpar)) < 0)
+            return ret;
+        reader->annexb->time_base_in = stream->time_base;
+        return av_bsf_init(reader->annexb);
+    }
+    return 0;
+}
+
+static void close_part(PartReader *reader)
+{
+    av_bsf_free(&reader->annexb);
+    avformat_close_input(&reader->part);
+}
+
+/* next packet of the chunked video, moving on to the next part at the end of one */
+static int read_segment_packet(PartReader *reader, AVPacket *packet)
+{
+    int ret;
+
+    for (;;)
+    {
+        if (!reader->annexb)
+            ret = read_packet(reader->part, packet);
+        else if ((ret = av_bsf_receive_packet(reader->annexb, packet)) == AVERROR(EAGAIN))
+        {
+            /* the parts hold nothing but the video, every packet goes through */
+            ret = read_packet(reader->part, packet);
+            if (ret >= 0 || ret == AVERROR_EOF)
+                ret = av_bsf_send_packet(reader->annexb, ret >= 0 ? packet : NULL);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        if (ret != AVERROR_EOF)
+            return ret;
+
+        close_part(reader);
+        if (++reader->index == reader->nb_parts)
+            return AVERROR_EOF;
+        if ((ret = open_part(reader)) < 0)
+            return ret;
+    }
+}
+
+static int64_t packet_time(const AVPacket *packet)
+{
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+/*
+ * The reorder delay each part's video starts with, in the time base of the
+ * output stream: how far dts runs behind pts on its first packet, a keyframe.
+ * Each chunk has its own encoder, and a copied chunk keeps the input's delay.
+ */
+static int probe_part_delays(const SegmentJob *jobs, int nb_parts, const AVFormatContext *output,
+        int64_t *delays)
+{
+    AVPacket *packet = av_packet_alloc();
+    int ret = 0;
+
+    if (!packet)
+        return AVERROR(ENOMEM);
+    for (int j = 0; j < nb_parts && ret >= 0; j++)
+    {
+        AVFormatContext *part = NULL;
+
+        delays[j] = 0;
+        if ((ret = avformat_open_input(&part, jobs[j].filename, NULL, NULL)) < 0)
+            break;
+        while ((ret = read_packet(part, packet)) >= 0)
+        {
+            int found = packet->pts != AV_NOPTS_VALUE && packet->dts != AV_NOPTS_VALUE;
+
+            if (found)
+                delays[j] = av_rescale_q(packet->pts - packet->dts,
+                                         part->streams[packet->stream_index]->time_base,
+                                         output->streams[packet->stream_index]->time_base);
+            av_packet_unref(packet);
+            if (found)
+                break;
+        }
+        if (ret == AVERROR_EOF)
+            ret = 0;
+        avformat_close_input(&part);
+    }
+    av_packet_free(&packet);
+    return ret;
+}
+
+/*
+ * Merges the video parts, in order, with the file holding every other
+ * stream. A known origin (AV_TIME_BASE) becomes time 0 of the output.
+ */
+static int stitch_segments(const SegmentJob *jobs, int nb_parts, const char *rest_filename,
+        const char *output_filename, int64_t origin, AsyncOutput *async_output)
+{
+    PartReader reader = { .jobs = jobs, .nb_parts = nb_parts };
+    AVFormatContext *part, *rest = NULL, *output = NULL;
+    AVPacket *part_packet = av_packet_alloc(), *rest_packet = av_packet_alloc();
+    int64_t *delays = NULL, max_delay = 0;
+    int spliced = 0, part_ret, rest_ret = AVERROR_EOF;
+    int ret;
+
+    for (int j = 0; j < nb_parts; j++)
+        spliced |= jobs[j].copy;
+
+    if (!part_packet || !rest_packet)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_part(&reader)) < 0 ||
+        (rest_filename && (ret = avformat_open_input(&rest, rest_filename, NULL, NULL)) < 0))
+    {
+        log_error("Cannot open the transcoded segments\n");
+        goto end;
+    }
+    part = reader.part;
+
+    avformat_alloc_output_context2(&output, NULL, NULL, output_filename);
+    if (!output)
+    {
+        log_error("Couldnt create output context\n");
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+
+    for (unsigned int i = 0; i < part->nb_streams; i++)
+    {
+        AVStream *source = part->streams[i];
+        AVStream *output_stream = avformat_new_stream(output, NULL);
+
+        if (!output_stream)
+        {
+            log_error("Failed allocation output stream\n");
+            ret = AVERROR_UNKNOWN;
+            goto end;
+        }
+        if (rest && source->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+            source = rest->streams[i];
+        if ((ret = avcodec_parameters_copy(output_stream->codecpar, source->codecpar)) < 0)
+            goto end;
+        output_stream->codecpar->codec_tag = 0;
+        output_stream->time_base = source->time_base;
+        /*
+         * the parameter sets change at the seams and come in-band with every
+         * part, the muxer takes them from the first keyframe
+         */
+        if (spliced && source->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            av_freep(&output_stream->codecpar->extradata);
+            output_stream->codecpar->extradata_size = 0;
+        }
+    }
+    if (origin != AV_NOPTS_VALUE)
+        output->output_ts_offset = -origin;
+
+    if (!(delays = av_malloc_array(nb_parts, sizeof(*delays))))
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (async_output)
+        async_output_attach(async_output, output);
+    if (!(output->oformat->flags & AVFMT_NOFILE) &&
+        (ret = async_output ? async_output_open(async_output, &output->pb, output_filename)
+                            : avio_open(&output->pb, output_filename, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+    if ((ret = avformat_write_header(output, NULL)) < 0)
+        goto end;
+
+    /* in the time base the muxer settled on */
+    if ((ret = probe_part_delays(jobs, nb_parts, output, delays)) < 0)
+        goto end;
+    for (int j = 0; j < nb_parts; j++)
+        max_delay = FFMAX(max_delay, delays[j]);
+
+    part_ret = read_segment_packet(&reader, part_packet);
+    if (rest)
+        rest_ret = read_packet(rest, rest_packet);
+
+    while (part_ret >= 0 || rest_ret >= 0)
+    {
+        int from_part;
+        AVFormatContext *input;
+        AVPacket *packet;
+        unsigned int stream_index;
+
+        part = reader.part;
+        from_part = rest_ret < 0 ||
+            (part_ret >= 0 &&
+             av_compare_ts(packet_time(part_packet), part->streams[part_packet->stream_index]->time_base,
+                           packet_time(rest_packet), rest->streams[rest_packet->stream_index]->time_base) <= 0);
+        input = from_part ? part : rest;
+        packet = from_part ? part_packet : rest_packet;
+        stream_index = packet->stream_index;
+
+        av_packet_rescale_ts(packet, input->streams[stream_index]->time_base,
+                             output->streams[stream_index]->time_base);
+
+        /*
+         * Every chunk's dts runs behind its pts by its own reorder delay.
+         * Moving each chunk's dts back to the longest delay makes them all
+         * run the same distance behind, so dts keeps rising across the seams
+         * and never passes pts.
+         */
+        if (from_part && packet->dts != AV_NOPTS_VALUE)
+            packet->dts -= max_delay - delays[reader.index];
+
+        if ((ret = mux_packet(output, packet)) < 0)
+            goto end;
+
+        if (from_part)
+            part_ret = read_segment_packet(&reader, part_packet);
+        else
+            rest_ret = read_packet(rest, rest_packet);
+    }
+    if (part_ret != AVERROR_EOF || rest_ret != AVERROR_EOF)
+    {
+        ret = part_ret != AVERROR_EOF ? part_ret : rest_ret;
+        goto end;
+    }
+
+    ret = av_write_trailer(output);
+
+end:
+    av_packet_free(&part_packet);
+    av_packet_free(&rest_packet);
+    av_free(delays);
+    close_part(&reader);
+    avformat_close_input(&rest);
+    if (ret < 0 && async_output)
+        async_output_cancel(async_output);
+    if (output && !(output->oformat->flags & AVFMT_NOFILE))
+        async_output_close(&output->pb);
+    avformat_free_context(output);
+    return ret;
+}
+
+static int transcode_segments(TranscodeJob *transcode_job, const SegmentPlan *plan)
+{
+    const char *output_filename = transcode_job->config.output_filename;
+    int nb_parts = plan->nb_boundaries + 1;
+    int nb_jobs = nb_parts + plan->has_other_streams;
+    int quota = atomic_load(&transcode_job->core_quota);
+    int nb_cores = transcode_job->config.thread_budget > 0 ? transcode_job->config.thread_budget
+                 : quota > 0 ? quota : av_cpu_count();
+    SegmentJob *jobs;
+    AsyncOutput *async_output = NULL;
+    int64_t started = av_gettime_relative(), encoded;
+    int ret = 0, async_ret;
+
+    jobs = av_mallocz_array(nb_jobs, sizeof(*jobs));
+    if (!jobs)
+        return AVERROR(ENOMEM);
+
+    for (int j = 0; j < nb_jobs; j++)
+    {
+        SegmentJob *job = &jobs[j];
+
+        job->transcode_job = transcode_job;
+        job->nb_threads = FFMAX(1, nb_cores / nb_jobs);
+        if (j < nb_parts)
+        {
+            job->start = j > 0 ? plan->boundaries[j - 1] : plan->start;
+            job->end = j < plan->nb_boundaries ? plan->boundaries[j] : plan->end;
+            /* a seek to the boundary itself would land on the keyframe before and decode its GOP for nothing */
+            job->seek = j > 0 ? job->start + plan->half_frame : AV_NOPTS_VALUE;
+            job->media_mask = 1u << AVMEDIA_TYPE_VIDEO;
+            job->copy = j == plan->copied_chunk;
+            job->splice = plan->copied_chunk >= 0 && !job->copy;
+            snprintf(job->filename, sizeof(job->filename), "%s.part%d.nut", output_filename, j);
+        }
+        else
+        {
+            job->start = plan->start;
+            job->end = plan->end;
+            job->seek = AV_NOPTS_VALUE;
+            job->media_mask = ~(1u << AVMEDIA_TYPE_VIDEO);
+            snprintf(job->filename, sizeof(job->filename), "%s.rest.nut", output_filename);
+        }
+
+        if ((ret = pthread_create(&job->thread, NULL, segment_thread_main, job)))
+        {
+            ret = AVERROR(ret);
+            break;
+        }
+        job->started = 1;
+    }
+
+    for (int j = 0; j < nb_jobs; j++)
+    {
+        if (!jobs[j].started)
+            continue;
+        pthread_join(jobs[j].thread, NULL);
+        if (jobs[j].ret < 0 && !ret)
+            ret = jobs[j].ret;
+    }
+    encoded = av_gettime_relative();
+
+    if (!ret && job_cancelled(transcode_job))
+        ret = AVERROR_EXIT;
+    if (!ret && transcode_job->config.async_output)
+        ret = async_output_init(&async_output);
+    if (!ret)
+        ret = stitch_segments(jobs, nb_parts, plan->has_other_streams ? jobs[nb_parts].filename : NULL,
+                              output_filename, plan->copied_chunk >= 0 ? plan->start : AV_NOPTS_VALUE,
+                              async_output);
+    if ((async_ret = async_output_free(&async_output)) < 0 && !ret)
+        ret = async_ret;
+    if (!ret)
+        log_info("segments: %d chunks encoded in %"PRId64" ms, stitched in %"PRId64" ms", nb_parts,
+                (encoded - started) / 1000, (av_gettime_relative() - encoded) / 1000);
+
+    for (int j = 0; j < nb_jobs; j++)
+        if (jobs[j].started)
+            unlink(jobs[j].filename);
+    av_free(jobs);
+    return ret;
+}
+
+/* for when no output decodes the video the thumbnail would come from */
+static void seek_thumbnail(TranscodeJob *job)
+{
+    const TranscodeConfig *config = &job->config;
+    char thumbnail_filename[64];
+    ThumbnailRequest request = {
+        .input_filename = config->input_filename,
+        .output_filename = thumbnail_filename,
+        .frame_number = config->thumbnail_frame,
+        .timestamp = -1,
+        .index = job->index.header ? &job->index : NULL,
+    };
+
+    snprintf(thumbnail_filename, sizeof(thumbnail_filename), "thumbnail_frame_%d.%s",
+             config->thumbnail_frame, config->thumbnail_format);
+    if (extract_thumbnail(&request) < 0)
+        log_error("Failed to write thumbnail %s", thumbnail_filename);
+}
+
+
+void transcode_config_default(TranscodeConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->res_h = -1;
+    config->res_w = -1;
+    config->bitrate = -1;
+    config->thumbnail_format = "png";
+    config->scaler = "bicubic";
+    config->live_part_time = 0.334;
+}
+
+int transcode_scaler_supported(const char *name)
+{
+    for (int n = 0; scaler_names[n]; n++)
+        if (!strcmp(name, scaler_names[n]))
+            return 1;
+    return 0;
+}
+
+TranscodeJob *transcode_job_create(void)
+{
+    TranscodeJob *job = av_mallocz(sizeof(*job));
+
+    if (!job)
+        return NULL;
+    atomic_init(&job->cancel_requests, 0);
+    atomic_init(&job->cancels_seen, 0);
+    atomic_init(&job->progress_us, 0);
+    atomic_init(&job->duration_us, 0);
+    return job;
+}
+
+static void free_config_strings(TranscodeConfig *config)
+{
+    av_freep(&config->input_filename);
+    av_freep(&config->output_filename);
+    av_freep(&config->thumbnail_format);
+    av_freep(&config->ladder);
+    av_freep(&config->outputs);
+    av_freep(&config->scaler);
+    av_freep(&config->trace_filename);
+}
+
+static int copy_config_string(const char **dst, const char *src)
+{
+    if (!src)
+        return 0;
+    *dst = av_strdup(src);
+    return *dst ? 0 : AVERROR(ENOMEM);
+}
+
+int transcode_job_configure(TranscodeJob *job, const TranscodeConfig *config)
+{
+    TranscodeConfig copy = *config;
+    int ret;
+
+    if (!config->input_filename || !config->output_filename)
+    {
+        log_error("A job needs an input and an output file");
+        return AVERROR(EINVAL);
+    }
+    if (config->thumbnail_frame < 0)
+    {
+        log_error("Wrong parameter passed.3rd parameter must be an integer\n");
+        return AVERROR(EINVAL);
+    }
+    if (config->thumbnail_frame > 0)
+    {
+        char probe[16];
+
+        snprintf(probe, sizeof(probe), "x.%s", config->thumbnail_format);
+        if (!thumbnail_format_supported(probe))
+        {
+            log_error("Unsupported thumbnail format %s", config->thumbnail_format);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (!transcode_scaler_supported(config->scaler))
+    {
+        log_error("Unknown scaler %s", config->scaler);
+        return AVERROR(EINVAL);
+    }
+    if (config->segments > 0 && config->ladder)
+    {
+        log_error("--segments cannot be combined with --ladder");
+        return AVERROR(EINVAL);
+    }
+    if (config->outputs && (config->segments > 0 || config->smart_cut))
+    {
+        log_error("--outputs cannot be combined with --segments or --smart-cut");
+        return AVERROR(EINVAL);
+    }
+    if (config->start < 0 || config->duration < 0)
+    {
+        log_error("--start and --duration cannot be negative");
+        return AVERROR(EINVAL);
+    }
+    if (config->segments > 0 && (config->start > 0 || config->duration > 0))
+    {
+        log_error("--segments cannot be combined with --start or --duration");
+        return AVERROR(EINVAL);
+    }
+    if (config->live && (config->segments > 0 || config->smart_cut ||
+                         !av_match_ext(config->output_filename, "m3u8")))
+    {
+        log_error("--live writes an .m3u8 output, and not with --segments or --smart-cut");
+        return AVERROR(EINVAL);
+    }
+    if (config->resume && (config->ladder || config->outputs || config->segments > 0 || config->smart_cut ||
+                           config->live || config->serve_port || config->start > 0 || config->duration > 0 ||
+                           !av_match_ext(config->output_filename, "m3u8")))
+    {
+        log_error("--resume needs an .m3u8 output, and not with --ladder, --outputs, --segments, --smart-cut, "
+                  "--live, --serve, --start or --duration");
+        return AVERROR(EINVAL);
+    }
+    if (config->serve_port && (config->serve_port < 0 || config->serve_port > 65535 || config->live ||
+                               config->segments > 0 || config->smart_cut || config->async_output ||
+                               !av_match_ext(config->output_filename, "m3u8")))
+    {
+        log_error("--serve needs a port and an .m3u8 output, and not with --live, --segments, --smart-cut "
+                  "or --async-output");
+        return AVERROR(EINVAL);
+    }
+    if (config->cmaf && (config->ladder || config->segments > 0 || config->cmaf_segment_time < 0 ||
+                         !av_match_ext(config->output_filename, "mpd")))
+    {
+        log_error("--cmaf writes an .mpd output, and not with --ladder or --segments");
+        return AVERROR(EINVAL);
+    }
+    if (config->live_segment_time < 0 || config->live_part_time < 0 || config->live_window < 0 ||
+        (config->live_part_time > 0 && config->live_segment_time > 0 &&
+         config->live_part_time > config->live_segment_time))
+    {
+        log_error("Live segment and part times must be 0 or more, parts no longer than segments");
+        return AVERROR(EINVAL);
+    }
+    if (config->smart_cut && (config->segments > 0 || config->ladder ||
+                              (config->start <= 0 && config->duration <= 0)))
+    {
+        log_error("--smart-cut needs --start or --duration, and no --segments or --ladder");
+        return AVERROR(EINVAL);
+    }
+    if (config->filter_threads < 0 || config->decoder_threads < 0 || config->encoder_threads < 0 ||
+        config->thread_budget < 0 || (config->codec_thread_type & ~(FF_THREAD_FRAME | FF_THREAD_SLICE)))
+    {
+        log_error("Thread counts must be 0 or more, the thread type frame and/or slice");
+        return AVERROR(EINVAL);
+    }
+
+    copy.input_filename = copy.output_filename = copy.thumbnail_format = NULL;
+    copy.ladder = copy.outputs = copy.scaler = copy.trace_filename = NULL;
+    if ((ret = copy_config_string(&copy.input_filename, config->input_filename)) < 0 ||
+        (ret = copy_config_string(&copy.output_filename, config->output_filename)) < 0 ||
+        (ret = copy_config_string(&copy.thumbnail_format, config->thumbnail_format)) < 0 ||
+        (ret = copy_config_string(&copy.ladder, config->ladder)) < 0 ||
+        (ret = copy_config_string(&copy.outputs, config->outputs)) < 0 ||
+        (ret = copy_config_string(&copy.scaler, config->scaler)) < 0 ||
+        (ret = copy_config_string(&copy.trace_filename, config->trace_filename)) < 0)
+    {
+        free_config_strings(&copy);
+        return ret;
+    }
+
+    free_config_strings(&job->config);
+    job->config = copy;
+    return 0;
+}
+
+#define THREAD_TRIAL_US (2 * AV_TIME_BASE)
+
+/* what a checkpoint of the output has to match: everything that changes the encoded output */
+static void checkpoint_settings(const TranscodeConfig *config, const OutputContext *output,
+        char *settings, size_t size)
+{
+    snprintf(settings, size, "height=%d,width=%d,bitrate=%d,scaler=%s,copy=%d",
+             output->res_h, output->res_w, output->bitrate, config->scaler, !config->no_stream_copy);
+}
+
+/*
+ * Transcodes the first seconds of the run, from its start time or its resume
+ * point, into the null muxer with every stage on one thread, timing decode,
+ * filter and encode, then hands out the core budget one thread at a time to
+ * the stage that is slowest per thread.
+ * That evens out the stages of the pipeline, which runs as fast as its
+ * slowest one. The filter and encoder shares are split between the outputs.
+ */
+static int plan_threads(TranscodeJob *job, TranscodeContext *transcode)
+{
+    const TranscodeConfig *config = &job->config;
+    static const enum TraceStage stages[3] = { TRACE_DECODE, TRACE_FILTER, TRACE_ENCODE };
+    TraceThread *outer_trace = trace_current_thread;
+    TranscodeContext trial;
+    Tracer tracer;
+    int64_t totals[TRACE_NB_STAGES];
+    int64_t start, end;
+    char settings[256];
+    int threads[3] = { 1, 1, 1 };
+    int ret;
+
+    if ((ret = tracer_init(&tracer)) < 0)
+        return ret;
+
+    init_transcode_context(&trial, job);
+    trial.track_progress = 0;
+    /* a copied stream costs nothing here, and then its threads do not matter either */
+    trial.no_stream_copy = 1;
+    trial.decoder_threads = trial.filter_threads = trial.encoder_threads = 1;
+
+    tracer_attach_thread(&tracer, "threads");
+    if ((ret = open_input(&trial, config->input_filename)) < 0)
+        goto end;
+    if ((ret = init_outputs(&trial)) < 0)
+        goto end;
+
+    /* the part the run transcodes, which may cost more or less than the beginning */
+    config_range(config, trial.input_format_context, &trial.range_start, &end);
+    if (config->resume)
+    {
+        checkpoint_settings(config, &trial.output_context[0], settings, sizeof(settings));
+        start = checkpoint_resume_time(config->input_filename, trial.output_context[0].filename, settings);
+        if (start != AV_NOPTS_VALUE)
+            trial.range_start = start;
+    }
+    start = trial.range_start != AV_NOPTS_VALUE ? trial.range_start
+          : trial.input_format_context->start_time != AV_NOPTS_VALUE ? trial.input_format_context->start_time : 0;
+    trial.range_end = end != AV_NOPTS_VALUE ? FFMIN(end, start + THREAD_TRIAL_US) : start + THREAD_TRIAL_US;
+    if (trial.range_start != AV_NOPTS_VALUE && (ret = seek_to_range(&trial)) < 0)
+        goto end;
+
+    for (int o = 0; o < trial.nb_outputs; o++)
+        trial.output_context[o].format_name = "null";
+    if ((ret = open_outputs(&trial)) < 0 || (ret = transcode_serial(&trial)) < 0)
+        goto end;
+
+    tracer_stage_totals(&tracer, totals);
+    for (int left = config->thread_budget - 3; left > 0; left--)
+    {
+        int slowest = 0;
+
+        for (int s = 1; s < 3; s++)
+            if (totals[stages[s]] * threads[slowest] > totals[stages[slowest]] * threads[s])
+                slowest = s;
+        threads[slowest]++;
+    }
+
+    transcode->decoder_threads = threads[0];
+    transcode->filter_threads = FFMAX(1, threads[1] / trial.nb_outputs);
+    transcode->encoder_threads = FFMAX(1, threads[2] / trial.nb_outputs);
+    log_info("threads: decode %d, filter %d, encode %d of %d cores "
+             "(trial took %.1f / %.1f / %.1f ms)", transcode->decoder_threads,
+             transcode->filter_threads, transcode->encoder_threads, config->thread_budget,
+             totals[TRACE_DECODE] / 1000.0, totals[TRACE_FILTER] / 1000.0,
+             totals[TRACE_ENCODE] / 1000.0);
+
+end:
+    if (ret < 0)
+        log_warning("thread planning failed (%s), keeping the configured threads", av_err2str(ret));
+    close_transcode(&trial, 0);
+    tracer_detach_thread();
+    trace_current_thread = outer_trace;
+    tracer_free(&tracer);
+    return ret;
+}
+
+/*
+ * Narrows the run to config start/duration, counted from the input's own
+ * start time, and puts the demuxer on the keyframe before the start. Frames
+ * before the start are dropped after decoding, reading stops past the end.
+ */
+static int apply_time_range(TranscodeContext *tc)
+{
+    int64_t length = config_range(tc->config, tc->input_format_context, &tc->range_start, &tc->range_end);
+    int ret;
+
+    if (length != AV_NOPTS_VALUE)
+        atomic_store(&tc->job->duration_us, length);
+    if (tc->range_start == AV_NOPTS_VALUE)
+        return 0;
+
+    tc->rebase_output = 1;
+    if ((ret = seek_to_range(tc)) < 0)
+    {
+        log_error("Failed to seek to %.3f s", tc->config->start);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * With --resume the playlist output is checkpointed at every segment. When
+ * an earlier run of the same input and settings left a checkpoint, the
+ * playlist is cut back to its complete segments and this run picks up at the
+ * keyframe the next segment starts at. Timestamps are kept, not rebased, so
+ * the appended segments carry on from the ones already written.
+ */
+static int resume_output(TranscodeContext *tc)
+{
+    const TranscodeConfig *config = tc->config;
+    OutputContext *output = &tc->output_context[0];
+    char settings[256];
+    int64_t resume_time, origin;
+    int ret;
+
+    checkpoint_settings(config, output, settings, sizeof(settings));
+    if ((ret = checkpoint_open(&output->checkpoint, config->input_filename, output->filename,
+                               settings, &resume_time)) < 0 || resume_time == AV_NOPTS_VALUE)
+        return ret;
+
+    tc->range_start = resume_time;
+    tc->range_on_keyframe = 1;
+    tc->resume = 1;
+    origin = tc->input_format_context->start_time != AV_NOPTS_VALUE ? tc->input_format_context->start_time : 0;
+    atomic_store(&tc->job->progress_us, FFMAX(resume_time - origin, 0));
+    if ((ret = seek_to_range(tc)) < 0)
+        log_error("Failed to seek to %.3f s to resume", resume_time / (double)AV_TIME_BASE);
+    return ret;
+}
+
+static int run_job(TranscodeJob *job)
+{
+    const TranscodeConfig *config = &job->config;
+    TranscodeContext transcode;
+    ThumbnailWriter thumbnail_writer = { 0 };
+    int ret, close_ret;
+
+    atomic_store(&job->progress_us, 0);
+    atomic_store(&job->duration_us, 0);
+
+    if (config->segments > 0 || config->smart_cut)
+    {
+        SegmentPlan plan;
+        int planned;
+
+        if ((ret = plan_segments(job, &plan)) < 0)
+            return ret;
+        planned = plan.nb_boundaries > 0 || plan.copied_chunk >= 0;
+        if (job_cancelled(job))
+            ret = AVERROR_EXIT;
+        else if (planned)
+        {
+            if (config->thumbnail_frame > 0)
+                seek_thumbnail(job);
+            ret = transcode_segments(job, &plan);
+        }
+        av_free(plan.boundaries);
+        if (ret || planned)
+            return ret;
+    }
+
+    init_transcode_context(&transcode, job);
+    if (config->thread_budget > 0)
+        plan_threads(job, &transcode);
+    if (config->thumbnail_frame > 0)
+    {
+        /* thumbnails are written at the size the first output is encoded at */
+        if ((ret = thumbnail_writer_init(&thumbnail_writer, 2, -1, -1)) < 0)
+            return ret;
+        transcode.thumbnail_writer = &thumbnail_writer;
+    }
+
+    if ((ret = open_input(&transcode, config->input_filename)) < 0)
+        goto end;
+    if (transcode.input_format_context->duration != AV_NOPTS_VALUE)
+        atomic_store(&job->duration_us, transcode.input_format_context->duration);
+    if ((ret = apply_time_range(&transcode)) < 0)
+        goto end;
+
+    if ((ret = init_outputs(&transcode)) < 0)
+        goto end;
+    if (config->resume && (ret = resume_output(&transcode)) < 0)
+        goto end;
+    /* the frames are counted from the resume point, the thumbnail's is looked up on its own */
+    if (transcode.resume)
+        transcode.thumbnail_writer = NULL;
+    if ((ret = open_outputs(&transcode)) < 0)
+        goto end;
+
+    if (config->ladder && (ret = write_master_playlist(&transcode, config->output_filename)) < 0)
+        goto end;
+
+    /*
+     * The thumbnail normally comes out of the first output's video filter.
+     * When that stream is copied nothing is decoded, so seek for it instead.
+     */
+    if (config->thumbnail_frame > 0 && transcode.input_format_context->nb_streams > 0 &&
+        (transcode.resume || !is_transcoded(&transcode.output_context[0], 0)) &&
+        transcode.input_format_context->streams[0]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        seek_thumbnail(job);
+
+    if (config->serial)
+        ret = transcode_serial(&transcode);
+    else
+        ret = run_pipeline(&transcode);
+    if (ret >= 0)
+        log_fan_out(&transcode);
+
+    if (!ret && job_cancelled(job))
+        ret = AVERROR_EXIT;
+
+end:
+    if (thumbnail_writer_close(&thumbnail_writer) < 0 && !ret)
+        ret = AVERROR(EIO);
+    /* a broken run publishes nothing more */
+    if (ret < 0 && transcode.async_output)
+        async_output_cancel(transcode.async_output);
+    if ((close_ret = close_transcode(&transcode, !ret)) < 0 && !ret)
+        ret = close_ret;
+    return ret;
+}
+
+/*
+ * Pixels per second one core decodes or encodes, 8-bit H.264 at the
+ * encoder's default preset, and what the other codecs cost relative to it.
+ */
+#define DECODE_PIXELS_PER_CORE 250e6
+#define ENCODE_PIXELS_PER_CORE 25e6
+/* demuxing and muxing, and every audio stream */
+#define CONTAINER_LOAD 0.1
+#define AUDIO_LOAD 0.05
+
+static double codec_cost(enum AVCodecID codec_id)
+{
+    switch (codec_id)
+    {
+    case AV_CODEC_ID_H264:
+        return 1;
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_VP9:
+        return 2.5;
+    case AV_CODEC_ID_AV1:
+        return 4;
+    default:
+        return 0.5;     /* MPEG-2, MPEG-4 part 2 and other older codecs */
+    }
+}
+
+int transcode_job_estimate(TranscodeJob *job, TranscodeEstimate *estimate)
+{
+    const TranscodeConfig *config = &job->config;
+    TranscodeContext probe;
+    AVFormatContext *input;
+    double decode = 0, encode = 0;
+    int ret;
+
+    memset(estimate, 0, sizeof(*estimate));
+    init_transcode_context(&probe, job);
+    probe.track_progress = 0;
+    probe.open_decoders = 0;
+    if ((ret = open_input(&probe, config->input_filename)) < 0)
+        goto end;
+    if ((ret = init_outputs(&probe)) < 0)
+        goto end;
+    input = probe.input_format_context;
+
+    if (input->duration > 0)
+        estimate->duration = FFMAX(input->duration / (double)AV_TIME_BASE - config->start, 0);
+    if (config->duration > 0)
+        estimate->duration = estimate->duration > 0 ? FFMIN(estimate->duration, config->duration)
+                                                    : config->duration;
+    /* only copy decisions depend on the range here, open_input has not seeked */
+    if (config->start > 0)
+    {
+        probe.range_start = llrint(config->start * AV_TIME_BASE);
+        probe.range_on_keyframe = config->smart_cut;
+    }
+
+    estimate->load = CONTAINER_LOAD;
+    for (unsigned int i = 0; i < input->nb_streams; i++)
+    {
+        AVStream *stream = input->streams[i];
+        AVCodecContext *decode_context = probe.stream_context[i].decode_context;
+        int decoded = 0;
+
+        if (decode_context->codec_type == AVMEDIA_TYPE_AUDIO)
+            estimate->load += AUDIO_LOAD;
+        if (decode_context->codec_type != AVMEDIA_TYPE_VIDEO ||
+            (stream->disposition & AV_DISPOSITION_ATTACHED_PIC))
+            continue;
+
+        double frame_rate = decode_context->framerate.num && decode_context->framerate.den
+                          ? av_q2d(decode_context->framerate) : 25;
+        if (!estimate->width)
+        {
+            estimate->width = decode_context->width;
+            estimate->height = decode_context->height;
+            estimate->frame_rate = frame_rate;
+            estimate->codec_name = avcodec_get_name(decode_context->codec_id);
+        }
+
+        for (int o = 0; o < probe.nb_outputs; o++)
+        {
+            OutputContext *output = &probe.output_context[o];
+            const AVOutputFormat *oformat = av_guess_format(output->format_name, output->filename, NULL);
+            int width, height;
+
+            if (oformat && can_stream_copy(&probe, output, oformat, stream, decode_context))
+                continue;
+            decoded = 1;
+            /* a strip encodes a handful of frames */
+            if (output->strip)
+                continue;
+            output_video_size(output, decode_context, &width, &height);
+            /* open_output encodes with the input's own codec, whatever the container's default */
+            encode += (double)width * height * frame_rate / ENCODE_PIXELS_PER_CORE *
+                      codec_cost(decode_context->codec_id);
+        }
+        if (decoded)
+            decode += (double)decode_context->width * decode_context->height * frame_rate /
+                      DECODE_PIXELS_PER_CORE * codec_cost(decode_context->codec_id);
+    }
+    estimate->load += decode + encode;
+    estimate->work = estimate->load * estimate->duration;
+
+end:
+    close_transcode(&probe, 0);
+    return ret;
+}
+
+void transcode_job_set_core_quota(TranscodeJob *job, int cores)
+{
+    atomic_store(&job->core_quota, FFMAX(cores, 0));
+}
+
+int transcode_job_run(TranscodeJob *job)
+{
+    Tracer tracer;
+    int ret;
+
+    if (!job->config.input_filename)
+    {
+        log_error("The job has not been configured");
+        return AVERROR(EINVAL);
+    }
+    if (job->config.serve_port > 0 && !job->origin &&
+        (ret = hls_origin_start(&job->origin, job->config.serve_port)) < 0)
+        return ret;
+
+    /* tracing is only a measurement, a run goes on without it */
+    if (job->config.trace_filename && (ret = tracer_init(&tracer)) < 0)
+        log_warning("Cannot trace this run (%s), running without it", av_err2str(ret));
+    else if (job->config.trace_filename)
+    {
+        job->tracer = &tracer;
+        tracer_attach_thread(&tracer, "main");
+    }
+
+    if (job->config.keyframe_index &&
+        keyframe_index_open(&job->index, job->config.input_filename) < 0)
+        log_warning("running without a keyframe index");
+
+    ret = run_job(job);
+
+    keyframe_index_close(&job->index);
+    if (job->tracer)
+    {
+        tracer_detach_thread();
+        tracer_log_summary(&tracer);
+        /* a lost trace does not fail the transcode */
+        tracer_write_json(&tracer, job->config.trace_filename);
+        tracer_free(&tracer);
+        job->tracer = NULL;
+    }
+    /* a cancel stops one run; one that came in too late for this run stops the next */
+    job->cancels_handled = atomic_load(&job->cancels_seen);
+    return ret;
+}
+
+double transcode_job_progress(TranscodeJob *job)
+{
+    int64_t duration = atomic_load(&job->duration_us);
+    int64_t progress = atomic_load(&job->progress_us);
+
+    if (duration <= 0)
+        return -1;
+    return progress >= duration ? 1.0 : (double)progress / duration;
+}
+
+void transcode_job_cancel(TranscodeJob *job)
+{
+    atomic_fetch_add(&job->cancel_requests, 1);
+}
+
+void transcode_job_destroy(TranscodeJob **job)
+{
+    if (!*job)
+        return;
+    hls_origin_stop(&(*job)->origin);
+    free_config_strings(&(*job)->config);
+    av_freep(job);
+}
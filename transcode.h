@@ -0,0 +1,104 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <stdint.h>
+
+/*
+ * Everything a transcode needs to know, the library keeps no state of its
+ * own. -1 keeps the input's value for the sizes and the bitrate, exactly like
+ * the positional command line arguments.
+ */
+typedef struct TranscodeConfig
+{
+    const char *input_filename;
+    const char *output_filename;    /* with a ladder, the master playlist */
+
+    int res_h, res_w;
+    int bitrate;
+
+    int thumbnail_frame;            /* 1-based, 0 = no thumbnail */
+    const char *thumbnail_format;   /* png, jpg or webp */
+
+    const char *ladder;             /* "h:w:bitrate,..." or NULL */
+    const char *outputs;            /* more outputs of the same decode, "file[:h:w:bitrate],..."
+                                       (an image file is a thumbnail strip), or NULL */
+    const char *scaler;             /* swscale algorithm name */
+    int filter_threads;             /* 0 = one per core */
+    int decoder_threads;            /* per video decoder, 0 = one per core */
+    int encoder_threads;            /* per video encoder, 0 = one per core */
+    int codec_thread_type;          /* FF_THREAD_FRAME and/or FF_THREAD_SLICE, 0 = both */
+    int thread_budget;              /* > 0: split this many cores between decoder, filters and
+                                       encoders from a timed trial run, overriding the three
+                                       thread counts above */
+    double start;                   /* seconds into the input to start at, 0 = the beginning */
+    double duration;                /* seconds to transcode from start, 0 = up to the end */
+    int smart_cut;                  /* copy the whole GOPs of the range, encode only the partial
+                                       ones at its ends (H.264 and HEVC) */
+    int live;                       /* .m3u8 outputs as a sliding-window LL-HLS stream of a growing input */
+    double live_segment_time;       /* seconds, 0 = 2 */
+    double live_part_time;          /* LL-HLS partial segments in seconds, 0 = none */
+    int live_window;                /* segments in the live playlist, 0 = 6 */
+    int cmaf;                       /* .mpd output: CMAF segments shared by the MPD and an HLS playlist */
+    double cmaf_segment_time;       /* seconds, 0 = 4 */
+    int no_stream_copy;
+    int serial;                     /* single threaded reference path */
+    int segments;                   /* keyframe-aligned parallel chunks, 0 = off */
+    int mmap_input;                 /* read local inputs through an mmap with read-ahead */
+    int async_output;               /* write outputs from an I/O thread, each file renamed into place once complete */
+    int serve_port;                 /* > 0: keep the HLS output in memory and serve it over HTTP on
+                                       127.0.0.1 at this port, up to transcode_job_destroy */
+    int resume;                     /* checkpoint the .m3u8 output at every segment in "<output>.resume",
+                                       and continue from the checkpoint an interrupted run left */
+    int keyframe_index;             /* seek and plan chunks with the "<input>.kfi" sidecar, built on first use */
+    const char *trace_filename;     /* per-stage timings as Chrome trace JSON, NULL = off */
+} TranscodeConfig;
+
+/* a job runs one transcode at a time, separate jobs share nothing */
+typedef struct TranscodeJob TranscodeJob;
+
+/*
+ * Rough cost of a job from its input headers and config, for schedulers
+ * running several jobs side by side. The rates behind it are those of one
+ * current x86 core, so compare jobs with it rather than predict times.
+ */
+typedef struct TranscodeEstimate
+{
+    int width, height;              /* first video stream of the input, 0 without one */
+    double frame_rate;
+    const char *codec_name;         /* of that stream, static */
+    double duration;                /* seconds to transcode, 0 if unknown */
+    double load;                    /* cores busy to keep up with real time */
+    double work;                    /* load * duration, core-seconds */
+} TranscodeEstimate;
+
+void transcode_config_default(TranscodeConfig *config);
+int transcode_scaler_supported(const char *name);
+
+TranscodeJob *transcode_job_create(void);
+/* copies config, strings included; fails with AVERROR(EINVAL) on bad values */
+int transcode_job_configure(TranscodeJob *job, const TranscodeConfig *config);
+/*
+ * Runs the configured transcode on the calling thread and returns once the
+ * output is complete. A job can be run again, with or without reconfiguring.
+ * Returns AVERROR_EXIT when it was cancelled.
+ */
+int transcode_job_run(TranscodeJob *job);
+/* reads the input headers, nothing is decoded */
+int transcode_job_estimate(TranscodeJob *job, TranscodeEstimate *estimate);
+/*
+ * Cores the next runs may use: the thread counts the config leaves at 0 and
+ * the --segments split count these instead of every core. 0 lifts the quota.
+ * Any thread, takes effect when a run starts.
+ */
+void transcode_job_set_core_quota(TranscodeJob *job, int cores);
+/* fraction of the input done, in [0, 1], or -1 while the duration is unknown; any thread */
+double transcode_job_progress(TranscodeJob *job);
+/*
+ * Stops the current run, or the next one if none is running: reading the
+ * input stops, what is already decoded is written out and run returns. Safe
+ * from any thread.
+ */
+void transcode_job_cancel(TranscodeJob *job);
+void transcode_job_destroy(TranscodeJob **job);
+
+#endif
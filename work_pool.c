@@ -0,0 +1,201 @@
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <string.h>
+#include "work_pool.h"
+
+#define WORK_DEQUE_INITIAL_SIZE 16
+
+/* lets a worker submit onto its own deque */
+static _Thread_local WorkPool *current_pool;
+static _Thread_local int current_worker;
+
+static int deque_push(WorkDeque *deque, WorkItem item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity ? deque->capacity * 2 : WORK_DEQUE_INITIAL_SIZE;
+        WorkItem *items = av_malloc_array(capacity, sizeof(*items));
+
+        if (!items) {
+            pthread_mutex_unlock(&deque->lock);
+            return AVERROR(ENOMEM);
+        }
+        for (int i = 0; i < deque->count; i++)
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        av_free(deque->items);
+        deque->items = items;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = item;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/* the newest item, which is the one most likely still warm in the cache */
+static int deque_take(WorkDeque *deque, WorkItem *item)
+{
+    int taken = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *item = deque->items[(deque->head + --deque->count) % deque->capacity];
+        taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+/* the oldest item, the one its owner would get to last */
+static int deque_steal(WorkDeque *deque, WorkItem *item)
+{
+    int taken = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *item = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+static int find_work(WorkPool *pool, int worker, WorkItem *item)
+{
+    if (deque_take(&pool->deques[worker], item))
+        return 1;
+    for (int k = 1; k < pool->nb_workers; k++)
+        if (deque_steal(&pool->deques[(worker + k) % pool->nb_workers], item)) {
+            atomic_fetch_add(&pool->stolen, 1);
+            return 1;
+        }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    WorkDeque *deque = arg;
+    WorkPool *pool = deque->pool;
+    int worker = deque - pool->deques;
+    WorkItem item;
+
+    current_pool = pool;
+    current_worker = worker;
+
+    for (;;) {
+        if (find_work(pool, worker, &item)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            item.function(item.arg, worker);
+
+            pthread_mutex_lock(&pool->idle_lock);
+            if (--pool->unfinished == 0)
+                pthread_cond_broadcast(&pool->all_done);
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (!atomic_load(&pool->queued) && !pool->stopping)
+            pthread_cond_wait(&pool->work_available, &pool->idle_lock);
+        if (pool->stopping && !atomic_load(&pool->queued)) {
+            pthread_mutex_unlock(&pool->idle_lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+int work_pool_init(WorkPool *pool, int nb_workers)
+{
+    int ret;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->deques = av_mallocz_array(nb_workers, sizeof(*pool->deques));
+    pool->threads = av_mallocz_array(nb_workers, sizeof(*pool->threads));
+    if (!pool->deques || !pool->threads) {
+        av_freep(&pool->deques);
+        av_freep(&pool->threads);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+
+    for (int i = 0; i < nb_workers; i++) {
+        pool->deques[i].pool = pool;
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    for (int i = 0; i < nb_workers; i++) {
+        if ((ret = pthread_create(&pool->threads[i], NULL, worker_main, &pool->deques[i]))) {
+            /* the ones already running are stopped and joined like a full pool */
+            pool->nb_workers = i;
+            work_pool_destroy(pool);
+            return AVERROR(ret);
+        }
+        pool->nb_workers = i + 1;
+    }
+    return 0;
+}
+
+int work_pool_submit(WorkPool *pool, work_function function, void *arg)
+{
+    WorkItem item = { function, arg };
+    int deque = current_pool == pool ? current_worker
+                                     : atomic_fetch_add(&pool->next_deque, 1) % pool->nb_workers;
+    int ret;
+
+    /* counted first, so a wait cannot see the pool done before the item has run */
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->unfinished++;
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    if ((ret = deque_push(&pool->deques[deque], item)) < 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        if (--pool->unfinished == 0)
+            pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->idle_lock);
+        return ret;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+void work_pool_wait(WorkPool *pool)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    while (pool->unfinished > 0)
+        pthread_cond_wait(&pool->all_done, &pool->idle_lock);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void work_pool_destroy(WorkPool *pool)
+{
+    if (!pool->deques)
+        return;
+
+    work_pool_wait(pool);
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < pool->nb_workers; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->nb_workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        av_free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_cond_destroy(&pool->all_done);
+    av_freep(&pool->deques);
+    av_freep(&pool->threads);
+}
@@ -0,0 +1,57 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef void (*work_function)(void *arg, int worker);
+
+typedef struct WorkItem
+{
+    work_function function;
+    void *arg;
+} WorkItem;
+
+/* one worker's deque: the owner takes from the back, thieves from the front */
+typedef struct WorkDeque
+{
+    struct WorkPool *pool;  /* for the worker thread owning the deque */
+    WorkItem *items;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+} WorkDeque;
+
+/*
+ * Work-stealing thread pool. Every worker has its own deque and runs the
+ * newest item of it; a worker whose deque runs dry steals the oldest item of
+ * another one, so long items do not leave the rest of the pool waiting
+ * behind them. Submitting from a worker queues on that worker's own deque,
+ * from anywhere else round-robin. Idle workers sleep until work comes in.
+ */
+typedef struct WorkPool
+{
+    WorkDeque *deques;
+    pthread_t *threads;
+    int nb_workers;
+    atomic_uint next_deque;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+    atomic_int queued;      /* items sitting in a deque */
+    int unfinished;         /* queued or running, under idle_lock */
+    int stopping;
+
+    atomic_int_fast64_t stolen;
+} WorkPool;
+
+int work_pool_init(WorkPool *pool, int nb_workers);
+int work_pool_submit(WorkPool *pool, work_function function, void *arg);
+/* blocks until every submitted item has run */
+void work_pool_wait(WorkPool *pool);
+/* waits for the work left, then stops and joins the workers */
+void work_pool_destroy(WorkPool *pool);
+
+#endif